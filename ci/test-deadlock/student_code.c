@@ -0,0 +1,35 @@
+#include<pthread.h>
+#include "student_code.h"
+
+// locks mutex twice, and returns the result of the second lock
+int relock(pthread_mutex_t *mutex)
+{
+	pthread_mutex_lock(mutex);
+	int ret = pthread_mutex_lock(mutex);
+	if (ret == 0)
+		pthread_mutex_unlock(mutex);
+	pthread_mutex_unlock(mutex);
+	return ret;
+}
+
+// locks mutex twice, unlocks it once, and locks other while holding it
+int relock_then(pthread_mutex_t *mutex, pthread_mutex_t *other)
+{
+	pthread_mutex_lock(mutex);
+	pthread_mutex_lock(mutex);
+	pthread_mutex_unlock(mutex);
+	pthread_mutex_lock(other);
+	pthread_mutex_unlock(other);
+	pthread_mutex_unlock(mutex);
+	return 0;
+}
+
+// locks first, then second
+int lock_both(pthread_mutex_t *first, pthread_mutex_t *second)
+{
+	pthread_mutex_lock(first);
+	pthread_mutex_lock(second);
+	pthread_mutex_unlock(second);
+	pthread_mutex_unlock(first);
+	return 0;
+}
@@ -0,0 +1,5 @@
+#include <pthread.h>
+
+int relock(pthread_mutex_t *mutex);
+int relock_then(pthread_mutex_t *mutex, pthread_mutex_t *other);
+int lock_both(pthread_mutex_t *first, pthread_mutex_t *second);
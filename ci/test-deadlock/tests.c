@@ -0,0 +1,87 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <errno.h>
+#include "student_code.h"
+#include "CTester/CTester.h"
+
+pthread_mutex_t a = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t b = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t r = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+static void init_mutex(pthread_mutex_t *mutex, int type)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, type);
+	pthread_mutex_init(mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+void test_errorcheck() {
+	set_test_metadata("errorcheck", _("relocking an error checking mutex fails"), 1);
+
+	pthread_mutex_t mutex;
+	int ret = 0;
+
+	init_mutex(&mutex, PTHREAD_MUTEX_ERRORCHECK);
+	monitored.pthread_mutex_deadlock = true;
+	SANDBOX_BEGIN;
+	ret = relock(&mutex);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, EDEADLK);
+	pthread_mutex_destroy(&mutex);
+}
+
+void test_recursive() {
+	set_test_metadata("recursive", _("a recursive mutex can be relocked"), 1);
+
+	pthread_mutex_t mutex;
+	int ret = -1;
+
+	init_mutex(&mutex, PTHREAD_MUTEX_RECURSIVE);
+	monitored.pthread_mutex_deadlock = true;
+	SANDBOX_BEGIN;
+	ret = relock(&mutex);
+	lock_both(&mutex, &a);
+	lock_both(&b, &a);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, 0);
+	pthread_mutex_destroy(&mutex);
+}
+
+void test_recursive_order() {
+	set_test_metadata("held", _("a recursive mutex is held until its last unlock"), 1);
+
+	monitored.pthread_mutex_deadlock = true;
+	SANDBOX_BEGIN;
+	relock_then(&r, &a);
+	lock_both(&a, &r);
+	SANDBOX_END;
+}
+
+void test_normal() {
+	set_test_metadata("normal", _("relocking a normal mutex is a deadlock"), 1);
+
+	monitored.pthread_mutex_deadlock = true;
+	SANDBOX_BEGIN;
+	relock(&a);
+	SANDBOX_END;
+}
+
+void test_order() {
+	set_test_metadata("order", _("mutexes locked in opposite orders are reported"), 1);
+
+	monitored.pthread_mutex_deadlock = true;
+	SANDBOX_BEGIN;
+	lock_both(&a, &b);
+	lock_both(&b, &a);
+	SANDBOX_END;
+}
+
+int main(int argc,char** argv)
+{
+	BAN_FUNCS();
+	RUN(test_errorcheck, test_recursive, test_recursive_order, test_normal, test_order);
+}
@@ -0,0 +1,3 @@
+int repeat(int fd, const char *s, int n);
+int save(const char *path, const char *s, int n);
+int save_unchecked(const char *path, const char *s, int n);
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "student_code.h"
+#include "CTester/CTester.h"
+
+#define LINE "line\n"
+#define NB_LINES 20
+
+struct repeat_args {
+	int fd;
+	int ret;
+};
+
+static void run_repeat(void *arg)
+{
+	struct repeat_args *args = arg;
+	args->fd = open("out.txt", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	args->ret = repeat(args->fd, LINE, NB_LINES);
+}
+
+// the file contains exactly the lines written by this run
+static bool check_repeat(void *arg)
+{
+	struct repeat_args *args = arg;
+	size_t len;
+	const char *content = vfs_read_file("out.txt", &len);
+	bool ok = content != NULL && lseek(args->fd, 0, SEEK_CUR) == (off_t) len
+		&& len == args->ret * strlen(LINE);
+	for (size_t i = 0; ok && i < len; i += strlen(LINE))
+		ok = !memcmp(content + i, LINE, strlen(LINE));
+	close(args->fd);
+	return ok;
+}
+
+void test_explore_files() {
+	set_test_metadata("explore", _("the children of the explorer have their own files"), 1);
+
+	vfs_enable();
+	struct repeat_args args;
+
+	struct explore_t result;
+	monitored.malloc = true;
+	CU_ASSERT_EQUAL(explore_failures(run_repeat, check_repeat, &args, &result), 0);
+
+	CU_ASSERT_EQUAL(result.outcome, EXPLORE_OK);
+	CU_ASSERT_EQUAL(result.n, NB_LINES);
+	CU_ASSERT_EQUAL(explore_report(&result), 0);
+	CU_ASSERT_EQUAL(args.ret, NB_LINES);
+}
+
+struct save_args {
+	int (*save)(const char *path, const char *s, int n);
+	int ret;
+};
+
+static void run_save(void *arg)
+{
+	struct save_args *args = arg;
+	args->ret = args->save("saved.txt", LINE, NB_LINES);
+}
+
+// -1 without file, or the file contains the lines written
+static bool check_save(void *arg)
+{
+	struct save_args *args = arg;
+	size_t len;
+	const char *content = vfs_read_file("saved.txt", &len);
+	if (content == NULL)
+		return args->ret == -1;
+	bool ok = args->ret >= 0 && len == args->ret * strlen(LINE);
+	for (size_t i = 0; ok && i < len; i += strlen(LINE))
+		ok = !memcmp(content + i, LINE, strlen(LINE));
+	return ok;
+}
+
+void test_explore_calls() {
+	set_test_metadata("calls", _("the failures of open and write are those of the real calls"), 1);
+
+	vfs_enable();
+	struct save_args args = { .save = save };
+
+	struct explore_t result;
+	monitored.open = true;
+	monitored.write = true;
+	CU_ASSERT_EQUAL(explore_failures(run_save, check_save, &args, &result), 0);
+
+	CU_ASSERT_EQUAL(result.outcome, EXPLORE_OK);
+	CU_ASSERT_EQUAL(result.n, 1 + NB_LINES);
+	CU_ASSERT_EQUAL(explore_report(&result), 0);
+	CU_ASSERT_EQUAL(args.ret, NB_LINES);
+}
+
+void test_explore_unchecked() {
+	set_test_metadata("unchecked", _("a failure of open which is not handled is reported"), 1);
+
+	vfs_enable();
+	struct save_args args = { .save = save_unchecked };
+
+	struct explore_t result;
+	monitored.open = true;
+	monitored.write = true;
+	CU_ASSERT_EQUAL(explore_failures(run_save, check_save, &args, &result), 0);
+
+	CU_ASSERT_EQUAL(result.outcome, EXPLORE_OK);
+	CU_ASSERT_EQUAL(explore_report(&result), 1);
+	CU_ASSERT_EQUAL(result.points[0].outcome, EXPLORE_WRONG);
+}
+
+int main(int argc,char** argv)
+{
+	BAN_FUNCS();
+	RUN(test_explore_files, test_explore_calls, test_explore_unchecked);
+}
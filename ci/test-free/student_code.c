@@ -0,0 +1,28 @@
+#include<stdlib.h>
+#include "student_code.h"
+
+int *fill(int n)
+{
+	int *tab = malloc(n * sizeof(int));
+	if (tab == NULL)
+		return NULL;
+	for (int i = 0; i < n; i++)
+		tab[i] = i;
+	return tab;
+}
+
+void release(void *ptr)
+{
+	free(ptr);
+}
+
+void release_twice(void *ptr)
+{
+	release(ptr);
+	release(ptr);
+}
+
+int *grow(int *tab, int n)
+{
+	return realloc(tab, n * sizeof(int));
+}
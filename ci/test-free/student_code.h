@@ -0,0 +1,4 @@
+int *fill(int n);
+void release(void *ptr);
+void release_twice(void *ptr);
+int *grow(int *tab, int n);
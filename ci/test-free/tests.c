@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include "student_code.h"
+#include "CTester/CTester.h"
+
+#define NB_BLOCKS 5000
+
+void test_free() {
+	set_test_metadata("free", _("blocks freed once are not reported"), 1);
+
+	int *tab = fill(10);
+	int *other = NULL;
+
+	// free is not monitored, the freed blocks must still leave the log
+	monitored.malloc = true;
+	SANDBOX_BEGIN;
+	other = fill(10);
+	tab = grow(tab, 4);
+	tab = grow(tab, 100000);
+	release(tab);
+	release(other);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(stats.free.double_free, 0);
+	CU_ASSERT_EQUAL(stats.free.invalid_free, 0);
+	CU_ASSERT_EQUAL(malloc_allocated(), 0);
+}
+
+void test_double_free() {
+	set_test_metadata("double", _("a block freed twice is a double free"), 1);
+
+	int *tab = NULL;
+
+	monitored.malloc = true;
+	SANDBOX_BEGIN;
+	tab = fill(10);
+	release_twice(tab);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(stats.free.double_free, 1);
+}
+
+void test_realloc_free() {
+	set_test_metadata("moved", _("the old block of realloc cannot be freed"), 1);
+
+	int *tab = fill(10);
+	int *old = tab;
+
+	monitored.realloc = true;
+	SANDBOX_BEGIN;
+	tab = grow(tab, 100000);
+	release(old);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(stats.free.double_free, 1);
+	free(tab);
+}
+
+void test_evicted_free() {
+	set_test_metadata("evicted", _("a double free is detected after the quarantine"), 1);
+
+	int *tab[NB_BLOCKS];
+
+	monitored.malloc = true;
+	monitored.free = true;
+	SANDBOX_BEGIN;
+	for (int i = 0; i < NB_BLOCKS; i++)
+		tab[i] = fill(10);
+	for (int i = 0; i < NB_BLOCKS; i++)
+		release(tab[i]);
+	release(tab[0]);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(stats.free.double_free, 1);
+}
+
+void test_invalid_free() {
+	set_test_metadata("invalid", _("pointers not returned by malloc cannot be freed"), 1);
+
+	int local = 0;
+	int *tab = NULL;
+
+	monitored.malloc = true;
+	monitored.free = true;
+	SANDBOX_BEGIN;
+	tab = fill(10);
+	release(&local);
+	release(tab + 1);
+	release(tab);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(stats.free.invalid_free, 2);
+	CU_ASSERT_EQUAL(stats.free.double_free, 0);
+	CU_ASSERT_EQUAL(malloc_allocated(), 0);
+}
+
+void test_interior_free() {
+	set_test_metadata("interior", _("a pointer far inside a block cannot be freed"), 1);
+
+	int *tab = NULL;
+
+	monitored.malloc = true;
+	monitored.free = true;
+	SANDBOX_BEGIN;
+	tab = fill(100000);
+	release((char *) tab + 4096);
+	release(tab);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(stats.free.invalid_free, 1);
+	CU_ASSERT_EQUAL(malloc_allocated(), 0);
+}
+
+int main(int argc,char** argv)
+{
+	BAN_FUNCS();
+	RUN(test_free, test_double_free, test_realloc_free, test_evicted_free, test_invalid_free,
+	    test_interior_free);
+}
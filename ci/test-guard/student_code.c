@@ -0,0 +1,53 @@
+#include<stdlib.h>
+#include<string.h>
+#include<pthread.h>
+#include "student_code.h"
+
+// writes one int too many
+int overflow(int n)
+{
+	int *tab = malloc(n * sizeof(int));
+	if (tab == NULL)
+		return -1;
+	for (int i = 0; i <= n; i++)
+		tab[i] = i;
+	int ret = tab[0];
+	free(tab);
+	return ret;
+}
+
+int use_after_free(void)
+{
+	char *s = malloc(32);
+	if (s == NULL)
+		return -1;
+	// the compiler would refuse the use of s
+	char *volatile kept = s;
+	strcpy(s, "freed");
+	free(s);
+	return kept[0];
+}
+
+static void *alloc_free(void *arg)
+{
+	int n = *(int *) arg;
+	for (int i = 0; i < n; i++) {
+		char *p = malloc(24);
+		if (p == NULL)
+			return NULL;
+		memset(p, i, 24);
+		free(p);
+	}
+	return NULL;
+}
+
+// allocates and frees n blocks in each of the threads
+int churn(int threads, int n)
+{
+	pthread_t t[16];
+	for (int i = 0; i < threads; i++)
+		pthread_create(&t[i], NULL, alloc_free, &n);
+	for (int i = 0; i < threads; i++)
+		pthread_join(t[i], NULL);
+	return threads * n;
+}
@@ -0,0 +1,3 @@
+int overflow(int n);
+int use_after_free(void);
+int churn(int threads, int n);
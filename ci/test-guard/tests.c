@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include "student_code.h"
+#include "CTester/CTester.h"
+
+void test_overflow() {
+	set_test_metadata("overflow", _("an overflow of a guarded block is reported"), 1);
+
+	int ret = -1;
+
+	monitored.malloc = true;
+	monitored.free = true;
+	monitored.malloc_guard = true;
+	SANDBOX_BEGIN;
+	ret = overflow(4);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, -1);
+}
+
+void test_freed() {
+	set_test_metadata("freed", _("a use after free of a guarded block is reported"), 1);
+
+	int ret = -1;
+
+	monitored.malloc = true;
+	monitored.free = true;
+	monitored.malloc_guard = true;
+	SANDBOX_BEGIN;
+	ret = use_after_free();
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, -1);
+}
+
+void test_threads() {
+	set_test_metadata("threads", _("threads allocate guarded blocks concurrently"), 1);
+
+	int ret = 0;
+
+	monitored.malloc = true;
+	monitored.free = true;
+	monitored.malloc_guard = true;
+	SANDBOX_BEGIN;
+	ret = churn(8, 2000);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, 8 * 2000);
+	CU_ASSERT_EQUAL(stats.malloc.called, 8 * 2000);
+	CU_ASSERT_EQUAL(stats.free.called, 8 * 2000);
+	CU_ASSERT_EQUAL(stats.free.invalid_free, 0);
+	CU_ASSERT_EQUAL(malloc_allocated(), 0);
+}
+
+int main(int argc,char** argv)
+{
+	BAN_FUNCS();
+	RUN(test_overflow, test_freed, test_threads);
+}
@@ -0,0 +1,50 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<sys/mman.h>
+#include "student_code.h"
+
+struct node *build(int n)
+{
+	struct node *head = NULL;
+	for (int i = 0; i < n; i++) {
+		struct node *new = malloc(sizeof(struct node));
+		if (new == NULL)
+			return head;
+		new->value = i;
+		new->next = head;
+		head = new;
+	}
+	return head;
+}
+
+// frees the first n nodes of the list
+void destroy(struct node *head, int n)
+{
+	for (int i = 0; i < n && head != NULL; i++) {
+		struct node *next = head->next;
+		free(head);
+		head = next;
+	}
+}
+
+int *grow(int *tab, int n)
+{
+	return realloc(tab, n * sizeof(int));
+}
+
+// allocates n ints with mmap instead of malloc, NULL if it fails
+int *map_tab(int n)
+{
+	int *tab = mmap(NULL, n * sizeof(int), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (tab == MAP_FAILED)
+		return NULL;
+	for (int i = 0; i < n; i++)
+		tab[i] = i;
+	return tab;
+}
+
+void unmap_tab(int *tab, int n)
+{
+	munmap(tab, n * sizeof(int));
+}
@@ -0,0 +1,10 @@
+struct node {
+	int value;
+	struct node *next;
+};
+
+struct node *build(int n);
+void destroy(struct node *head, int n);
+int *grow(int *tab, int n);
+int *map_tab(int n);
+void unmap_tab(int *tab, int n);
@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "student_code.h"
+#include "CTester/CTester.h"
+
+#define NB_NODES 20000
+
+void test_build_destroy() {
+	set_test_metadata("list", _("allocations are tracked beyond the first thousand"), 1);
+
+	struct node *head = NULL;
+	struct node *last = NULL;
+
+	monitored.malloc = true;
+	monitored.free = true;
+	SANDBOX_BEGIN;
+	head = build(NB_NODES);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(stats.malloc.called, NB_NODES);
+	CU_ASSERT_EQUAL(malloc_allocated(), NB_NODES * sizeof(struct node));
+	CU_ASSERT_EQUAL(stats.memory.used, malloc_allocated());
+
+	last = head;
+	while (last != NULL && last->next != NULL)
+		last = last->next;
+	CU_ASSERT_TRUE(malloced(head));
+	CU_ASSERT_TRUE(malloced(last));
+	CU_ASSERT_TRUE(malloced(&last->next));
+
+	SANDBOX_BEGIN;
+	destroy(head, NB_NODES - 1);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(stats.free.called, NB_NODES - 1);
+	CU_ASSERT_EQUAL(malloc_allocated(), sizeof(struct node));
+	CU_ASSERT_EQUAL(stats.memory.used, sizeof(struct node));
+	CU_ASSERT_FALSE(malloced(head));
+	CU_ASSERT_TRUE(malloced(last));
+	free(last);
+}
+
+void test_realloc() {
+	set_test_metadata("grow", _("realloc moves the tracked block"), 1);
+
+	int *tab = NULL;
+
+	monitored.realloc = true;
+	monitored.free = true;
+	SANDBOX_BEGIN;
+	tab = grow(NULL, 4);
+	tab = grow(tab, 100000);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(stats.realloc.called, 2);
+	CU_ASSERT_TRUE(malloced(tab));
+	CU_ASSERT_TRUE(malloced(tab + 50000));
+	CU_ASSERT_FALSE(malloced(tab + 100000));
+	CU_ASSERT_EQUAL(malloc_allocated(), 100000 * sizeof(int));
+	CU_ASSERT_EQUAL(stats.memory.used, 100000 * sizeof(int));
+
+	SANDBOX_BEGIN;
+	free(tab);
+	SANDBOX_END;
+
+	CU_ASSERT_FALSE(malloced(tab));
+	CU_ASSERT_EQUAL(malloc_allocated(), 0);
+	CU_ASSERT_EQUAL(stats.memory.used, 0);
+}
+
+void test_budget() {
+	set_test_metadata("budget", _("allocations beyond the memory budget fail"), 1);
+
+	struct node *head = NULL;
+
+	monitored.malloc = true;
+	monitored.free = true;
+	failures.memory_budget = 100 * sizeof(struct node);
+	SANDBOX_BEGIN;
+	head = build(1000);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(stats.malloc.called, 101);
+	CU_ASSERT_EQUAL(stats.memory.over_budget, 1);
+	CU_ASSERT_EQUAL(stats.memory.used, 100 * sizeof(struct node));
+
+	SANDBOX_BEGIN;
+	destroy(head, 1000);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(stats.memory.used, 0);
+	CU_ASSERT_EQUAL(stats.memory.peak, 100 * sizeof(struct node));
+	CU_ASSERT_EQUAL(stats.memory.allocations, 100);
+	CU_ASSERT_EQUAL(stats.memory.frees, 100);
+}
+
+void test_schedule() {
+	set_test_metadata("schedule", _("the 5000th malloc fails"), 1);
+
+	struct node *head = NULL;
+
+	monitored.malloc = true;
+	monitored.free = true;
+	failures.malloc_schedule = FAIL_NTH(5000);
+	failures.malloc_ret = NULL;
+	SANDBOX_BEGIN;
+	head = build(NB_NODES);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(stats.malloc.called, 5000);
+	CU_ASSERT_EQUAL(stats.memory.used, 4999 * sizeof(struct node));
+
+	failures.malloc_schedule = FAIL_PROBABILITY(0.01, 42);
+	SANDBOX_BEGIN;
+	destroy(head, NB_NODES);
+	head = build(NB_NODES);
+	SANDBOX_END;
+
+	CU_ASSERT_TRUE(stats.malloc.called > 5000 + 10);
+	CU_ASSERT_TRUE(stats.malloc.called < 5000 + 1000);
+
+	SANDBOX_BEGIN;
+	destroy(head, NB_NODES);
+	SANDBOX_END;
+}
+
+void test_sites() {
+	set_test_metadata("sites", _("the leaks are summarized by callsite"), 1);
+
+	struct node *head = NULL;
+	int *tab = NULL;
+
+	monitored.malloc = true;
+	monitored.realloc = true;
+	SANDBOX_BEGIN;
+	head = build(10);
+	tab = grow(NULL, 100);
+	SANDBOX_END;
+
+	struct malloc_site_t sites[4];
+	CU_ASSERT_EQUAL(malloc_sites(sites, 4, true), 2);
+	CU_ASSERT_EQUAL(sites[0].live, 1);
+	CU_ASSERT_EQUAL(sites[0].live_bytes, 100 * sizeof(int));
+	CU_ASSERT_EQUAL(sites[1].live, 10);
+	CU_ASSERT_EQUAL(sites[1].live_bytes, 10 * sizeof(struct node));
+
+	char name[128];
+	malloc_site_name(sites[0].caller, name, sizeof(name));
+	CU_ASSERT_EQUAL(strncmp(name, "grow+", 5), 0);
+	malloc_site_name(sites[1].caller, name, sizeof(name));
+	CU_ASSERT_EQUAL(strncmp(name, "build+", 6), 0);
+	// not in a loaded object
+	malloc_site_name(&name, name, sizeof(name));
+	CU_ASSERT_EQUAL(strchr(name, '+'), NULL);
+
+	char msg[256];
+	CU_ASSERT_EQUAL(malloc_sites_summary(msg, sizeof(msg), 1, true), 1);
+	CU_ASSERT_TRUE(strstr(msg, "1 blocks (400 bytes) not freed") != NULL);
+
+	free(tab);
+	destroy(head, 10);
+}
+
+void test_mmap() {
+	set_test_metadata("mmap", _("anonymous mappings are counted even if mmap is not monitored"), 1);
+
+	int *tab = NULL;
+
+	SANDBOX_BEGIN;
+	tab = map_tab(4096);
+	SANDBOX_END;
+
+	CU_ASSERT_TRUE(tab != NULL);
+	CU_ASSERT_EQUAL(stats.mmap.called, 0);
+	CU_ASSERT_EQUAL(stats.memory.used, 4096 * sizeof(int));
+	CU_ASSERT_EQUAL(stats.memory.allocations, 1);
+
+	SANDBOX_BEGIN;
+	unmap_tab(tab, 4096);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(stats.memory.used, 0);
+	CU_ASSERT_EQUAL(stats.memory.peak, 4096 * sizeof(int));
+
+	// an injected failure returns MAP_FAILED with ENOMEM
+	monitored.mmap = true;
+	failures.mmap = FAIL_FIRST;
+	int err = 0;
+	SANDBOX_BEGIN;
+	tab = map_tab(4096);
+	err = errno;
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(tab, NULL);
+	CU_ASSERT_EQUAL(stats.mmap.called, 1);
+	CU_ASSERT_EQUAL(stats.mmap.last_return, MAP_FAILED);
+	CU_ASSERT_EQUAL(err, ENOMEM);
+}
+
+void test_mmap_budget() {
+	set_test_metadata("mmap_budget", _("anonymous mappings beyond the memory budget fail"), 1);
+
+	int *tab = NULL;
+
+	failures.memory_budget = 1024 * sizeof(int);
+	SANDBOX_BEGIN;
+	tab = map_tab(4096);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(tab, NULL);
+	CU_ASSERT_EQUAL(stats.memory.over_budget, 1);
+	CU_ASSERT_EQUAL(stats.memory.used, 0);
+}
+
+int main(int argc,char** argv)
+{
+	BAN_FUNCS();
+	RUN(test_build_destroy, test_realloc, test_budget, test_schedule, test_sites, test_mmap, test_mmap_budget);
+}
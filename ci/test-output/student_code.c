@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "student_code.h"
+
+void chatter(void)
+{
+	for (;;)
+		write(STDOUT_FILENO, "spam\n", 5);
+}
+
+void hello(void)
+{
+	printf("hello\n");
+}
+
+long flood(void)
+{
+	char buf[500];
+	memset(buf, 'x', sizeof(buf));
+	long total = 0;
+	while (total < (64L << 20)) {
+		ssize_t n = write(STDOUT_FILENO, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+		total += n;
+	}
+	return total;
+}
@@ -0,0 +1,3 @@
+void chatter(void);
+void hello(void);
+long flood(void);
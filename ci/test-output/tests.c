@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "student_code.h"
+#include "CTester/CTester.h"
+
+void test_unbounded() {
+	set_test_metadata("unbounded", _("an output without end stops at the limit"), 1);
+
+	size_t len = 0;
+
+	sandbox_output_limit = 1000;
+	SANDBOX_BEGIN_TIMEOUT(200);
+	chatter();
+	SANDBOX_END;
+
+	const char *out = sandbox_stdout(&len);
+	if (len != 1000 || out == NULL || strncmp(out, "spam\nspam\n", 10) != 0)
+		push_info_msg(_("The output was not cut at the limit."));
+}
+
+void test_refused() {
+	set_test_metadata("refused", _("the writes past the limit fail during the run"), 1);
+
+	long written = 0;
+	size_t len = 0;
+
+	sandbox_output_limit = 1000;
+	SANDBOX_BEGIN;
+	written = flood();
+	SANDBOX_END;
+
+	// the memfd is sealed at the limit rounded up to a page
+	CU_ASSERT_TRUE(written >= 1000 && written <= sysconf(_SC_PAGESIZE));
+	sandbox_stdout(&len);
+	CU_ASSERT_EQUAL(len, 1000);
+}
+
+void test_after() {
+	set_test_metadata("after", _("the next sandboxes print normally"), 1);
+
+	size_t len = 0;
+
+	sandbox_output_limit = 1000;
+	SANDBOX_BEGIN;
+	hello();
+	SANDBOX_END;
+	const char *out = sandbox_stdout(&len);
+	CU_ASSERT_EQUAL(len, 6);
+	CU_ASSERT_TRUE(out != NULL && strncmp(out, "hello\n", 6) == 0);
+
+	sandbox_output_limit = 0;
+	SANDBOX_BEGIN;
+	hello();
+	hello();
+	SANDBOX_END;
+	out = sandbox_stdout(&len);
+	CU_ASSERT_EQUAL(len, 12);
+	CU_ASSERT_TRUE(out != NULL && strncmp(out, "hello\nhello\n", 12) == 0);
+}
+
+int main(int argc,char** argv)
+{
+	BAN_FUNCS();
+	RUN(test_unbounded, test_refused, test_after);
+}
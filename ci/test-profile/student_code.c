@@ -0,0 +1,35 @@
+#include<unistd.h>
+#include<fcntl.h>
+#include "student_code.h"
+
+// reads the file by blocks of 4 bytes, with copies of the descriptor
+int read_shared(const char *path)
+{
+	char buf[4];
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	int copy = dup(fd);
+	int last = fcntl(copy, F_DUPFD, 20);
+	int total = 0;
+	total += read(fd, buf, sizeof(buf));
+	close(fd);
+	total += read(copy, buf, sizeof(buf));
+	dup2(last, copy);
+	total += read(copy, buf, sizeof(buf));
+	close(copy);
+	total += read(last, buf, sizeof(buf));
+	close(last);
+	return total;
+}
+
+ssize_t read_at(const char *path, off_t offset)
+{
+	char buf[4];
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ssize_t ret = pread(fd, buf, sizeof(buf), offset);
+	close(fd);
+	return ret;
+}
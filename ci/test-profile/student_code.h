@@ -0,0 +1,4 @@
+#include <sys/types.h>
+
+int read_shared(const char *path);
+ssize_t read_at(const char *path, off_t offset);
@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include <string.h>
+#include "student_code.h"
+#include "CTester/CTester.h"
+
+#define DATA "abcdefghijklmnop"
+
+void test_dup() {
+	set_test_metadata("dup", _("the copies of a descriptor share its profile"), 1);
+
+	int ret = -1;
+	struct file_profile_t total;
+
+	vfs_enable();
+	vfs_write_file("data.txt", DATA, strlen(DATA));
+	monitored.file_profile = true;
+	SANDBOX_BEGIN;
+	ret = read_shared("data.txt");
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, 16);
+	CU_ASSERT_EQUAL(logs.file.n, 1);
+	CU_ASSERT_EQUAL(file_profile_total("data.txt", &total), 1);
+	CU_ASSERT_EQUAL(total.read.calls, 4);
+	CU_ASSERT_EQUAL(total.read.bytes, 16);
+	CU_ASSERT_EQUAL(total.sequential, 4);
+	CU_ASSERT_EQUAL(total.random, 0);
+	struct file_profile_t *p = file_profile(logs.file.profiles[0].fd);
+	CU_ASSERT_TRUE(p != NULL && p->closed && p->descriptors == 0);
+}
+
+void test_pread() {
+	set_test_metadata("pread", _("pread returns and records the number of bytes"), 1);
+
+	ssize_t ret = -1;
+	struct file_profile_t total;
+
+	vfs_enable();
+	vfs_write_file("data.txt", DATA, strlen(DATA));
+	monitored.pread = true;
+	monitored.file_profile = true;
+	SANDBOX_BEGIN;
+	ret = read_at("data.txt", 14);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, 2);
+	CU_ASSERT_EQUAL(stats.pread.last_return, 2);
+	CU_ASSERT_EQUAL(sizeof(stats.pread.last_return), sizeof(ssize_t));
+	CU_ASSERT_EQUAL(file_profile_total("data.txt", &total), 1);
+	CU_ASSERT_EQUAL(total.read.bytes, 2);
+	CU_ASSERT_EQUAL(total.random, 1);
+}
+
+int main(int argc,char** argv)
+{
+	BAN_FUNCS();
+	RUN(test_dup, test_pread);
+}
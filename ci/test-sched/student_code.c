@@ -0,0 +1,78 @@
+#include<stdlib.h>
+#include<pthread.h>
+#include "student_code.h"
+
+#define STEPS 4
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int *order_of;
+static int steps;
+static int counter;
+
+// records the order in which the threads take the mutex
+static void *step(void *arg)
+{
+	for (int i = 0; i < STEPS; i++) {
+		pthread_mutex_lock(&mutex);
+		order_of[steps++] = *(int *) arg;
+		pthread_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+static int run_two(void *(*f)(void *))
+{
+	pthread_t threads[2];
+	int ids[2] = {0, 1};
+	for (int i = 0; i < 2; i++)
+		pthread_create(&threads[i], NULL, f, &ids[i]);
+	for (int i = 0; i < 2; i++)
+		pthread_join(threads[i], NULL);
+	return 0;
+}
+
+int trace(int *order)
+{
+	order_of = order;
+	steps = 0;
+	run_two(step);
+	return steps;
+}
+
+// reads and writes the counter in two critical sections, an update
+// can be lost in between
+static void *increment_racy(void *arg)
+{
+	pthread_mutex_lock(&mutex);
+	int value = counter;
+	pthread_mutex_unlock(&mutex);
+	pthread_mutex_lock(&mutex);
+	counter = value + 1;
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+static void *increment_locked(void *arg)
+{
+	pthread_mutex_lock(&mutex);
+	counter++;
+	pthread_mutex_unlock(&mutex);
+	pthread_mutex_lock(&mutex);
+	counter++;
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+int count_racy(void)
+{
+	counter = 0;
+	run_two(increment_racy);
+	return counter;
+}
+
+int count_locked(void)
+{
+	counter = 0;
+	run_two(increment_locked);
+	return counter;
+}
@@ -0,0 +1,3 @@
+int trace(int *order);
+int count_racy(void);
+int count_locked(void);
@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <string.h>
+#include "student_code.h"
+#include "CTester/CTester.h"
+
+#define STEPS 8
+
+void test_seed() {
+	set_test_metadata("seed", _("the same seed replays the same interleaving"), 1);
+
+	int first[STEPS], again[STEPS], other[STEPS];
+	int ret = 0;
+	bool differ = false;
+
+	schedule.enabled = true;
+	schedule.preemptions = -1;
+	schedule.seed = 42;
+	SANDBOX_BEGIN;
+	ret = trace(first);
+	SANDBOX_END;
+	CU_ASSERT_EQUAL(ret, STEPS);
+
+	for (int seed = 1; seed <= 20; seed++) {
+		schedule.seed = seed;
+		SANDBOX_BEGIN;
+		trace(other);
+		SANDBOX_END;
+		if (memcmp(first, other, sizeof(first)))
+			differ = true;
+	}
+	CU_ASSERT_TRUE(differ);
+
+	schedule.seed = 42;
+	SANDBOX_BEGIN;
+	ret = trace(again);
+	SANDBOX_END;
+	CU_ASSERT_EQUAL(ret, STEPS);
+	CU_ASSERT_EQUAL(memcmp(first, again, sizeof(first)), 0);
+	CU_ASSERT_EQUAL(schedule.last_seed, 42);
+}
+
+void test_racy() {
+	set_test_metadata("racy", _("the systematic exploration finds a lost update"), 1);
+
+	int ret = 0, lost = 0, runs = 0;
+
+	schedule.enabled = true;
+	schedule.systematic = true;
+	schedule.preemptions = 1;
+	while (!schedule.exhausted && runs < 1000) {
+		SANDBOX_BEGIN;
+		ret = count_racy();
+		SANDBOX_END;
+		runs++;
+		if (ret != 2)
+			lost++;
+	}
+	CU_ASSERT_TRUE(schedule.exhausted);
+	CU_ASSERT_EQUAL(schedule.runs, runs);
+	CU_ASSERT_TRUE(lost > 0);
+	CU_ASSERT_TRUE(lost < runs);
+}
+
+void test_locked() {
+	set_test_metadata("locked", _("every interleaving of correct code succeeds"), 1);
+
+	int ret = 0, wrong = 0, runs = 0;
+
+	schedule.enabled = true;
+	schedule.systematic = true;
+	schedule.preemptions = 2;
+	while (!schedule.exhausted && runs < 1000) {
+		SANDBOX_BEGIN;
+		ret = count_locked();
+		SANDBOX_END;
+		runs++;
+		if (ret != 4)
+			wrong++;
+	}
+	CU_ASSERT_TRUE(schedule.exhausted);
+	CU_ASSERT_TRUE(runs > 1);
+	CU_ASSERT_EQUAL(wrong, 0);
+}
+
+int main(int argc,char** argv)
+{
+	BAN_FUNCS();
+	RUN(test_seed, test_racy, test_locked);
+}
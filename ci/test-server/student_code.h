@@ -0,0 +1 @@
+int work(void);
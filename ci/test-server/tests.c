@@ -0,0 +1,17 @@
+#include <stdlib.h>
+#include "student_code.h"
+#include "CTester/CTester.h"
+
+// work is called outside of the sandbox: only the limits of the fork
+// server stop it
+void test_work() {
+	set_test_metadata("work", _("the limits of the fork server apply to the submissions"), 1);
+
+	CU_ASSERT_EQUAL(work(), 42);
+}
+
+int main(int argc,char** argv)
+{
+	BAN_FUNCS();
+	RUN(test_work);
+}
@@ -0,0 +1,66 @@
+#include<stdio.h>
+#include<unistd.h>
+#include "student_code.h"
+
+// writes text and waits until it is on the disk
+int save(const char *path, const char *text)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	fputs(text, f);
+	fflush(f);
+	int ret = fsync(fileno(f));
+	fclose(f);
+	return ret;
+}
+
+int append_fd(int fd, const char *text)
+{
+	FILE *f = fdopen(fd, "a");
+	if (f == NULL)
+		return -1;
+	fputs(text, f);
+	return fclose(f);
+}
+
+// sum of the numbers of the file, read from stdin
+int sum_stdin(const char *path)
+{
+	if (freopen(path, "r", stdin) == NULL)
+		return -1;
+	int sum = 0, n;
+	while (scanf("%d", &n) == 1)
+		sum += n;
+	return sum;
+}
+
+// sum of the numbers from 0 to n-1, through a temporary file
+int scratch(int n)
+{
+	FILE *f = tmpfile();
+	if (f == NULL)
+		return -1;
+	for (int i = 0; i < n; i++)
+		fprintf(f, "%d\n", i);
+	rewind(f);
+	int sum = 0, i;
+	while (fscanf(f, "%d", &i) == 1)
+		sum += i;
+	fclose(f);
+	return sum;
+}
+
+// writes text, and reads its first character with the same stream
+int reread(const char *path, const char *text)
+{
+	FILE *f = fopen(path, "w");
+	if (f == NULL)
+		return -1;
+	fputs(text, f);
+	if (freopen(path, "r", f) == NULL)
+		return -1;
+	int c = fgetc(f);
+	fclose(f);
+	return c;
+}
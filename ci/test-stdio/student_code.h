@@ -0,0 +1,5 @@
+int save(const char *path, const char *text);
+int append_fd(int fd, const char *text);
+int sum_stdin(const char *path);
+int scratch(int n);
+int reread(const char *path, const char *text);
@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "student_code.h"
+#include "CTester/CTester.h"
+
+void test_fileno() {
+	set_test_metadata("fileno", _("fileno gives the descriptor of a stream of fopen"), 1);
+
+	int ret = -1;
+	size_t len;
+
+	vfs_enable();
+	monitored.write = true;
+	monitored.fsync = true;
+	SANDBOX_BEGIN;
+	ret = save("out.txt", "hello");
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, 0);
+	CU_ASSERT_EQUAL(stats.write.called, 1);
+	CU_ASSERT_EQUAL(stats.fsync.called, 1);
+	CU_ASSERT_EQUAL(stats.fsync.last_params.fd, stats.write.last_params.fd);
+	const char *content = vfs_read_file("out.txt", &len);
+	CU_ASSERT_EQUAL(len, 5);
+	CU_ASSERT_TRUE(content != NULL && memcmp(content, "hello", len) == 0);
+}
+
+void test_fdopen() {
+	set_test_metadata("fdopen", _("the writes of a stream of fdopen are counted"), 1);
+
+	int ret = -1;
+	size_t len;
+
+	vfs_enable();
+	vfs_write_file("log.txt", "a", 1);
+	monitored.write = true;
+	monitored.fdopen = true;
+	SANDBOX_BEGIN;
+	ret = append_fd(open("log.txt", O_WRONLY), "bc");
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, 0);
+	CU_ASSERT_EQUAL(stats.fdopen.called, 1);
+	CU_ASSERT_EQUAL(stats.write.called, 1);
+	const char *content = vfs_read_file("log.txt", &len);
+	CU_ASSERT_EQUAL(len, 3);
+	CU_ASSERT_TRUE(content != NULL && memcmp(content, "abc", len) == 0);
+}
+
+void test_freopen() {
+	set_test_metadata("freopen", _("freopen opens the files in memory"), 1);
+
+	int ret = -1;
+
+	vfs_enable();
+	vfs_write_file("in.txt", "1 2 3\n", 6);
+	monitored.open = true;
+	SANDBOX_BEGIN;
+	ret = sum_stdin("in.txt");
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, 6);
+	CU_ASSERT_EQUAL(stats.open.called, 1);
+	CU_ASSERT_EQUAL(access("in.txt", F_OK), -1);
+}
+
+void test_reopen() {
+	set_test_metadata("reopen", _("a stream of fopen can be reopened"), 1);
+
+	int ret = -1;
+
+	vfs_enable();
+	monitored.write = true;
+	monitored.read = true;
+	SANDBOX_BEGIN;
+	ret = reread("out.txt", "xyz");
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, 'x');
+	CU_ASSERT_EQUAL(stats.write.called, 1);
+	CU_ASSERT_EQUAL(stats.read.called, 1);
+}
+
+void test_tmpfile() {
+	set_test_metadata("tmpfile", _("the I/O of a temporary file is counted"), 1);
+
+	int ret = -1;
+
+	monitored.read = true;
+	monitored.write = true;
+	monitored.tmpfile = true;
+	SANDBOX_BEGIN;
+	ret = scratch(100);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, 100 * 99 / 2);
+	CU_ASSERT_EQUAL(stats.tmpfile.called, 1);
+	CU_ASSERT_TRUE(stats.write.called > 0);
+	CU_ASSERT_TRUE(stats.read.called > 0);
+}
+
+int main(int argc,char** argv)
+{
+	BAN_FUNCS();
+	RUN(test_fileno, test_fdopen, test_freopen, test_reopen, test_tmpfile);
+}
@@ -0,0 +1,144 @@
+#include<stdlib.h>
+#include<pthread.h>
+#include<unistd.h>
+#include "student_code.h"
+
+// never ends, and allocates memory all the time
+static void *churn(void *arg)
+{
+	for (;;) {
+		void *ptr = malloc(64);
+		free(ptr);
+	}
+	return NULL;
+}
+
+int spawn(void)
+{
+	pthread_t thread;
+	return pthread_create(&thread, NULL, churn, NULL);
+}
+
+// allocates ten blocks
+static void *alloc_ten(void *arg)
+{
+	for (int i = 0; i < 10; i++)
+		free(malloc(16));
+	return NULL;
+}
+
+// runs n threads, one after the other
+int spawn_joined(int n)
+{
+	for (int i = 0; i < n; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, alloc_ten, NULL))
+			return i;
+		pthread_join(thread, NULL);
+	}
+	return n;
+}
+
+int sum(int n)
+{
+	int *tab = malloc(n * sizeof(int));
+	if (tab == NULL)
+		return -1;
+	int s = 0;
+	for (int i = 0; i < n; i++) {
+		tab[i] = i;
+		s += tab[i];
+	}
+	free(tab);
+	return s;
+}
+
+static pthread_mutex_t flag_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flag_cond = PTHREAD_COND_INITIALIZER;
+static int flag;
+
+// raises the flag after 100 ms, without locking the mutex, so that the
+// only intervals during which it is held are those of wait_flag
+static void *raise_flag(void *arg)
+{
+	usleep(100000);
+	__atomic_store_n(&flag, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&flag_cond);
+	return NULL;
+}
+
+// waits on a condition variable until another thread raises the flag
+int wait_flag(void)
+{
+	pthread_t thread;
+	flag = 0;
+	if (pthread_create(&thread, NULL, raise_flag, NULL))
+		return -1;
+	pthread_mutex_lock(&flag_mutex);
+	while (!__atomic_load_n(&flag, __ATOMIC_ACQUIRE))
+		pthread_cond_wait(&flag_cond, &flag_mutex);
+	pthread_mutex_unlock(&flag_mutex);
+	pthread_join(thread, NULL);
+	return flag;
+}
+
+pthread_mutex_t *flag_lock(void)
+{
+	return &flag_mutex;
+}
+
+// recurses until the stack of the thread overflows
+static int deep(int n)
+{
+	volatile char buf[1024];
+	buf[0] = n;
+	if (n < 0)
+		return 0;
+	return deep(n + 1) + buf[0];
+}
+
+static void *overflow(void *arg)
+{
+	deep(1);
+	return NULL;
+}
+
+int spawn_overflow(void)
+{
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, overflow, NULL))
+		return -1;
+	return pthread_join(thread, NULL);
+}
+
+static pthread_mutex_t counter_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// increments the counter under a mutex, returns the error of the lock
+int locked_incr(int *counter)
+{
+	int err = pthread_mutex_lock(&counter_mutex);
+	if (err)
+		return err;
+	(*counter)++;
+	pthread_mutex_unlock(&counter_mutex);
+	return 0;
+}
+
+int trylocked_incr(int *counter)
+{
+	int err = pthread_mutex_trylock(&counter_mutex);
+	if (err)
+		return err;
+	(*counter)++;
+	pthread_mutex_unlock(&counter_mutex);
+	return 0;
+}
+
+int make_mutex(void)
+{
+	pthread_mutex_t mutex;
+	int err = pthread_mutex_init(&mutex, NULL);
+	if (!err)
+		pthread_mutex_destroy(&mutex);
+	return err;
+}
@@ -0,0 +1,11 @@
+#include <pthread.h>
+
+int spawn(void);
+int spawn_joined(int n);
+int sum(int n);
+int wait_flag(void);
+pthread_mutex_t *flag_lock(void);
+int spawn_overflow(void);
+int locked_incr(int *counter);
+int trylocked_incr(int *counter);
+int make_mutex(void);
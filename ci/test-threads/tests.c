@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <errno.h>
+#include "student_code.h"
+#include "CTester/CTester.h"
+
+void test_stats() {
+	set_test_metadata("stats", _("the statistics of the threads are added"), 1);
+
+	int ret = 0;
+
+	monitored.malloc = true;
+	monitored.free = true;
+	SANDBOX_BEGIN;
+	ret = spawn_joined(100);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, 100);
+	CU_ASSERT_EQUAL(stats.threads.created, 100);
+	CU_ASSERT_EQUAL(stats.malloc.called, 1000);
+	CU_ASSERT_EQUAL(stats.free.called, 1000);
+	CU_ASSERT_EQUAL(stats.malloc.last_params.size, 16);
+}
+
+void test_leak() {
+	set_test_metadata("leak", _("a thread left running is reported"), 1);
+
+	int ret = -1;
+
+	monitored.malloc = true;
+	monitored.free = true;
+	SANDBOX_BEGIN;
+	ret = spawn();
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, 0);
+	CU_ASSERT_EQUAL(stats.threads.created, 1);
+	CU_ASSERT_EQUAL(stats.threads.leaked, 1);
+}
+
+void test_after() {
+	set_test_metadata("after", _("the next tests are not disturbed by the thread"), 1);
+
+	int ret = 0;
+
+	monitored.malloc = true;
+	monitored.free = true;
+	SANDBOX_BEGIN;
+	ret = sum(1000);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, 1000 * 999 / 2);
+	CU_ASSERT_EQUAL(stats.malloc.called, 1);
+	CU_ASSERT_EQUAL(stats.threads.leaked, 0);
+	CU_ASSERT_EQUAL(malloc_allocated(), 0);
+}
+
+void test_cond_hold() {
+	set_test_metadata("cond_hold", _("the wait on a condition variable is not held time"), 1);
+
+	int ret = 0;
+
+	monitored.pthread_mutex_profile = true;
+	SANDBOX_BEGIN;
+	ret = wait_flag();
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, 1);
+	struct mutex_profile_t *p = mutex_profile(flag_lock());
+	CU_ASSERT_TRUE(p != NULL);
+	// the flag is raised after 100 ms, the mutex is held much less
+	if (p != NULL) {
+		CU_ASSERT_EQUAL(p->acquisitions, 1);
+		CU_ASSERT_TRUE(p->hold_ns < 50000000);
+	}
+}
+
+void test_overflow() {
+	set_test_metadata("overflow", _("a stack overflow in a thread is reported"), 1);
+
+	SANDBOX_BEGIN;
+	spawn_overflow();
+	SANDBOX_END;
+}
+
+void test_mutex_fail() {
+	set_test_metadata("mutex_fail", _("the mutex functions fail with their own errors"), 1);
+
+	int counter = 0;
+	int lock[5], trylock[4], init[2];
+
+	monitored.pthread_mutex_lock = true;
+	monitored.pthread_mutex_trylock = true;
+	monitored.pthread_mutex_init = true;
+	failures.pthread_mutex_lock_schedule = FAIL_NTH(3);
+	failures.pthread_mutex_trylock_schedule = FAIL_EVERY(2);
+	failures.pthread_mutex_init = FAIL_FIRST;
+	SANDBOX_BEGIN;
+	for (int i = 0; i < 5; i++)
+		lock[i] = locked_incr(&counter);
+	for (int i = 0; i < 4; i++)
+		trylock[i] = trylocked_incr(&counter);
+	for (int i = 0; i < 2; i++)
+		init[i] = make_mutex();
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(lock[1], 0);
+	CU_ASSERT_EQUAL(lock[2], EAGAIN);
+	CU_ASSERT_EQUAL(trylock[0], 0);
+	CU_ASSERT_EQUAL(trylock[1], EBUSY);
+	CU_ASSERT_EQUAL(trylock[3], EBUSY);
+	CU_ASSERT_EQUAL(init[0], ENOMEM);
+	CU_ASSERT_EQUAL(init[1], 0);
+	CU_ASSERT_EQUAL(counter, 6);
+	CU_ASSERT_EQUAL(stats.pthread_mutex_lock.last_return, 0);
+	CU_ASSERT_EQUAL(stats.pthread_mutex_trylock.last_return, EBUSY);
+}
+
+int main(int argc,char** argv)
+{
+	BAN_FUNCS();
+	RUN(test_stats, test_leak, test_after, test_cond_hold, test_overflow,
+	    test_mutex_fail);
+}
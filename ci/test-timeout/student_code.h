@@ -0,0 +1 @@
+unsigned long spin(unsigned long n);
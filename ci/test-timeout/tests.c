@@ -0,0 +1,34 @@
+#include <stdlib.h>
+#include "student_code.h"
+#include "CTester/CTester.h"
+
+void test_quick() {
+	set_test_metadata("quick", _("a limit in microseconds lets quick code finish"), 1);
+
+	unsigned long ret = 0;
+
+	SANDBOX_BEGIN_TIMEOUT_US(200000);
+	ret = spin(1000);
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, 499500);
+	CU_ASSERT_EQUAL(stats.sandbox.timeout_us, 200000);
+}
+
+void test_spin() {
+	set_test_metadata("spin", _("a limit below the millisecond stops an infinite loop"), 1);
+
+	SANDBOX_BEGIN_TIMEOUT_US(500);
+	spin(0);
+	SANDBOX_END;
+
+	// stopped long before the old granularity of the millisecond
+	if (stats.sandbox.cpu_time > 50000000)
+		push_info_msg(_("The loop was not stopped in time."));
+}
+
+int main(int argc,char** argv)
+{
+	BAN_FUNCS();
+	RUN(test_quick, test_spin);
+}
@@ -0,0 +1,17 @@
+#include "student_code.h"
+
+size_t count_zeros(const char *buf, size_t n)
+{
+	size_t zeros = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (buf[i] == 0)
+			zeros++;
+	}
+	return zeros;
+}
+
+void fill(char *buf, size_t n, char c)
+{
+	for (size_t i = 0; i < n; i++)
+		buf[i] = c;
+}
@@ -0,0 +1,4 @@
+#include <stddef.h>
+
+size_t count_zeros(const char *buf, size_t n);
+void fill(char *buf, size_t n, char c);
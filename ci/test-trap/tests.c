@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "student_code.h"
+#include "CTester/CTester.h"
+
+#define SIZE 100
+
+void test_reuse() {
+	set_test_metadata("reuse", _("a reused buffer starts zeroed"), 1);
+
+	size_t zeros = 0;
+
+	char *first = trap_buffer(SIZE, TRAP_RIGHT, PROT_READ | PROT_WRITE, NULL);
+	CU_ASSERT_TRUE(first != NULL);
+	SANDBOX_BEGIN;
+	fill(first, SIZE, 'x');
+	SANDBOX_END;
+	CU_ASSERT_EQUAL(free_trap(first, SIZE), 0);
+
+	char *again = trap_buffer(SIZE, TRAP_RIGHT, PROT_READ | PROT_WRITE, NULL);
+	CU_ASSERT_TRUE(again == first);
+	SANDBOX_BEGIN;
+	zeros = count_zeros(again, SIZE);
+	SANDBOX_END;
+	CU_ASSERT_EQUAL(zeros, SIZE);
+	CU_ASSERT_EQUAL(free_trap(again, SIZE), 0);
+
+	errno = 0;
+	CU_ASSERT_EQUAL(free_trap(again, SIZE), -1);
+	CU_ASSERT_EQUAL(errno, EINVAL);
+}
+
+void test_large() {
+	set_test_metadata("large", _("a large buffer has its own mapping"), 1);
+
+	size_t size = 200 * getpagesize();
+	size_t zeros = 0;
+
+	char *buf = trap_buffer(size, TRAP_LEFT, PROT_READ | PROT_WRITE, NULL);
+	CU_ASSERT_TRUE(buf != NULL);
+	SANDBOX_BEGIN;
+	zeros = count_zeros(buf, size);
+	SANDBOX_END;
+	CU_ASSERT_EQUAL(zeros, size);
+	CU_ASSERT_EQUAL(free_trap(buf, size), 0);
+
+	// the mapping is gone, its header must not be read
+	errno = 0;
+	CU_ASSERT_EQUAL(free_trap(buf, size), -1);
+	CU_ASSERT_EQUAL(errno, EINVAL);
+}
+
+void test_invalid() {
+	set_test_metadata("invalid", _("a pointer which is not a buffer is refused"), 1);
+
+	int local = 0;
+	char *block = malloc(SIZE);
+
+	errno = 0;
+	CU_ASSERT_EQUAL(free_trap(block, SIZE), -1);
+	CU_ASSERT_EQUAL(errno, EINVAL);
+	errno = 0;
+	CU_ASSERT_EQUAL(free_trap(&local, sizeof(local)), -1);
+	CU_ASSERT_EQUAL(errno, EINVAL);
+	errno = 0;
+	CU_ASSERT_EQUAL(free_trap((void *) (uintptr_t) getpagesize(), SIZE), -1);
+	CU_ASSERT_EQUAL(errno, EINVAL);
+	free(block);
+}
+
+int main(int argc,char** argv)
+{
+	BAN_FUNCS();
+	RUN(test_reuse, test_large, test_invalid);
+}
@@ -0,0 +1,64 @@
+#include<unistd.h>
+#include<fcntl.h>
+#include<string.h>
+#include "student_code.h"
+
+int copy_file(const char *src, const char *dst)
+{
+	int in = open(src, O_RDONLY);
+	if (in < 0)
+		return -1;
+	int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+	if (out < 0) {
+		close(in);
+		return -1;
+	}
+	char buf[64];
+	ssize_t n;
+	while ((n = read(in, buf, sizeof(buf))) > 0) {
+		if (write(out, buf, n) != n)
+			n = -1;
+		if (n < 0)
+			break;
+	}
+	close(in);
+	close(out);
+	return n < 0 ? -1 : 0;
+}
+
+// writes msg with two descriptors of the same file, returns the second
+int log_twice(const char *path, const char *msg)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -1;
+	int copy = fcntl(fd, F_DUPFD, 10);
+	if (copy < 0) {
+		close(fd);
+		return -1;
+	}
+	int last = dup2(copy, copy + 1);
+	write(fd, msg, strlen(msg));
+	write(copy, msg, strlen(msg));
+	write(last, msg, strlen(msg));
+	close(fd);
+	close(copy);
+	close(last);
+	return copy;
+}
+
+// opens path and adds O_APPEND to its flags, returns the flags read back
+int append_flags(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0)
+		return -1;
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_APPEND) < 0) {
+		close(fd);
+		return -1;
+	}
+	flags = fcntl(fd, F_GETFL);
+	close(fd);
+	return flags;
+}
@@ -0,0 +1,3 @@
+int copy_file(const char *src, const char *dst);
+int log_twice(const char *path, const char *msg);
+int append_flags(const char *path);
@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "student_code.h"
+#include "CTester/CTester.h"
+
+#define DATA "the content of the file, longer than a buffer of 64 bytes, to be copied"
+
+void test_copy() {
+	set_test_metadata("copy", _("a file is copied in memory, with the mode given to open"), 1);
+
+	int ret = -1;
+	struct stat st;
+	size_t len;
+
+	vfs_enable();
+	vfs_write_file("in.txt", DATA, strlen(DATA));
+	umask(027);
+	monitored.open = true;
+	monitored.stat = true;
+	SANDBOX_BEGIN;
+	ret = copy_file("in.txt", "./out.txt");
+	stat("out.txt", &st);
+	SANDBOX_END;
+	umask(022);
+
+	CU_ASSERT_EQUAL(ret, 0);
+	CU_ASSERT_EQUAL(stats.open.called, 2);
+	CU_ASSERT_EQUAL(st.st_mode, S_IFREG | 0640);
+	const char *content = vfs_read_file("out.txt", &len);
+	CU_ASSERT_EQUAL(len, strlen(DATA));
+	CU_ASSERT_TRUE(content != NULL && memcmp(content, DATA, len) == 0);
+	CU_ASSERT_EQUAL(access("out.txt", F_OK), -1);
+}
+
+void test_mode() {
+	set_test_metadata("mode", _("a file without permission cannot be opened"), 1);
+
+	int ret = 0, err = 0;
+
+	vfs_enable();
+	vfs_write_file("in.txt", DATA, strlen(DATA));
+	vfs_write_file("out.txt", "", 0);
+	vfs_chmod("out.txt", 0444);
+	SANDBOX_BEGIN;
+	ret = copy_file("in.txt", "out.txt");
+	err = errno;
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, -1);
+	CU_ASSERT_EQUAL(err, EACCES);
+
+	vfs_chmod("out.txt", 0644);
+	vfs_chmod("in.txt", 0200);
+	SANDBOX_BEGIN;
+	ret = copy_file("in.txt", "out.txt");
+	err = errno;
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, -1);
+	CU_ASSERT_EQUAL(err, EACCES);
+}
+
+void test_dup() {
+	set_test_metadata("dup", _("the descriptors of dup2 and fcntl share the offset"), 1);
+
+	int ret = -1;
+	size_t len;
+
+	vfs_enable();
+	monitored.dup2 = true;
+	monitored.fcntl = true;
+	SANDBOX_BEGIN;
+	ret = log_twice("log.txt", "abc");
+	SANDBOX_END;
+
+	CU_ASSERT_TRUE(ret >= 10);
+	CU_ASSERT_EQUAL(stats.fcntl.called, 1);
+	CU_ASSERT_EQUAL(stats.fcntl.last_params.cmd, F_DUPFD);
+	CU_ASSERT_EQUAL(stats.fcntl.last_params.arg, 10);
+	CU_ASSERT_EQUAL(stats.dup2.called, 1);
+	CU_ASSERT_EQUAL(stats.dup2.last_return, ret + 1);
+	const char *content = vfs_read_file("log.txt", &len);
+	CU_ASSERT_EQUAL(len, 9);
+	CU_ASSERT_TRUE(content != NULL && memcmp(content, "abcabcabc", len) == 0);
+}
+
+void test_fail() {
+	set_test_metadata("fail", _("a failure of fcntl is returned"), 1);
+
+	int ret = 0;
+
+	vfs_enable();
+	monitored.fcntl = true;
+	failures.fcntl = FAIL_FIRST;
+	failures.fcntl_ret = -1;
+	failures.fcntl_errno = EMFILE;
+	SANDBOX_BEGIN;
+	ret = log_twice("log.txt", "abc");
+	SANDBOX_END;
+
+	CU_ASSERT_EQUAL(ret, -1);
+	CU_ASSERT_EQUAL(stats.fcntl.called, 1);
+	CU_ASSERT_TRUE(vfs_exists("log.txt"));
+}
+
+void test_flags() {
+	set_test_metadata("flags", _("fcntl reads its argument only for the commands which take one"), 1);
+
+	int ret = -1;
+
+	vfs_enable();
+	monitored.fcntl = true;
+	SANDBOX_BEGIN;
+	ret = append_flags("flags.txt");
+	SANDBOX_END;
+
+	CU_ASSERT_TRUE(ret >= 0 && (ret & O_APPEND));
+	CU_ASSERT_EQUAL(stats.fcntl.called, 3);
+	CU_ASSERT_EQUAL(stats.fcntl.last_params.cmd, F_GETFL);
+	CU_ASSERT_EQUAL(stats.fcntl.last_params.arg, 0);
+}
+
+int main(int argc,char** argv)
+{
+	BAN_FUNCS();
+	RUN(test_copy, test_mode, test_dup, test_fail, test_flags);
+}
@@ -7,6 +7,17 @@
 #include <signal.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include <CUnit/CUnit.h>
 #include <CUnit/Basic.h>
@@ -19,6 +30,16 @@
 #include <malloc.h>
 
 #include "wrap.h"
+#include "vfs.h"
+#include "trap.h"
+#include "scale.h"
+
+// alternate stack of the SIGSEGV handler of the main thread, which
+// must run after a stack overflow
+#define SEGV_STACK_SIZE (64*1024)
+
+// maximal number of children running tests at a time, with --jobs
+#define JOBS_MAX 256
 
 #define TAGS_NB_MAX 20
 #define TAGS_LEN_MAX 30
@@ -28,24 +49,72 @@ extern struct wrap_stats_t stats;
 extern struct wrap_monitor_t monitored;
 extern struct wrap_fail_t failures;
 extern struct wrap_log_t logs;
+extern struct schedule_t schedule;
 
 extern sigjmp_buf segv_jmp;
 
+/* dup2 and fcntl are wrapped for the student's code */
+int __real_dup2(int oldfd, int newfd);
+int __real_fcntl(int fd, int cmd, ...);
+
 int true_stderr;
 int true_stdout;
-int pipe_stderr[2], usr_pipe_stderr[2];
-int pipe_stdout[2], usr_pipe_stdout[2];
 extern int stdout_cpy, stderr_cpy;
+extern size_t sandbox_output_limit;
+
+/*
+ * In the sandbox, stdout and stderr are redirected to memfds, which grow
+ * as needed, so that the student's code never blocks on a full pipe.
+ * After the sandbox, their content is mapped read-only and exposed
+ * without copy by sandbox_stdout() and sandbox_stderr(). stdout_cpy and
+ * stderr_cpy are read-only descriptors of the same files.
+ *
+ * With sandbox_output_limit, the memfd of a sandbox is given the size of
+ * the limit, rounded up to a page, and sealed against growing: the writes
+ * past it fail with EPERM during the run, and the output is never larger
+ * than the limit. As the size of the file is then fixed, the length of
+ * the output is the offset of its descriptor, shared with stdout and
+ * stderr. A sealed memfd cannot grow again, and is replaced by a new one
+ * at the next sandbox.
+ */
+struct capture_t {
+    int std;      // STDOUT_FILENO or STDERR_FILENO
+    int *cpy;     // stdout_cpy or stderr_cpy
+    int fd;       // memfd receiving the output in the sandbox
+    bool sealed;  // fd is sealed at the output limit
+    char *buf;    // output of the last sandbox, mapped read-only
+    size_t len;
+} captures[2] = {
+    { .std = STDOUT_FILENO, .cpy = &stdout_cpy, .fd = -1 },
+    { .std = STDERR_FILENO, .cpy = &stderr_cpy, .fd = -1 },
+};
+void capture_reset(struct capture_t *c, int i);
 struct itimerval it_val;
 
 CU_pSuite pSuite = NULL;
 
+void send_test_metadata();
+
 
 struct info_msg {
     char *msg;
     struct info_msg *next;
 };
 
+// resources used by the sandboxes of a test, measured with getrusage
+// and written in usage.txt
+struct sandbox_usage_t {
+    uint64_t utime;   // CPU time in user mode, in us
+    uint64_t stime;   // CPU time in the kernel, in us
+    uint64_t wall;    // elapsed time, in us
+    long maxrss;      // peak resident set size of the process at the end of the sandboxes, in KiB
+    long maxrss_growth; // growth of this peak during the sandboxes, in KiB
+    long minflt;      // page faults served without I/O
+    long majflt;      // page faults which required I/O
+    long nvcsw;       // voluntary context switches (blocking calls)
+    long nivcsw;      // involuntary context switches (preemptions)
+};
+
 struct __test_metadata {
     struct info_msg *fifo_in;
     struct info_msg *fifo_out;
@@ -54,6 +123,7 @@ struct __test_metadata {
     unsigned int weight;
     unsigned char nb_tags;
     char tags[TAGS_NB_MAX][TAGS_LEN_MAX];
+    struct sandbox_usage_t usage;
     int err;
 } test_metadata;
 
@@ -63,6 +133,7 @@ void set_test_metadata(char *problem, char *descr, unsigned int weight)
     test_metadata.weight = weight;
     strncpy(test_metadata.problem, problem, sizeof(test_metadata.problem));
     strncpy(test_metadata.descr, descr, sizeof(test_metadata.descr));
+    send_test_metadata();
 }
 
 void push_info_msg(char *msg)
@@ -104,16 +175,83 @@ void set_tag(char *tag)
         strncpy(test_metadata.tags[test_metadata.nb_tags++], tag, TAGS_LEN_MAX);
 }
 
-void segv_handler(int sig, siginfo_t *unused, void *unused2) {
+/*
+ * The signals are handled by the thread running the sandbox, which
+ * leaves it with siglongjmp. A thread created by the student's code
+ * which segfaults forwards the signal to the sandbox thread, and
+ * terminates. SIGALRM is blocked in these threads, but may still be
+ * received by another one.
+ */
+volatile sig_atomic_t thread_fault;
+// set when a handler leaves the sandbox with siglongjmp
+volatile sig_atomic_t sandbox_left;
+
+void segv_handler(int sig, siginfo_t *info, void *unused) {
+    if (thread_sandboxed()) {
+        if (wrap_monitoring && __atomic_exchange_n(&thread_fault, 1, __ATOMIC_ACQ_REL) == 0)
+            pthread_kill(sandbox_thread, SIGSEGV);
+        thread_exit();
+    }
     wrap_monitoring = false;
-    push_info_msg(_("Your code produced a segfault."));
+    if (thread_fault)
+        push_info_msg(_("A thread created by your code produced a segfault."));
+    else if (trap_fault(info->si_addr) == TRAP_FAULT_OUTSIDE)
+        push_info_msg(_("Your code produced a segfault, by accessing memory outside of a block allocated by malloc."));
+    else if (trap_fault(info->si_addr) == TRAP_FAULT_FREED)
+        push_info_msg(_("Your code produced a segfault, by accessing a block of memory after freeing it."));
+    else
+        push_info_msg(_("Your code produced a segfault."));
     set_tag("sigsegv");
     wrap_monitoring = true;
+    sandbox_left = 1;
     siglongjmp(segv_jmp, 1);
 }
 
+/*
+ * A deadlock detected by the mutex wrappers aborts the sandbox at once
+ * instead of waiting for the timeout. From another thread than the one
+ * running the sandbox, the message is left in deadlock_msg and SIGALRM
+ * is sent to the sandbox thread, whose handler reports it.
+ */
+char deadlock_msg[256];
+volatile sig_atomic_t deadlock_pending;
+
+void deadlock_report()
+{
+    wrap_monitoring = false;
+    push_info_msg(deadlock_msg);
+    set_tag("deadlock");
+    wrap_monitoring = true;
+}
+
+void sandbox_deadlock(const char *msg)
+{
+    if (__atomic_exchange_n(&deadlock_pending, 1, __ATOMIC_ACQ_REL) == 0)
+        snprintf(deadlock_msg, sizeof(deadlock_msg), "%s", msg);
+    if (pthread_equal(pthread_self(), sandbox_thread)) {
+        deadlock_report();
+        sandbox_left = 1;
+        siglongjmp(segv_jmp, 1);
+    }
+    if (wrap_monitoring)
+        pthread_kill(sandbox_thread, SIGALRM);
+}
+
 void alarm_handler(int sig, siginfo_t *unused, void *unused2)
 {
+    if (!pthread_equal(pthread_self(), sandbox_thread)) {
+        pthread_kill(sandbox_thread, SIGALRM);
+        return;
+    }
+    // the CPU and wall-clock timers may both expire before sandbox_end
+    // stops them, the sandbox is left only once
+    if (sandbox_left)
+        return;
+    sandbox_left = 1;
+    if (deadlock_pending) {
+        deadlock_report();
+        siglongjmp(segv_jmp, 1);
+    }
     wrap_monitoring = false;
     push_info_msg(_("Your code exceeded the maximal allowed execution time."));
     set_tag("timeout");
@@ -122,66 +260,270 @@ void alarm_handler(int sig, siginfo_t *unused, void *unused2)
 }
 
 
-int sandbox_begin()
+/*
+ * The time limit of a sandbox is enforced on the CPU time consumed by
+ * the process, with a POSIX timer on its CPU clock whose SIGALRM is
+ * delivered to the thread running the sandbox. As code which blocks
+ * (sleep, deadlock, ...) does not consume CPU time, the wall-clock time
+ * is also limited to SANDBOX_WALL_FACTOR times the limit.
+ */
+#define SANDBOX_TIMEOUT 2000000 // default limit, in us of CPU time
+#define SANDBOX_WALL_FACTOR 2
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+timer_t cpu_timer;
+pid_t cpu_timer_pid; // timers are not inherited by fork, see sandbox_begin
+struct timespec sandbox_cpu_start;
+struct timespec sandbox_wall_start;
+struct rusage sandbox_rusage_start;
+int sandbox_double_free, sandbox_invalid_free, sandbox_over_budget; // errors reported before the sandbox
+
+uint64_t timespec_ns(struct timespec *t)
 {
-    // Start timer
-    it_val.it_value.tv_sec = 2;
-    it_val.it_value.tv_usec = 0;
+    return (uint64_t) t->tv_sec * 1000000000 + t->tv_nsec;
+}
+
+uint64_t timeval_us(struct timeval *t)
+{
+    return (uint64_t) t->tv_sec * 1000000 + t->tv_usec;
+}
+
+// adds the resources used since sandbox_begin to the usage of the test.
+// The counters of getrusage cover all the threads of the process.
+void sandbox_usage_add()
+{
+    struct rusage end;
+    struct timespec wall_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    getrusage(RUSAGE_SELF, &end);
+    struct rusage *start = &sandbox_rusage_start;
+    struct sandbox_usage_t *u = &test_metadata.usage;
+    u->utime += timeval_us(&end.ru_utime) - timeval_us(&start->ru_utime);
+    u->stime += timeval_us(&end.ru_stime) - timeval_us(&start->ru_stime);
+    u->wall += (timespec_ns(&wall_end) - timespec_ns(&sandbox_wall_start)) / 1000;
+    // ru_maxrss is the peak of the process, it only grows
+    if (end.ru_maxrss > u->maxrss)
+        u->maxrss = end.ru_maxrss;
+    u->maxrss_growth += end.ru_maxrss - start->ru_maxrss;
+    u->minflt += end.ru_minflt - start->ru_minflt;
+    u->majflt += end.ru_majflt - start->ru_majflt;
+    u->nvcsw += end.ru_nvcsw - start->ru_nvcsw;
+    u->nivcsw += end.ru_nivcsw - start->ru_nivcsw;
+}
+
+void sandbox_start_timers(uint64_t us)
+{
+    if (cpu_timer_pid != getpid()) {
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = SIGALRM;
+        sev.sigev_notify_thread_id = syscall(SYS_gettid);
+        if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &cpu_timer) == 0)
+            cpu_timer_pid = getpid();
+    }
+    struct itimerspec cpu_val = {
+        .it_value.tv_sec = us / 1000000,
+        .it_value.tv_nsec = (us % 1000000) * 1000,
+    };
+    timer_settime(cpu_timer, 0, &cpu_val, NULL);
+
+    it_val.it_value.tv_sec = us * SANDBOX_WALL_FACTOR / 1000000;
+    it_val.it_value.tv_usec = us * SANDBOX_WALL_FACTOR % 1000000;
     it_val.it_interval.tv_sec = 0;
     it_val.it_interval.tv_usec = 0;
     setitimer(ITIMER_REAL, &it_val, NULL);
+}
 
-    // Intercepting stdout and stderr
-    dup2(pipe_stdout[1], STDOUT_FILENO);
-    dup2(pipe_stderr[1], STDERR_FILENO);
-    // Emptying the user pipes
-    char buf[BUFSIZ];
-    int n;
-    while ((n = read(usr_pipe_stdout[0], buf, BUFSIZ)) > 0);
-    while ((n = read(usr_pipe_stderr[0], buf, BUFSIZ)) > 0);
+/*
+ * Called in a child forked in the sandbox by the explorer of failures,
+ * which does not inherit the timers. Its output is dropped, and its
+ * files are not shared with the parent (see vfs_fork_child).
+ */
+void sandbox_fork_child()
+{
+    sandbox_start_timers(stats.sandbox.timeout_us);
+    bool monitoring = wrap_monitoring;
+    wrap_monitoring = false;
+    int null = open("/dev/null", O_WRONLY);
+    __real_dup2(null, STDOUT_FILENO);
+    __real_dup2(null, STDERR_FILENO);
+    close(null);
+    vfs_fork_child();
+    wrap_monitoring = monitoring;
+}
+
+int sandbox_begin_timeout_us(uint64_t us)
+{
+    sandbox_start_timers(us);
+
+    stats.sandbox.timeout_us = us;
+    sandbox_double_free = stats.free.double_free;
+    sandbox_invalid_free = stats.free.invalid_free;
+    sandbox_over_budget = stats.memory.over_budget;
+    stats_sandbox_thread();
+    mutex_graph_reset();
+    deadlock_pending = 0;
+    thread_fault = 0;
+    sandbox_left = 0;
+    threads_begin();
+    sched_begin();
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &sandbox_cpu_start);
+    getrusage(RUSAGE_SELF, &sandbox_rusage_start);
+    clock_gettime(CLOCK_MONOTONIC, &sandbox_wall_start);
+
+    // Intercepting stdout and stderr, and emptying the previous output
+    fflush(stdout);
+    fflush(stderr);
+    for (int i=0; i < 2; i++) {
+        struct capture_t *c = &captures[i];
+        if (c->buf != NULL)
+            munmap(c->buf, c->len);
+        c->buf = NULL;
+        c->len = 0;
+        capture_reset(c, i);
+        __real_dup2(c->fd, c->std);
+    }
 
     wrap_monitoring = true;
     return 0;
 }
 
+int sandbox_begin_timeout(unsigned int ms)
+{
+    return sandbox_begin_timeout_us((uint64_t) ms * 1000);
+}
+
+int sandbox_begin()
+{
+    return sandbox_begin_timeout_us(SANDBOX_TIMEOUT);
+}
+
 void sandbox_fail()
 {
     CU_FAIL("Segfault or timeout");
+    if (schedule.enabled) {
+        char msg[128];
+        if (schedule.systematic)
+            snprintf(msg, sizeof(msg), _("The threads were run with the interleaving %d."),
+                     schedule.runs);
+        else
+            snprintf(msg, sizeof(msg), _("The threads were run with the schedule %llu."),
+                     (unsigned long long) schedule.last_seed);
+        push_info_msg(msg);
+    }
 }
 
 void sandbox_end()
 {
     wrap_monitoring = false;
+    sched_end();
+    scale_end();
+    // Stopping the threads created by the student's code, and adding
+    // their statistics
+    int leaked = threads_reap();
+    stats.threads.leaked += leaked;
+    stats_merge();
+
+    // Stopping the timers
+    struct itimerspec cpu_val;
+    memset(&cpu_val, 0, sizeof(cpu_val));
+    timer_settime(cpu_timer, 0, &cpu_val, NULL);
+    it_val.it_value.tv_sec = 0;
+    it_val.it_value.tv_usec = 0;
+    it_val.it_interval.tv_sec = 0;
+    it_val.it_interval.tv_usec = 0;
+    setitimer(ITIMER_REAL, &it_val, NULL);
 
-    // Remapping stderr to the orignal one ...
-    dup2(true_stdout, STDOUT_FILENO); // TODO
-    dup2(true_stderr, STDERR_FILENO);
-
-    // ... and looking for a double free warning
-    char buf[BUFSIZ];
-    int n;
-    while ((n = read(pipe_stdout[0], buf, BUFSIZ)) > 0) {
-        write(usr_pipe_stdout[1], buf, n);
-        write(STDOUT_FILENO, buf, n);
+    struct timespec cpu_end;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    stats.sandbox.cpu_time = timespec_ns(&cpu_end) - timespec_ns(&sandbox_cpu_start);
+    stats.sandbox.total_cpu_time += stats.sandbox.cpu_time;
+    sandbox_usage_add();
+
+    // Remapping stdout and stderr to the original ones ...
+    fflush(stdout);
+    fflush(stderr);
+    __real_dup2(true_stdout, STDOUT_FILENO);
+    __real_dup2(true_stderr, STDERR_FILENO);
+    // the writes refused at the output limit leave an error on the streams
+    clearerr(stdout);
+    clearerr(stderr);
+
+    // ... mapping the captured output and forwarding it
+    for (int i=0; i < 2; i++) {
+        struct capture_t *c = &captures[i];
+        struct stat st;
+        if (c->sealed) {
+            off_t end = lseek(c->fd, 0, SEEK_CUR);
+            st.st_size = end < 0 ? 0 : end;
+            ftruncate(c->fd, st.st_size);
+        }
+        else if (fstat(c->fd, &st))
+            continue;
+        if (st.st_size == 0)
+            continue;
+        c->len = st.st_size;
+        if (sandbox_output_limit && c->len > sandbox_output_limit) {
+            c->len = sandbox_output_limit;
+            ftruncate(c->fd, c->len);
+        }
+        c->buf = mmap(NULL, c->len, PROT_READ, MAP_SHARED, c->fd, 0);
+        if (c->buf == MAP_FAILED) {
+            c->buf = NULL;
+            c->len = 0;
+            continue;
+        }
+        write(c->std, c->buf, c->len);
     }
 
+    // Reporting the double and invalid frees detected by the wrappers
+    if (stats.free.double_free > sandbox_double_free) {
+        CU_FAIL("Double free");
+        push_info_msg(_("Your code produced a double free."));
+        set_tag("double_free");
+    }
+    if (stats.free.invalid_free > sandbox_invalid_free) {
+        CU_FAIL("Invalid free");
+        push_info_msg(_("Your code called free on a pointer that was not returned by malloc."));
+        set_tag("invalid_free");
+    }
+    if (stats.memory.over_budget > sandbox_over_budget) {
+        CU_FAIL("Memory budget exceeded");
+        push_info_msg(_("Your code tried to allocate more memory than allowed."));
+        set_tag("memory");
+    }
+    if (leaked > 0) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), _("%d thread(s) created by your code were still running at the end of the test."), leaked);
+        push_info_msg(msg);
+    }
 
-    while ((n = read(pipe_stderr[0], buf, BUFSIZ)) > 0) {
-        if (strstr(buf, "double free or corruption") != NULL) {
-            CU_FAIL("Double free or corruption");
-            push_info_msg(_("Your code produced a double free."));
-            set_tag("double_free");
+    // stdout_cpy and stderr_cpy read the output from its beginning
+    for (int i=0; i < 2; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", captures[i].fd);
+        int fd = open(path, O_RDONLY | O_NONBLOCK);
+        if (fd >= 0) {
+            __real_dup2(fd, *captures[i].cpy);
+            close(fd);
         }
-        write(usr_pipe_stderr[1], buf, n);
-        write(STDERR_FILENO, buf, n);
     }
+}
 
+const char *sandbox_stdout(size_t *len)
+{
+    *len = captures[0].len;
+    return captures[0].buf;
+}
 
-    it_val.it_value.tv_sec = 0;
-    it_val.it_value.tv_usec = 0;
-    it_val.it_interval.tv_sec = 0;
-    it_val.it_interval.tv_usec = 0;
-    setitimer(ITIMER_REAL, &it_val, NULL);
+const char *sandbox_stderr(size_t *len)
+{
+    *len = captures[1].len;
+    return captures[1].buf;
 }
 
 
@@ -200,8 +542,14 @@ void start_test()
     bzero(&test_metadata,sizeof(test_metadata));
     bzero(&stats,sizeof(stats));
     bzero(&failures,sizeof(failures));
+    /* a failed mmap returns MAP_FAILED, not NULL */
+    failures.mmap_ret = MAP_FAILED;
+    failures.mmap_errno = ENOMEM;
     bzero(&monitored,sizeof(monitored));
+    bzero(&schedule,sizeof(schedule));
+    malloc_log_reset();
     bzero(&logs,sizeof(logs));
+    vfs_reset();
 }
 
 int __real_exit(int status);
@@ -209,80 +557,355 @@ int __wrap_exit(int status){
     return status;
 }
 
-int run_tests(int argc, char *argv[], void *tests[], int nb_tests) {
-    for (int i=1; i < argc; i++) {
-        if (!strncmp(argv[i], "LANGUAGE=", 9))
-                putenv(argv[i]);
+int capture_memfd(int i)
+{
+    return memfd_create(i == 0 ? "stdout" : "stderr", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+}
+
+void create_capture_files()
+{
+    for (int i=0; i < 2; i++) {
+        captures[i].fd = capture_memfd(i);
+        captures[i].sealed = false;
+        *captures[i].cpy = dup(captures[i].fd);
     }
-    setlocale (LC_ALL, "");
-    bindtextdomain("tests", getenv("PWD"));
-    bind_textdomain_codeset("messages", "UTF-8");
-    textdomain("tests");
+}
 
-    mallopt(M_PERTURB, 142); // newly allocated memory with malloc will be set to ~142
+/*
+ * Empties the output of the capture c for a new sandbox, and seals it at
+ * sandbox_output_limit if there is one. stdout_cpy and stderr_cpy keep
+ * the replaced memfd until the end of the sandbox.
+ */
+void capture_reset(struct capture_t *c, int i)
+{
+    if (c->sealed) {
+        int fd = capture_memfd(i);
+        if (fd >= 0) {
+            close(c->fd);
+            c->fd = fd;
+            c->sealed = false;
+        }
+    }
+    ftruncate(c->fd, 0);
+    lseek(c->fd, 0, SEEK_SET);
+    if (sandbox_output_limit && !c->sealed) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t size = (sandbox_output_limit + page - 1) / page * page;
+        if (ftruncate(c->fd, size) == 0 && __real_fcntl(c->fd, F_ADD_SEALS, F_SEAL_GROW) == 0)
+            c->sealed = true;
+        else
+            ftruncate(c->fd, 0);
+    }
+}
+
+void close_capture_files()
+{
+    for (int i=0; i < 2; i++) {
+        struct capture_t *c = &captures[i];
+        if (c->buf != NULL)
+            munmap(c->buf, c->len);
+        c->buf = NULL;
+        c->len = 0;
+        close(c->fd);
+        close(*c->cpy);
+    }
+}
 
-    // Code for detecting properly double free errors
-    mallopt(M_CHECK_ACTION, 1); // don't abort if double free
-    true_stderr = dup(STDERR_FILENO); // preparing a non-blocking pipe for stderr
-    true_stdout = dup(STDOUT_FILENO); // preparing a non-blocking pipe for stderr
+/*
+ * Writes the line of results.txt for the test that just ran, and
+ * empties the info messages queue. Its fields are separated by '#':
+ * problem, SUCCESS or FAIL, description, weight, tags and the messages.
+ */
+int write_test_result(FILE *f_out, int failed)
+{
+    int ret;
+    if (failed)
+        ret = fprintf(f_out, "%s#FAIL#%s#%d#", test_metadata.problem,
+                test_metadata.descr, test_metadata.weight);
+
+    else
+        ret = fprintf(f_out, "%s#SUCCESS#%s#%d#", test_metadata.problem,
+                test_metadata.descr, test_metadata.weight);
+    if (ret < 0)
+        return ret;
 
-    int *pipes[] = {pipe_stderr, pipe_stdout, usr_pipe_stdout, usr_pipe_stderr};
-    for(int i=0; i < 4; i++) { // Configuring pipes to be non-blocking
-        pipe(pipes[i]);
-        int flags = fcntl(pipes[i][0], F_GETFL, 0);
-        fcntl(pipes[i][0], F_SETFL, flags | O_NONBLOCK);
+    for(int i=0; i < test_metadata.nb_tags; i++) {
+        ret = fprintf(f_out, "%s", test_metadata.tags[i]);
+        if (ret < 0)
+            return ret;
+
+        if (i != test_metadata.nb_tags - 1) {
+            ret = fprintf(f_out, ",");
+            if (ret < 0)
+                return ret;
+        }
     }
-    stdout_cpy = usr_pipe_stdout[0];
-    stderr_cpy = usr_pipe_stderr[0];
 
-    putenv("LIBC_FATAL_STDERR_=2"); // needed otherwise libc doesn't print to program's stderr
+    while (test_metadata.fifo_in != NULL) {
+        struct info_msg *head = test_metadata.fifo_in;
+        ret = fprintf(f_out, "#%s", head->msg);
 
-    /* make sure that we catch segmentation faults */
-    struct sigaction sa;
+        if (head->msg != NULL)
+            free(head->msg);
+        test_metadata.fifo_in = head->next;
+        free(head);
 
-    memset(&sa, 0, sizeof(sigaction));
-    sigemptyset(&sa.sa_mask);
-    static char stack[SIGSTKSZ];
-    stack_t ss = {
-        .ss_size = SIGSTKSZ,
-        .ss_sp = stack,
-    };
+        if (ret < 0)
+            return ret;
+    }
 
-    sa.sa_flags     = SA_NODEFER|SA_ONSTACK|SA_RESTART;
-    sa.sa_sigaction = segv_handler;
-    sigaltstack(&ss, 0);
-    sigfillset(&sa.sa_mask);
-    int ret = sigaction(SIGSEGV, &sa, NULL);
-    if (ret)
-        return ret;
-    sa.sa_sigaction = alarm_handler;
-    ret = sigaction(SIGALRM, &sa, NULL);
-    if (ret)
+    test_metadata.fifo_out = NULL;
+    ret = fprintf(f_out, "\n");
+    if (ret < 0)
         return ret;
+    return 0;
+}
 
+/*
+ * Writes the line of usage.txt for the test that just ran, in the order
+ * of results.txt: problem, and the usage of the sandboxes as a list of
+ * name=value separated by ','.
+ */
+int write_test_usage(FILE *f_usage)
+{
+    struct sandbox_usage_t *u = &test_metadata.usage;
+    int ret = fprintf(f_usage, "%s#utime=%llu,stime=%llu,wall=%llu,maxrss=%ld,maxrss_growth=%ld,minflt=%ld,majflt=%ld,nvcsw=%ld,nivcsw=%ld\n",
+            test_metadata.problem, (unsigned long long) u->utime,
+            (unsigned long long) u->stime, (unsigned long long) u->wall,
+            u->maxrss, u->maxrss_growth, u->minflt, u->majflt, u->nvcsw,
+            u->nivcsw);
+    return ret < 0 ? ret : 0;
+}
 
-    /* Output file containing succeeded / failed tests */
-    FILE* f_out = fopen("results.txt", "w");
-    if (!f_out)
-        return -ENOENT;
+/*
+ * Parallel mode (--jobs N): each test runs in a forked child, at most N
+ * at a time. A child sends its metadata as soon as set_test_metadata is
+ * called ("M" record), then its line of usage.txt ("U" record) and its
+ * line of results.txt ("R" record, the last one) on the pipe. If the
+ * child dies before sending its results, the parent reports a failure
+ * for the test using the last metadata received.
+ */
+struct job_t {
+    pid_t pid;
+    int test;   // index of the test run by the child
+    int fd;     // read end of the pipe from the child
+    char *buf;  // records received from the child
+    size_t len;
+};
 
+int result_fd = -1; // write end of the pipe to the parent, in a child
 
-    /* initialize the CUnit test registry */
-    if (CUE_SUCCESS != CU_initialize_registry())
-        return CU_get_error();
+void send_test_metadata()
+{
+    if (result_fd < 0)
+        return;
+    dprintf(result_fd, "M%s#%s#%d\n", test_metadata.problem,
+            test_metadata.descr, test_metadata.weight);
+}
 
-    /* add a suite to the registry */
-    pSuite = CU_add_suite("Suite_1", init_suite1, clean_suite1);
-    if (NULL == pSuite) {
-        CU_cleanup_registry();
-        return CU_get_error();
+void run_test_child(CU_pTest pTest, int fd)
+{
+    result_fd = fd;
+    // the children must not share their output files
+    close_capture_files();
+    create_capture_files();
+    start_test();
+
+    if (CU_basic_run_test(pSuite,pTest) != CUE_SUCCESS)
+        _exit(1);
+    fflush(stdout);
+    if (test_metadata.err)
+        _exit(test_metadata.err);
+
+    char *usage = NULL, *line = NULL;
+    size_t usage_len = 0, len = 0;
+    FILE *f_usage = open_memstream(&usage, &usage_len);
+    FILE *f = open_memstream(&line, &len);
+    if (f_usage == NULL || write_test_usage(f_usage) || f == NULL
+        || write_test_result(f, CU_get_number_of_tests_failed() > 0))
+        _exit(1);
+    fclose(f_usage);
+    fclose(f);
+
+    dprintf(fd, "U%s", usage);
+    dprintf(fd, "R%s", line);
+    _exit(0);
+}
+
+/*
+ * Returns the line of results.txt for a job whose child exited with
+ * the given status, or NULL if it cannot be allocated, and sets usage
+ * to its line of usage.txt. If the child died before calling
+ * set_test_metadata, the test is reported with the name of its
+ * function and a weight of 1.
+ */
+char *job_result(struct job_t *job, const char *name, int status, char **usage)
+{
+    char *last_meta = NULL;
+    char *record = job->buf;
+    *usage = NULL;
+    while (record != NULL && record < job->buf + job->len) {
+        char *next = memchr(record, '\n', job->buf + job->len - record);
+        if (record[0] == 'R')
+            return strndup(record + 1, job->buf + job->len - record - 1);
+        if (record[0] == 'U' && next != NULL)
+            *usage = strndup(record + 1, next + 1 - record - 1);
+        if (next != NULL)
+            *next = '\0';
+        if (record[0] == 'M')
+            last_meta = record + 1;
+        record = next ? next + 1 : NULL;
     }
 
+    // the child died before sending its results, and its usage is unknown
+    char *tag = "crash";
+    char msg[200];
+    if (WIFSIGNALED(status)) {
+        if (WTERMSIG(status) == SIGSEGV)
+            tag = "sigsegv";
+        else if (WTERMSIG(status) == SIGFPE)
+            tag = "sigfpe";
+        snprintf(msg, sizeof(msg), _("Your code crashed (%s)."), strsignal(WTERMSIG(status)));
+    } else {
+        snprintf(msg, sizeof(msg), _("Your code crashed (exit status %d)."), WEXITSTATUS(status));
+    }
+
+    char *problem = NULL, *descr = NULL, *weight = NULL;
+    if (last_meta != NULL) {
+        problem = strtok(last_meta, "#");
+        descr = strtok(NULL, "#");
+        weight = strtok(NULL, "#");
+    } else {
+        problem = descr = (char *) name;
+        weight = "1";
+    }
+    char *line;
+    if (asprintf(&line, "%s#FAIL#%s#%s#%s#%s\n", problem ? problem : "",
+                descr ? descr : "", weight ? weight : "0", tag, msg) < 0)
+        return NULL;
+    free(*usage);
+    if (asprintf(usage, "%s#\n", problem ? problem : "") < 0)
+        *usage = NULL;
+    return line;
+}
+
+int run_tests_parallel(FILE *f_out, FILE *f_usage, void *tests[], int nb_tests, int jobs)
+{
+    CU_pTest pTests[nb_tests];
+    char *results[nb_tests];
+    char *usages[nb_tests];
+    struct job_t running[jobs];
+    struct pollfd fds[jobs];
+    int ret = 0, next = 0, nb_running = 0;
+
     for (int i=0; i < nb_tests; i++) {
         Dl_info  DlInfo;
         if (dladdr(tests[i], &DlInfo) == 0)
             return -EFAULT;
 
+        if ((pTests[i] = CU_add_test(pSuite, DlInfo.dli_sname, tests[i])) == NULL) {
+                CU_cleanup_registry();
+                return CU_get_error();
+        }
+        results[i] = NULL;
+        usages[i] = NULL;
+    }
+
+    while (next < nb_tests || nb_running > 0) {
+        // keep the pool full
+        while (next < nb_tests && nb_running < jobs && ret == 0) {
+            int p[2];
+            if (pipe(p))
+                return -errno;
+            printf("\n==== Results for test %s : ====\n", pTests[next]->pName);
+            fflush(stdout);
+            fflush(f_out);
+            fflush(f_usage);
+
+            pid_t pid = fork();
+            if (pid < 0)
+                return -errno;
+            if (pid == 0) {
+                close(p[0]);
+                for (int i=0; i < nb_running; i++)
+                    close(running[i].fd);
+                run_test_child(pTests[next], p[1]);
+            }
+            close(p[1]);
+            running[nb_running] = (struct job_t) {
+                .pid = pid, .test = next, .fd = p[0], .buf = NULL, .len = 0
+            };
+            nb_running++;
+            next++;
+        }
+        if (nb_running == 0)
+            break;
+
+        for (int i=0; i < nb_running; i++) {
+            fds[i].fd = running[i].fd;
+            fds[i].events = POLLIN;
+        }
+        if (poll(fds, nb_running, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        for (int i=nb_running-1; i >= 0; i--) {
+            if (!fds[i].revents)
+                continue;
+            struct job_t *job = &running[i];
+            char buf[BUFSIZ];
+            int n = read(job->fd, buf, BUFSIZ);
+            if (n > 0) {
+                char *grown = realloc(job->buf, job->len + n);
+                if (grown == NULL)
+                    return -ENOMEM;
+                memcpy(grown + job->len, buf, n);
+                job->buf = grown;
+                job->len += n;
+                continue;
+            }
+
+            // the child closed its pipe
+            int status;
+            close(job->fd);
+            waitpid(job->pid, &status, 0);
+            results[job->test] = job_result(job, pTests[job->test]->pName, status,
+                                            &usages[job->test]);
+            if ((results[job->test] == NULL || usages[job->test] == NULL) && ret == 0)
+                ret = -ENOMEM;
+            free(job->buf);
+            *job = running[--nb_running];
+        }
+    }
+
+    for (int i=0; i < nb_tests; i++) {
+        if (results[i] != NULL && ret == 0 && fputs(results[i], f_out) < 0)
+            ret = -EIO;
+        if (usages[i] != NULL && ret == 0 && fputs(usages[i], f_usage) < 0)
+            ret = -EIO;
+        free(results[i]);
+        free(usages[i]);
+    }
+    return ret;
+}
+
+// runs the tests one after the other in this process
+int run_tests_serial(FILE *f_out, FILE *f_usage, void *tests[], int nb_tests)
+{
+    int ret = 0;
+    for (int i=0; i < nb_tests; i++) {
+        // threads of a previous test are still running, and may modify
+        // its memory or hold locks: the remaining tests run in forked
+        // children, one at a time
+        if (threads_stray())
+            return run_tests_parallel(f_out, f_usage, tests + i, nb_tests - i, 1);
+
+        Dl_info  DlInfo;
+        if (dladdr(tests[i], &DlInfo) == 0)
+            return -EFAULT;
+
         CU_pTest pTest;
         if ((pTest = CU_add_test(pSuite, DlInfo.dli_sname, tests[i])) == NULL) {
                 CU_cleanup_registry();
@@ -299,51 +922,282 @@ int run_tests(int argc, char *argv[], void *tests[], int nb_tests) {
         if (test_metadata.err)
             return test_metadata.err;
 
-        int nb = CU_get_number_of_tests_failed();
-        if (nb > 0)
-            ret = fprintf(f_out, "%s#FAIL#%s#%d#", test_metadata.problem,
-                    test_metadata.descr, test_metadata.weight);
-
-        else
-            ret = fprintf(f_out, "%s#SUCCESS#%s#%d#", test_metadata.problem,
-                    test_metadata.descr, test_metadata.weight);
+        ret = write_test_usage(f_usage);
+        if (ret < 0)
+            return ret;
+        ret = write_test_result(f_out, CU_get_number_of_tests_failed() > 0);
         if (ret < 0)
             return ret;
+    }
+    return ret;
+}
 
-        for(int i=0; i < test_metadata.nb_tags; i++) {
-            ret = fprintf(f_out, "%s", test_metadata.tags[i]);
-            if (ret < 0)
-                return ret;
+/*
+ * Runs all the tests and writes results.txt and usage.txt in the
+ * current directory
+ */
+int run_suite(void *tests[], int nb_tests, int jobs)
+{
+    /* Output file containing succeeded / failed tests */
+    FILE* f_out = fopen("results.txt", "w");
+    if (!f_out)
+        return -ENOENT;
+    /* and the resources they used, apart from results.txt whose layout
+       is read by the existing graders */
+    FILE* f_usage = fopen("usage.txt", "w");
+    if (!f_usage) {
+        fclose(f_out);
+        return -ENOENT;
+    }
 
-            if (i != test_metadata.nb_tags - 1) {
-                ret = fprintf(f_out, ",");
-                if (ret < 0)
-                    return ret;
-            }
-        }
+    int ret;
+    if (jobs > 0)
+        ret = run_tests_parallel(f_out, f_usage, tests, nb_tests, jobs);
+    else
+        ret = run_tests_serial(f_out, f_usage, tests, nb_tests);
 
+    fclose(f_usage);
+    fclose(f_out);
+    return ret;
+}
 
-        while (test_metadata.fifo_in != NULL) {
-            struct info_msg *head = test_metadata.fifo_in;
-            ret = fprintf(f_out, "#%s", head->msg);
+/*
+ * Limits of the children of the fork server, which replace those of
+ * run_student (--time, --hard-time and --memory of tests-server). The
+ * CPU time is limited with RLIMIT_CPU, the elapsed time by killing the
+ * process group of the child, and the memory with RLIMIT_DATA.
+ */
+struct serve_limits_t {
+    unsigned int cpu;     // in seconds
+    unsigned int wall;    // in seconds
+    unsigned int memory;  // in MiB, 0 for no limit
+} serve_limits = { .cpu = 20, .wall = 60, .memory = 512 };
 
-            if (head->msg != NULL)
-                free(head->msg);
-            test_metadata.fifo_in = head->next;
-            free(head);
+#define SERVE_TIMEOUT 253  // exit status of run_student for a timeout
 
-            if (ret < 0)
-                return ret;
+pid_t serve_child;
+volatile sig_atomic_t serve_timed_out;
+
+void serve_alarm_handler(int sig)
+{
+    serve_timed_out = 1;
+    kill(-serve_child, SIGKILL);
+}
+
+void serve_set_limits()
+{
+    struct rlimit cpu = { .rlim_cur = serve_limits.cpu, .rlim_max = serve_limits.cpu + 1 };
+    setrlimit(RLIMIT_CPU, &cpu);
+    if (serve_limits.memory) {
+        rlim_t bytes = (rlim_t) serve_limits.memory << 20;
+        struct rlimit data = { .rlim_cur = bytes, .rlim_max = bytes };
+        setrlimit(RLIMIT_DATA, &data);
+    }
+}
+
+/*
+ * Handles one connection of the fork server: reads the request
+ * "SHARED_OBJECT DIRECTORY [LANGUAGE=xx]\n", runs the suite in a child
+ * which loads the student's code with dlopen, and answers with the
+ * exit status of the child ("%d\n", 256-SIG if it was killed by SIG,
+ * SERVE_TIMEOUT if it exceeded its time limits).
+ */
+int serve_request(int conn, void *tests[], int nb_tests, int jobs)
+{
+    char req[2*PATH_MAX+64];
+    size_t len = 0;
+    int n;
+    while (len < sizeof(req)-1 && (n = read(conn, req+len, sizeof(req)-1-len)) > 0) {
+        len += n;
+        if (memchr(req, '\n', len) != NULL)
+            break;
+    }
+    req[len] = '\0';
+
+    char *so = strtok(req, " \n");
+    char *dir = strtok(NULL, " \n");
+    char *lang = strtok(NULL, " \n");
+    if (so == NULL || dir == NULL)
+        return EINVAL;
+
+    signal(SIGCHLD, SIG_DFL);
+    pid_t pid = fork();
+    if (pid < 0)
+        return errno;
+    if (pid == 0) {
+        close(conn);
+        // the children of --jobs and of the explorer are killed with it
+        setpgid(0, 0);
+        serve_set_limits();
+        if (chdir(dir))
+            _exit(ENOENT);
+        if (lang != NULL && !strncmp(lang, "LANGUAGE=", 9))
+            putenv(lang);
+        // RTLD_GLOBAL so that the calls from the tests to the student's
+        // functions, left unresolved when linking the server, are bound to
+        // this object. The student's calls to the wrapped functions were
+        // renamed to __wrap_* by -Wl,-wrap and bind to the server's wrappers.
+        if (dlopen(so, RTLD_NOW | RTLD_GLOBAL) == NULL) {
+            fprintf(stderr, "%s\n", dlerror());
+            _exit(ENOEXEC);
         }
+        int ret = run_suite(tests, nb_tests, jobs);
+        fflush(stdout);
+        _exit(ret & 0xff);
+    }
 
-        test_metadata.fifo_out = NULL;
-        ret = fprintf(f_out, "\n");
-        if (ret < 0)
-            return ret;
+    setpgid(pid, pid);
+    serve_child = pid;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_alarm_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);
+    alarm(serve_limits.wall);
 
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            return errno;
     }
+    alarm(0);
+    // the other processes of the group, if any
+    kill(-pid, SIGKILL);
+    int code = WIFSIGNALED(status) ? 256 - WTERMSIG(status) : WEXITSTATUS(status);
+    if (serve_timed_out || (WIFSIGNALED(status) && WTERMSIG(status) == SIGXCPU))
+        code = SERVE_TIMEOUT;
+    dprintf(conn, "%d\n", code);
+    close(conn);
+    return 0;
+}
 
-    fclose(f_out);
+/*
+ * Fork server mode (--serve SOCKET): the tests are linked once per task
+ * without the student's code (make server) and stay loaded, with CUnit,
+ * gettext and the sandbox already initialized. Each submission is
+ * compiled to a shared object (make student_code.so), and each
+ * connection on the unix socket SOCKET is handled in a forked child.
+ */
+int serve_tests(char *path, void *tests[], int nb_tests, int jobs)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    unlink(path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -errno;
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) || listen(sock, 16))
+        return -errno;
+
+    signal(SIGCHLD, SIG_IGN); // the handlers are reaped automatically
+    for (;;) {
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(sock);
+            _exit(serve_request(conn, tests, nb_tests, jobs));
+        }
+        close(conn);
+    }
+}
+
+int run_tests(int argc, char *argv[], void *tests[], int nb_tests) {
+    int jobs = -1; // by default, tests run serially in this process
+    char *serve = NULL;
+    for (int i=1; i < argc; i++) {
+        if (!strncmp(argv[i], "LANGUAGE=", 9))
+                putenv(argv[i]);
+        else if (!strcmp(argv[i], "--jobs") && i+1 < argc)
+                jobs = atoi(argv[++i]);
+        else if (!strncmp(argv[i], "--jobs=", 7))
+                jobs = atoi(argv[i]+7);
+        else if (!strcmp(argv[i], "--serve") && i+1 < argc)
+                serve = argv[++i];
+        else if (!strcmp(argv[i], "--time") && i+1 < argc)
+                serve_limits.cpu = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--hard-time") && i+1 < argc)
+                serve_limits.wall = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--memory") && i+1 < argc)
+                serve_limits.memory = atoi(argv[++i]);
+    }
+    if (jobs == 0) // --jobs 0 uses all the cores
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    // the pool of children is on the stack
+    if (jobs > JOBS_MAX)
+        jobs = JOBS_MAX;
+    if (jobs > nb_tests)
+        jobs = nb_tests > 0 ? nb_tests : -1;
+    setlocale (LC_ALL, "");
+    bindtextdomain("tests", getenv("PWD"));
+    bind_textdomain_codeset("messages", "UTF-8");
+    textdomain("tests");
+
+    mallopt(M_PERTURB, 142); // newly allocated memory with malloc will be set to ~142
+
+    // Double frees are detected by the wrappers, see malloc_check_free.
+    // Don't abort on the ones that are not.
+    mallopt(M_CHECK_ACTION, 1);
+    // a thread left running by a test may hold the locks of CTester
+    // when a child is forked, see run_tests_serial
+    trap_atfork();
+    malloc_atfork();
+    vfs_atfork();
+    true_stderr = dup(STDERR_FILENO);
+    true_stdout = dup(STDOUT_FILENO);
+
+    create_capture_files();
+
+    putenv("LIBC_FATAL_STDERR_=2"); // needed otherwise libc doesn't print to program's stderr
+
+    /* make sure that we catch segmentation faults */
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sigaction));
+    sigemptyset(&sa.sa_mask);
+    // SIGSTKSZ is not a constant with recent versions of glibc
+    static char stack[SEGV_STACK_SIZE];
+    stack_t ss = {
+        .ss_size = SEGV_STACK_SIZE,
+        .ss_sp = stack,
+    };
+
+    sa.sa_flags     = SA_NODEFER|SA_ONSTACK|SA_RESTART|SA_SIGINFO;
+    sa.sa_sigaction = segv_handler;
+    sigaltstack(&ss, 0);
+    sigfillset(&sa.sa_mask);
+    int ret = sigaction(SIGSEGV, &sa, NULL);
+    if (ret)
+        return ret;
+    sa.sa_sigaction = alarm_handler;
+    ret = sigaction(SIGALRM, &sa, NULL);
+    if (ret)
+        return ret;
+
+
+    /* initialize the CUnit test registry */
+    if (CUE_SUCCESS != CU_initialize_registry())
+        return CU_get_error();
+
+    /* add a suite to the registry */
+    pSuite = CU_add_suite("Suite_1", init_suite1, clean_suite1);
+    if (NULL == pSuite) {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    if (serve != NULL)
+        ret = serve_tests(serve, tests, nb_tests, jobs);
+    else
+        ret = run_suite(tests, nb_tests, jobs);
+    if (ret)
+        return ret;
 
     /* Run all tests using the CUnit Basic interface */
     //CU_basic_run_tests();
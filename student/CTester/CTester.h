@@ -4,6 +4,9 @@
 
 #include "wrap.h"
 #include "trap.h"
+#include "scale.h"
+#include "explore.h"
+#include "vfs.h"
 
 #include <libintl.h>
 #include <locale.h>
@@ -12,6 +15,10 @@
 #define RUN(...) void *ptr_tests[] = {__VA_ARGS__}; return run_tests(argc, argv, ptr_tests, sizeof(ptr_tests)/sizeof(void*))
 #define BAN_FUNCS(...) 
 #define SANDBOX_BEGIN sandbox_begin(); if(sigsetjmp(segv_jmp,1) == 0) { (void)0
+// same as SANDBOX_BEGIN, with a limit of ms milliseconds of CPU time instead of 2 seconds
+#define SANDBOX_BEGIN_TIMEOUT(ms) sandbox_begin_timeout(ms); if(sigsetjmp(segv_jmp,1) == 0) { (void)0
+// same as SANDBOX_BEGIN, with a limit of us microseconds of CPU time
+#define SANDBOX_BEGIN_TIMEOUT_US(us) sandbox_begin_timeout_us(us); if(sigsetjmp(segv_jmp,1) == 0) { (void)0
 #define SANDBOX_END } else { \
                              sandbox_fail(); \
                            } \
@@ -21,6 +28,8 @@
 // Hidden by macros
 int run_tests(int argc, char *argv[], void *tests[], int nb_tests);
 int sandbox_begin();
+int sandbox_begin_timeout(unsigned int ms);
+int sandbox_begin_timeout_us(uint64_t us);
 void sandbox_fail();
 void sandbox_end();
 
@@ -37,7 +46,16 @@ struct wrap_stats_t stats;
 struct wrap_monitor_t monitored;
 struct wrap_fail_t failures;
 struct wrap_log_t logs;
+// deterministic scheduling of the threads, see CTester/wrap_thread.h
+struct schedule_t schedule;
 
 int stdout_cpy, stderr_cpy;
 
+// Output of the code run in the last sandbox, without copy. The buffer
+// is valid until the next sandbox, and is NULL if nothing was written.
+const char *sandbox_stdout(size_t *len);
+const char *sandbox_stderr(size_t *len);
+// maximal number of bytes kept from each output of a sandbox, 0 for no limit
+size_t sandbox_output_limit;
+
 sigjmp_buf segv_jmp;
@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "wrap.h"
+#include "explore.h"
+
+#include <libintl.h>
+#define _(STRING) gettext(STRING)
+
+extern bool wrap_monitoring;
+extern struct wrap_fail_t failures;
+extern sigjmp_buf segv_jmp;
+
+void *__real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+ssize_t __real_read(int fd, void *buf, size_t count);
+int __real_close(int fd);
+
+int sandbox_begin();
+void sandbox_fail();
+void sandbox_end();
+void push_info_msg(char *msg);
+
+/*
+ * The children are forked by fail_call, from the thread of the sandbox,
+ * and run the rest of the code with the failure, then the check, and
+ * write their outcome in the points, a mapping shared with the parent.
+ * At most one child per core runs at a time: the parent waits for the
+ * oldest one before forking another, with the wall-clock timer of the
+ * sandbox suspended, as the children have their own timers. A child
+ * gets its own copy of the files of the filesystem, and the parent waits
+ * until it is made before going on (see vfs_fork_child).
+ */
+
+#define EXPLORE_FUNCTIONS_MAX 32
+#define EXPLORE_REPORT_MAX 3
+
+static struct {
+    bool running;     // in explore_failures, configured failures are ignored
+    bool injecting;   // in the run of the parent, which forks the children
+    bool child;       // in a child, whose failure has been injected
+    int point;        // point of the child
+    int n;            // children forked
+    int waited;       // children waited for
+    int jobs;         // maximal number of children running
+    bool truncated;
+    struct explore_point_t *points;  // shared with the children
+    pid_t pids[EXPLORE_POINTS_MAX];
+    int functions;
+    const char *function[EXPLORE_FUNCTIONS_MAX];
+    uint64_t calls[EXPLORE_FUNCTIONS_MAX];
+} explore;
+
+bool explore_running()
+{
+    return explore.running;
+}
+
+static void explore_wait()
+{
+    struct itimerval wall, stopped;
+    memset(&stopped, 0, sizeof(stopped));
+    setitimer(ITIMER_REAL, &stopped, &wall);
+    waitpid(explore.pids[explore.waited++], NULL, 0);
+    setitimer(ITIMER_REAL, &wall, NULL);
+}
+
+bool explore_call(const char *function)
+{
+    if (!explore.injecting || explore.child)
+        return false;
+    int f;
+    for (f = 0; f < explore.functions && explore.function[f] != function; f++)
+        ;
+    if (f == EXPLORE_FUNCTIONS_MAX)
+        return false;
+    if (f == explore.functions)
+        explore.function[explore.functions++] = function;
+    uint64_t call = ++explore.calls[f];
+
+    // fork only duplicates the calling thread
+    if (!pthread_equal(pthread_self(), sandbox_thread) || threads_alive() > 0)
+        return false;
+    if (explore.n == EXPLORE_POINTS_MAX) {
+        explore.truncated = true;
+        return false;
+    }
+    if (explore.n - explore.waited == explore.jobs)
+        explore_wait();
+    struct explore_point_t *p = &explore.points[explore.n];
+    p->function = function;
+    p->call = call;
+    p->outcome = EXPLORE_CRASH;  // if the child dies without reporting
+    p->leaked = 0;
+    int ready[2];
+    if (pipe(ready))
+        return false;
+    pid_t pid = fork();
+    if (pid < 0) {
+        __real_close(ready[0]);
+        __real_close(ready[1]);
+        return false;
+    }
+    if (pid == 0) {
+        explore.child = true;
+        explore.point = explore.n;
+        __real_close(ready[0]);
+        sandbox_fork_child();
+        __real_close(ready[1]);
+        return true;
+    }
+    // the child closes its end once it has its own files
+    __real_close(ready[1]);
+    char c;
+    while (__real_read(ready[0], &c, 1) < 0 && errno == EINTR)
+        ;
+    __real_close(ready[0]);
+    explore.pids[explore.n++] = pid;
+    return false;
+}
+
+int explore_failures(void (*run)(void *), bool (*check)(void *), void *arg,
+                     struct explore_t *result)
+{
+    memset(result, 0, sizeof(*result));
+    if (explore.points == NULL) {
+        void *points = __real_mmap(NULL, EXPLORE_POINTS_MAX * sizeof(struct explore_point_t),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (points == MAP_FAILED)
+            return -1;
+        explore.points = points;
+    }
+    explore.n = 0;
+    explore.waited = 0;
+    explore.truncated = false;
+    explore.functions = 0;
+    memset(explore.calls, 0, sizeof(explore.calls));
+    explore.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (explore.jobs < 1)
+        explore.jobs = 1;
+
+    // the failed calls return what the real functions return
+    struct wrap_fail_t configured = failures;
+    fail_natural(&failures);
+
+    size_t before = malloc_allocated();
+    volatile enum explore_outcome_t outcome = EXPLORE_CRASH;
+    explore.running = true;
+    explore.injecting = true;
+    sandbox_begin();
+    if (sigsetjmp(segv_jmp, 1) == 0) {
+        run(arg);
+        explore.injecting = false;
+        outcome = check == NULL || check(arg) ? EXPLORE_OK : EXPLORE_WRONG;
+    } else if (!explore.child) {
+        sandbox_fail();
+    }
+    explore.injecting = false;
+    size_t after = malloc_allocated();
+    size_t leaked = after > before ? after - before : 0;
+    if (outcome == EXPLORE_OK && leaked > 0)
+        outcome = EXPLORE_LEAK;
+    if (explore.child) {
+        wrap_monitoring = false;
+        struct explore_point_t *p = &explore.points[explore.point];
+        p->outcome = outcome;
+        p->leaked = outcome != EXPLORE_CRASH && leaked > 0 ? leaked : 0;
+        _exit(0);
+    }
+    explore.running = false;
+    sandbox_end();
+    failures = configured;
+
+    while (explore.waited < explore.n)
+        explore_wait();
+    result->outcome = outcome;
+    result->n = explore.n;
+    result->truncated = explore.truncated;
+    result->points = explore.points;
+    for (int i = 0; i < explore.n; i++) {
+        if (explore.points[i].outcome != EXPLORE_OK)
+            result->failed++;
+    }
+    return 0;
+}
+
+int explore_report(struct explore_t *result)
+{
+    int reported = 0;
+    for (int i = 0; i < result->n && reported < EXPLORE_REPORT_MAX; i++) {
+        struct explore_point_t *p = &result->points[i];
+        char msg[256];
+        switch (p->outcome) {
+        case EXPLORE_OK:
+            continue;
+        case EXPLORE_CRASH:
+            snprintf(msg, sizeof(msg), _("When call %llu to %s fails, your code crashes."),
+                     (unsigned long long) p->call, p->function);
+            break;
+        case EXPLORE_LEAK:
+            snprintf(msg, sizeof(msg), _("When call %llu to %s fails, your code leaks %zu bytes."),
+                     (unsigned long long) p->call, p->function, p->leaked);
+            break;
+        case EXPLORE_WRONG:
+            snprintf(msg, sizeof(msg), _("When call %llu to %s fails, your code returns a wrong result."),
+                     (unsigned long long) p->call, p->function);
+            break;
+        }
+        push_info_msg(msg);
+        reported++;
+    }
+    return result->failed;
+}
@@ -0,0 +1,51 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Exploration of the failures of the monitored functions: the code is
+// run once, and at each call to a monitored function which can fail, a
+// child process is forked in which this call fails, and the others
+// succeed. The outcome of each child tells whether the student's code
+// handles the failure of this call.
+
+#define EXPLORE_POINTS_MAX 1024
+
+enum explore_outcome_t {
+    EXPLORE_OK,     // the check succeeded, without leak
+    EXPLORE_CRASH,  // segfault, timeout, deadlock or exit
+    EXPLORE_LEAK,   // the check succeeded, but memory was leaked
+    EXPLORE_WRONG,  // the check failed
+};
+
+struct explore_point_t {
+    const char *function;  // function whose call failed
+    uint64_t call;         // number of the call to it, from 1
+    enum explore_outcome_t outcome;
+    size_t leaked;         // bytes allocated by the run and never freed
+};
+
+struct explore_t {
+    enum explore_outcome_t outcome; // outcome of the run without failure
+    int n;                 // number of points explored
+    int failed;            // number of points whose outcome is not EXPLORE_OK
+    bool truncated;        // true if more than EXPLORE_POINTS_MAX calls could fail
+    struct explore_point_t *points; // valid until the next exploration
+};
+
+// Runs run(arg) in a sandbox, then check(arg) (if not NULL), which
+// returns false if the result is wrong, and frees what run allocated.
+// The points explored are the calls of run to the functions which are
+// monitored, in the thread of the sandbox: no failure is injected while
+// other threads run. Leaks are measured with the log of malloc,
+// when it is monitored. The configured failures are ignored. Returns
+// 0, or -1 if the exploration could not be done.
+int explore_failures(void (*run)(void *), bool (*check)(void *), void *arg,
+                     struct explore_t *result);
+// Adds a message for the first points whose outcome is not EXPLORE_OK,
+// and returns their number.
+int explore_report(struct explore_t *result);
+
+// true during an exploration, used by fail_call
+bool explore_running();
+// true if the call to function fails, during an exploration
+bool explore_call(const char *function);
@@ -0,0 +1,209 @@
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "wrap.h"
+#include "scale.h"
+
+extern struct wrap_monitor_t monitored;
+extern struct wrap_log_t logs;
+extern struct schedule_t schedule;
+
+/*
+ * The threads of a run first wait for each other, and for the thread
+ * calling scale_run, which then releases them together and starts the
+ * clock. Each thread counts its operations in its own cache line. The
+ * time lost waiting for mutexes is measured by the profile of the mutex
+ * wrappers, enabled during the run: it only works in a sandbox. A run
+ * interrupted by a timeout leaves it enabled, until scale_end. The
+ * threads spin while waiting, which never ends if the deterministic
+ * scheduler runs one thread at a time: a run is refused if it is
+ * enabled.
+ */
+
+#define SCALE_THREADS_MAX 64
+
+struct scale_run_t {
+    scale_op_t op;
+    void *arg;
+    int ready;   // threads waiting for go
+    int go;
+    int stop;    // end of a timed run
+    bool timed;
+};
+
+struct scale_thread_t {
+    struct scale_run_t *run;
+    pthread_t thread;
+    int id;
+    uint64_t todo;  // operations to do, if the run is not timed
+    uint64_t ops;   // operations done
+} __attribute__((aligned(64)));
+
+// static, as the threads may outlive a run interrupted by a timeout
+static struct scale_run_t scale_current;
+static struct scale_thread_t scale_threads[SCALE_THREADS_MAX];
+static uint64_t scale_wait_before[MUTEX_PROFILE_MAX];
+static bool scale_running;
+static bool scale_profiled;  // monitored.pthread_mutex_profile before the run
+
+static uint64_t scale_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void *scale_thread(void *arg)
+{
+    struct scale_thread_t *t = arg;
+    struct scale_run_t *run = t->run;
+    __atomic_add_fetch(&run->ready, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&run->go, __ATOMIC_ACQUIRE))
+        sched_yield();
+    uint64_t i = 0;
+    if (run->timed) {
+        while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED))
+            run->op(t->id, i++, run->arg);
+    } else {
+        for (; i < t->todo && !__atomic_load_n(&run->stop, __ATOMIC_RELAXED); i++)
+            run->op(t->id, i, run->arg);
+    }
+    t->ops = i;
+    return NULL;
+}
+
+// total wait of each mutex profiled so far
+static void scale_wait_snapshot(uint64_t *wait)
+{
+    for (int i = 0; i < MUTEX_PROFILE_MAX; i++)
+        wait[i] = logs.mutex.profiles[i].mutex ? logs.mutex.profiles[i].wait_ns : 0;
+}
+
+int scale_run(int threads, scale_op_t op, void *arg, unsigned int duration_ms,
+              uint64_t ops, struct scale_point_t *point)
+{
+    if (threads < 1)
+        threads = 1;
+    if (threads > SCALE_THREADS_MAX)
+        threads = SCALE_THREADS_MAX;
+    memset(point, 0, sizeof(*point));
+    point->threads = threads;
+    if (schedule.enabled)
+        return -1;
+
+    struct scale_run_t *run = &scale_current;
+    memset(run, 0, sizeof(*run));
+    run->op = op;
+    run->arg = arg;
+    run->timed = duration_ms != 0;
+    scale_profiled = monitored.pthread_mutex_profile;
+    scale_running = true;
+    monitored.pthread_mutex_profile = true;
+    scale_wait_snapshot(scale_wait_before);
+
+    int created;
+    for (created = 0; created < threads; created++) {
+        struct scale_thread_t *t = &scale_threads[created];
+        t->run = run;
+        t->id = created;
+        t->todo = ops / threads + (created < ops % threads);
+        t->ops = 0;
+        if (pthread_create(&t->thread, NULL, scale_thread, t))
+            break;
+    }
+    if (created < threads)
+        __atomic_store_n(&run->stop, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&run->ready, __ATOMIC_ACQUIRE) < created)
+        sched_yield();
+
+    uint64_t start = scale_now();
+    __atomic_store_n(&run->go, 1, __ATOMIC_RELEASE);
+    if (run->timed && created == threads) {
+        struct timespec duration = {
+            .tv_sec = duration_ms / 1000,
+            .tv_nsec = (duration_ms % 1000) * 1000000,
+        };
+        while (nanosleep(&duration, &duration) != 0)
+            ;
+        __atomic_store_n(&run->stop, 1, __ATOMIC_RELAXED);
+    }
+    for (int i = 0; i < created; i++) {
+        pthread_join(scale_threads[i].thread, NULL);
+        point->ops += scale_threads[i].ops;
+    }
+    point->ns = scale_now() - start;
+
+    uint64_t hottest = 0;
+    for (int i = 0; i < MUTEX_PROFILE_MAX; i++) {
+        struct mutex_profile_t *p = &logs.mutex.profiles[i];
+        if (p->mutex == NULL)
+            continue;
+        uint64_t wait = p->wait_ns - scale_wait_before[i];
+        point->lock_wait_ns += wait;
+        if (wait > hottest) {
+            hottest = wait;
+            point->hottest = p->mutex;
+        }
+    }
+    scale_end();
+    if (created < threads)
+        return -1;
+
+    if (point->ns > 0) {
+        point->ops_per_sec = point->ops * 1e9 / point->ns;
+        point->lock_wait = (double) point->lock_wait_ns / ((double) point->ns * threads);
+    }
+    point->speedup = 1;
+    return 0;
+}
+
+void scale_end()
+{
+    if (scale_running)
+        monitored.pthread_mutex_profile = scale_profiled;
+    scale_running = false;
+}
+
+int scale_curve(int max_threads, scale_op_t op, void *arg, unsigned int duration_ms,
+                uint64_t ops, struct scale_t *curve)
+{
+    memset(curve, 0, sizeof(*curve));
+    curve->cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (max_threads > SCALE_THREADS_MAX)
+        max_threads = SCALE_THREADS_MAX;
+    for (int threads = 1; curve->n < SCALE_POINTS_MAX; threads *= 2) {
+        if (threads > max_threads)
+            threads = max_threads;
+        struct scale_point_t *point = &curve->points[curve->n];
+        if (scale_run(threads, op, arg, duration_ms, ops, point))
+            return -1;
+        if (curve->points[0].ops_per_sec > 0)
+            point->speedup = point->ops_per_sec / curve->points[0].ops_per_sec;
+        curve->n++;
+        if (threads >= max_threads)
+            break;
+    }
+    return 0;
+}
+
+struct scale_point_t *scale_point(struct scale_t *curve, int threads)
+{
+    for (int i = 0; i < curve->n; i++) {
+        if (curve->points[i].threads == threads)
+            return &curve->points[i];
+    }
+    return NULL;
+}
+
+double scale_speedup(struct scale_t *curve, int from, int to)
+{
+    struct scale_point_t *a = scale_point(curve, from);
+    struct scale_point_t *b = scale_point(curve, to);
+    if (a == NULL || b == NULL || a->ops_per_sec == 0)
+        return 0;
+    return b->ops_per_sec / a->ops_per_sec;
+}
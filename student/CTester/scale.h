@@ -0,0 +1,47 @@
+#include <stdint.h>
+#include <pthread.h>
+
+// Throughput of an operation of the student's code, run from several
+// threads at once, to grade how a thread-safe data structure scales.
+
+#define SCALE_POINTS_MAX 8
+
+// operation run by the threads. thread is the index of the thread, and
+// i counts its operations
+typedef void (*scale_op_t)(int thread, uint64_t i, void *arg);
+
+struct scale_point_t {
+    int threads;             // number of threads
+    uint64_t ops;            // operations done by all the threads
+    uint64_t ns;             // duration of the run
+    double ops_per_sec;      // throughput
+    double speedup;          // throughput relative to the first point of the curve
+    uint64_t lock_wait_ns;   // time spent waiting for mutexes, by all the threads
+    double lock_wait;        // lock_wait_ns / (threads * ns)
+    pthread_mutex_t *hottest; // mutex with the longest wait during the run, or NULL
+};
+
+struct scale_t {
+    int n;
+    int cores;               // number of online cores
+    struct scale_point_t points[SCALE_POINTS_MAX];
+};
+
+// Runs op from threads threads, released together, during duration_ms
+// if it is not 0, and otherwise until they did ops operations in total.
+// Returns 0, or -1 if the threads could not be created, or if the
+// deterministic scheduler is enabled (schedule.enabled).
+int scale_run(int threads, scale_op_t op, void *arg, unsigned int duration_ms,
+              uint64_t ops, struct scale_point_t *point);
+// Runs op with 1, 2, 4, ... up to max_threads threads (max_threads
+// being the last point), and fills curve. Returns 0 or -1.
+int scale_curve(int max_threads, scale_op_t op, void *arg, unsigned int duration_ms,
+                uint64_t ops, struct scale_t *curve);
+// point of curve with threads threads, NULL if none
+struct scale_point_t *scale_point(struct scale_t *curve, int threads);
+// throughput with to threads divided by the one with from threads, 0 if
+// one of them is not in curve
+double scale_speedup(struct scale_t *curve, int from, int to);
+// restores the monitoring changed by a run interrupted by a timeout,
+// called by sandbox_end
+void scale_end();
@@ -1,37 +1,367 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "trap.h"
 
+void *__real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int __real_munmap(void *addr, size_t length);
+int __real_pthread_mutex_lock(pthread_mutex_t *mutex);
+int __real_pthread_mutex_unlock(pthread_mutex_t *mutex);
+
+/*
+ * The buffers of up to 2^(TRAP_CLASSES-1) pages are carved out of
+ * arenas, one per power of two of pages, reserved once without any
+ * access. In the arena of class c, the slots of 2^c pages are
+ * separated by pages which are never accessible, the guard pages.
+ * trap_buffer only makes the pages of the buffer accessible, at the
+ * start of the slot for TRAP_LEFT and at its end for TRAP_RIGHT, and
+ * free_trap makes them inaccessible again and puts the slot on the free
+ * list of its class. The pages of a reused slot are cleared by
+ * trap_buffer, which is cheaper than giving them back to the kernel for
+ * small buffers, so a buffer always starts zeroed. Larger buffers, and the
+ * buffers of a full class, get their own mapping, whose first page
+ * records its length. These mappings are kept in a list, so that
+ * free_trap only reads the first page of a mapping it made.
+ *
+ * The blocks of malloc in the guarded mode have their own arenas, with
+ * more slots, and are retired (made inaccessible) before their slot is
+ * released, once they leave the quarantine of malloc.
+ */
+
+#define TRAP_CLASSES 8
+#define TRAP_SLOTS 256      // slots of each class for trap_buffer
+#define TRAP_BLOCKS 65536   // slots of one page for trap_alloc, halved for each class
+#define TRAP_ALIGN 16       // alignment of the blocks returned by trap_alloc
+#define TRAP_BUSY -2
+#define TRAP_RETIRED -3
+#define TRAP_MAGIC 0x7472617062756621ULL
+
+struct trap_slot_t {
+    int next;       // next free slot, or TRAP_BUSY or TRAP_RETIRED
+    void *ptr;      // block returned by trap_alloc
+    size_t size;    // and its size
+};
+
+struct trap_arena_t {
+    char *base;     // NULL until the first buffer of the class
+    int slots;      // number of slots
+    int used;       // slots carved so far
+    int free;       // first free slot, -1 if none
+    struct trap_slot_t *slot;
+};
+
+// first page of a mapping which is not in an arena
+struct trap_header_t {
+    uint64_t magic;
+    size_t len;
+    struct trap_header_t *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct trap_arena_t buffers[TRAP_CLASSES];  // trap_buffer
+    struct trap_arena_t blocks[TRAP_CLASSES];   // trap_alloc
+    struct trap_header_t *maps;                 // mappings of trap_buffer outside the arenas
+    bool guarded;   // trap_alloc was called, the other functions on blocks do nothing before
+} trap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// size of a slot of class c and of the guard page which follows it
+static size_t trap_slot_size(int c)
+{
+    return (((size_t) 1 << c) + 1) * getpagesize();
+}
+
+static size_t trap_arena_size(struct trap_arena_t *a, int c)
+{
+    return getpagesize() + a->slots * trap_slot_size(c);
+}
+
+static char *trap_slot_start(struct trap_arena_t *a, int c, int slot)
+{
+    return a->base + getpagesize() + slot * trap_slot_size(c);
+}
+
+// takes a free slot of at least pages pages in arenas, where the class
+// c has max(TRAP_SLOTS, slots >> c) slots. Returns the slot, -1 if
+// none. reused is true if the slot was used before
+static int trap_slot_get(struct trap_arena_t *arenas, int slots, size_t pages,
+                         int *class, bool *reused)
+{
+    int c = 0;
+    while (c < TRAP_CLASSES && ((size_t) 1 << c) < pages)
+        c++;
+    if (c == TRAP_CLASSES)
+        return -1;
+    struct trap_arena_t *a = &arenas[c];
+    if (a->base == NULL) {
+        a->slots = (slots >> c) < TRAP_SLOTS ? TRAP_SLOTS : slots >> c;
+        void *base = __real_mmap(NULL, trap_arena_size(a, c), PROT_NONE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED)
+            return -1;
+        void *slot = __real_mmap(NULL, a->slots * sizeof(struct trap_slot_t),
+                                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slot == MAP_FAILED) {
+            __real_munmap(base, trap_arena_size(a, c));
+            return -1;
+        }
+        a->slot = slot;
+        a->free = -1;
+        a->base = base;
+    }
+    int slot;
+    *reused = a->free >= 0;
+    if (a->free >= 0) {
+        slot = a->free;
+        a->free = a->slot[slot].next;
+    } else if (a->used < a->slots) {
+        slot = a->used++;
+    } else {
+        return -1;
+    }
+    a->slot[slot].next = TRAP_BUSY;
+    *class = c;
+    return slot;
+}
+
+// makes the slot inaccessible and puts it on the free list
+static void trap_slot_put(struct trap_arena_t *a, int c, int slot)
+{
+    if (a->slot[slot].next != TRAP_RETIRED)
+        mprotect(trap_slot_start(a, c, slot), ((size_t) 1 << c) * getpagesize(), PROT_NONE);
+    a->slot[slot].next = a->free;
+    a->free = slot;
+}
+
+// class and slot of the arena containing addr, false if none
+static bool trap_find(struct trap_arena_t *arenas, void *addr, int *class, int *slot)
+{
+    char *p = addr;
+    for (int c = 0; c < TRAP_CLASSES; c++) {
+        struct trap_arena_t *a = &arenas[c];
+        if (a->base == NULL || p < a->base || p >= a->base + trap_arena_size(a, c))
+            continue;
+        size_t offset = p - a->base;
+        *class = c;
+        *slot = offset < (size_t) getpagesize() ? 0 : (offset - getpagesize()) / trap_slot_size(c);
+        return true;
+    }
+    return false;
+}
+
+// pages accessible pages, between the header and a guard page on each side
+static char *trap_map(size_t pages)
+{
+    size_t len = (pages + 3) * getpagesize();
+    char *base = __real_mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect(base, getpagesize(), PROT_READ | PROT_WRITE)) {
+        __real_munmap(base, len);
+        return NULL;
+    }
+    struct trap_header_t *header = (struct trap_header_t *) base;
+    header->magic = TRAP_MAGIC;
+    header->len = len;
+    __real_pthread_mutex_lock(&trap.lock);
+    header->next = trap.maps;
+    trap.maps = header;
+    __real_pthread_mutex_unlock(&trap.lock);
+    return base + 2 * getpagesize();
+}
+
 void *trap_buffer(size_t size, int type, int flags, void *data)
 {
-    int nb_pages = (size / getpagesize()) + 2;
-    void *ptr = mmap(NULL, getpagesize() * nb_pages, PROT_READ | PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
-    if (ptr == MAP_FAILED) {
+    if (type != TRAP_LEFT && type != TRAP_RIGHT)
+        return NULL;
+    size_t page = getpagesize();
+    size_t pages = (size + page - 1) / page;
+
+    int c = 0;
+    bool reused = false;
+    __real_pthread_mutex_lock(&trap.lock);
+    int slot = trap_slot_get(trap.buffers, TRAP_SLOTS, pages, &c, &reused);
+    __real_pthread_mutex_unlock(&trap.lock);
+    char *start = NULL;
+    if (slot >= 0) {
+        start = trap_slot_start(&trap.buffers[c], c, slot);
+        if (type == TRAP_RIGHT)
+            start += (((size_t) 1 << c) - pages) * page;
+    } else if ((start = trap_map(pages)) == NULL) {
         return NULL;
     }
 
-    void *buf_start;
-    if (type == TRAP_LEFT) {
-        buf_start = ptr + getpagesize();
-        mprotect(ptr, getpagesize(), PROT_NONE);
-    } else if (type == TRAP_RIGHT) {
-        buf_start = ptr + (nb_pages - 1) * getpagesize() - size;
-        mprotect(ptr + (nb_pages - 1)*getpagesize(), getpagesize(), PROT_NONE);
+    size_t len = pages * page;
+    char *buf_start = type == TRAP_LEFT ? start : start + len - size;
+    if (len > 0) {
+        mprotect(start, len, PROT_READ | PROT_WRITE);
+        if (reused)
+            memset(start, 0, len);
+        if (data != NULL)
+            memcpy(buf_start, data, size);
+        if (flags != (PROT_READ | PROT_WRITE))
+            mprotect(start, len, flags);
+    }
+    return buf_start;
+}
+
+int free_trap(void *ptr, size_t size)
+{
+    // the first page of the buffer is the first page of the slot for
+    // TRAP_LEFT, and the first accessible one for TRAP_RIGHT
+    char *page = (char *) ((uintptr_t) ptr & ~((uintptr_t) getpagesize() - 1));
+    int c, slot;
+    int ret = -1;
+    struct trap_header_t *header = NULL;
+    __real_pthread_mutex_lock(&trap.lock);
+    if (trap_find(trap.buffers, page, &c, &slot)) {
+        if (trap.buffers[c].slot[slot].next == TRAP_BUSY) {
+            trap_slot_put(&trap.buffers[c], c, slot);
+            ret = 0;
+        }
     } else {
+        // any other pointer, which may not be mapped, is compared to
+        // the mappings of the list before reading their header
+        for (struct trap_header_t **h = &trap.maps; *h != NULL; h = &(*h)->next) {
+            if ((char *) *h + 2 * getpagesize() == page) {
+                header = *h;
+                *h = header->next;
+                break;
+            }
+        }
+    }
+    __real_pthread_mutex_unlock(&trap.lock);
+    if (header != NULL && header->magic == TRAP_MAGIC)
+        ret = __real_munmap(header, header->len);
+    if (ret == -1)
+        errno = EINVAL;
+    return ret;
+}
+
+void *trap_alloc(size_t size, int type)
+{
+    size_t page = getpagesize();
+    size_t pages = (size + page - 1) / page;
+    int c = 0;
+    bool reused = false;
+    size_t len = pages * page;
+    size_t rounded = (size + TRAP_ALIGN - 1) & ~(size_t) (TRAP_ALIGN - 1);
+    char *start = NULL, *ptr = NULL;
+    // the slot describes the block before the lock is released, for
+    // trap_block in the other threads
+    __real_pthread_mutex_lock(&trap.lock);
+    __atomic_store_n(&trap.guarded, true, __ATOMIC_RELAXED);
+    int slot = trap_slot_get(trap.blocks, TRAP_BLOCKS, pages, &c, &reused);
+    struct trap_arena_t *a = &trap.blocks[c];
+    if (slot >= 0) {
+        start = trap_slot_start(a, c, slot);
+        if (type == TRAP_RIGHT)
+            start += (((size_t) 1 << c) - pages) * page;
+        ptr = type == TRAP_LEFT ? start : start + len - rounded;
+        a->slot[slot].ptr = ptr;
+        a->slot[slot].size = size;
+    }
+    __real_pthread_mutex_unlock(&trap.lock);
+    if (slot < 0)
+        return NULL;
+
+    // mprotect fails once the process has too many mappings
+    if (len > 0 && mprotect(start, len, PROT_READ | PROT_WRITE)) {
+        __real_pthread_mutex_lock(&trap.lock);
+        trap_slot_put(a, c, slot);
+        __real_pthread_mutex_unlock(&trap.lock);
+        return NULL;
+    }
+    if (reused)
+        memset(start, 0, len);
+    return ptr;
+}
+
+// slot of the block ptr, retired or not, NULL if ptr is not a block
+static struct trap_slot_t *trap_block(void *ptr, int *class, int *slot)
+{
+    if (!trap_find(trap.blocks, ptr, class, slot))
         return NULL;
+    struct trap_slot_t *s = &trap.blocks[*class].slot[*slot];
+    if ((s->next != TRAP_BUSY && s->next != TRAP_RETIRED) || s->ptr != ptr)
+        return NULL;
+    return s;
+}
+
+bool trap_allocated(void *ptr, size_t *size)
+{
+    if (!__atomic_load_n(&trap.guarded, __ATOMIC_RELAXED))
+        return false;
+    int c, slot;
+    __real_pthread_mutex_lock(&trap.lock);
+    struct trap_slot_t *s = trap_block(ptr, &c, &slot);
+    bool allocated = s != NULL && s->next == TRAP_BUSY;
+    if (allocated && size != NULL)
+        *size = s->size;
+    __real_pthread_mutex_unlock(&trap.lock);
+    return allocated;
+}
+
+bool trap_retire(void *ptr)
+{
+    if (!__atomic_load_n(&trap.guarded, __ATOMIC_RELAXED))
+        return false;
+    int c, slot;
+    __real_pthread_mutex_lock(&trap.lock);
+    struct trap_slot_t *s = trap_block(ptr, &c, &slot);
+    bool retired = s != NULL && s->next == TRAP_BUSY;
+    if (retired) {
+        mprotect(trap_slot_start(&trap.blocks[c], c, slot), ((size_t) 1 << c) * getpagesize(), PROT_NONE);
+        s->next = TRAP_RETIRED;
     }
+    __real_pthread_mutex_unlock(&trap.lock);
+    return retired;
+}
+
+bool trap_release(void *ptr)
+{
+    if (!__atomic_load_n(&trap.guarded, __ATOMIC_RELAXED))
+        return false;
+    int c, slot;
+    __real_pthread_mutex_lock(&trap.lock);
+    struct trap_slot_t *s = trap_block(ptr, &c, &slot);
+    if (s != NULL)
+        trap_slot_put(&trap.blocks[c], c, slot);
+    __real_pthread_mutex_unlock(&trap.lock);
+    return s != NULL;
+}
 
-    if (data != NULL)
-        memcpy(buf_start, data, size);
+// called by the handler of SIGSEGV, without the lock
+int trap_fault(void *addr)
+{
+    int c, slot;
+    if (!trap_find(trap.blocks, addr, &c, &slot))
+        return TRAP_FAULT_NONE;
+    char *start = trap_slot_start(&trap.blocks[c], c, slot);
+    char *p = addr;
+    if (p < start || p >= start + ((size_t) 1 << c) * getpagesize())
+        return TRAP_FAULT_OUTSIDE;   // guard page
+    if (trap.blocks[c].slot[slot].next == TRAP_BUSY)
+        return TRAP_FAULT_OUTSIDE;   // page of the slot not used by the block
+    return TRAP_FAULT_FREED;
+}
 
-    mprotect(buf_start, size, flags);
+static void trap_lock(void)
+{
+    __real_pthread_mutex_lock(&trap.lock);
+}
 
-    return buf_start;
+static void trap_unlock(void)
+{
+    __real_pthread_mutex_unlock(&trap.lock);
 }
 
-int free_trap(void *ptr, size_t size)
+void trap_atfork()
 {
-    return munmap(ptr, size);
+    pthread_atfork(trap_lock, trap_unlock, trap_unlock);
 }
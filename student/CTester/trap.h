@@ -1,3 +1,6 @@
+#include <stdbool.h>
+#include <stddef.h>
+
 enum {
     TRAP_LEFT,
     TRAP_RIGHT
@@ -5,4 +8,33 @@ enum {
 
 
 void *trap_buffer(size_t size, int type, int flags, void *data);
+// releases a buffer returned by trap_buffer, size is ignored. Returns 0,
+// or -1 with errno set to EINVAL if ptr is not a buffer of trap_buffer
+// or was already released.
 int free_trap(void *ptr, size_t size);
+
+// Guarded blocks of malloc, when monitored.malloc_guard is set (see
+// wrap_malloc.c). The guard page is on the side given by type.
+
+// readable and writable block of size bytes, zeroed and aligned like
+// malloc. NULL if it cannot be guarded
+void *trap_alloc(size_t size, int type);
+// true if ptr was returned by trap_alloc and not retired. Sets size
+// (if not NULL) to its size
+bool trap_allocated(void *ptr, size_t *size);
+// makes the block ptr inaccessible, false if it is not an allocated block
+bool trap_retire(void *ptr);
+// gives back the slot of the block ptr, retired or not, false if ptr is not a block
+bool trap_release(void *ptr);
+
+enum {
+    TRAP_FAULT_NONE,     // not in a guarded block
+    TRAP_FAULT_OUTSIDE,  // before or after a block
+    TRAP_FAULT_FREED,    // in a block which was freed
+};
+
+// kind of the invalid access to addr, for the handler of SIGSEGV
+int trap_fault(void *addr);
+
+// makes fork wait until no thread holds the lock of the slots
+void trap_atfork();
@@ -0,0 +1,369 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#include "wrap.h"
+#include "vfs.h"
+
+/*
+ * Each file is a memfd. open reopens it through /proc/self/fd, which
+ * gives a new open file description, with its own offset and flags,
+ * like opening a file on disk. The descriptors kept by the filesystem
+ * are not visible to the student's code, which cannot close them.
+ */
+
+int __real_open(const char *pathname, int flags, mode_t mode);
+ssize_t __real_write(int fd, const void *buf, size_t count);
+int __real_close(int fd);
+int __real_fstat(int fd, struct stat *buf);
+off_t __real_lseek(int fd, off_t offset, int whence);
+ssize_t __real_pwrite(int fd, const void *buf, size_t count, off_t offset);
+int __real_ftruncate(int fd, off_t length);
+int __real_fcntl(int fd, int cmd, ...);
+void *__real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int __real_munmap(void *addr, size_t length);
+int __real_pthread_mutex_lock(pthread_mutex_t *mutex);
+int __real_pthread_mutex_unlock(pthread_mutex_t *mutex);
+
+extern bool wrap_monitoring;
+
+struct vfs_file_t {
+    char path[VFS_PATH_MAX];  // empty if the slot is free
+    int fd;
+    mode_t mode;
+    char *map;                // content returned by vfs_read_file
+    size_t map_len;
+};
+
+static struct {
+    bool enabled;
+    pthread_mutex_t lock;
+    struct vfs_file_t files[VFS_FILES_MAX];
+} vfs = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void vfs_lock(void)
+{
+    __real_pthread_mutex_lock(&vfs.lock);
+}
+
+static void vfs_unlock(void)
+{
+    __real_pthread_mutex_unlock(&vfs.lock);
+}
+
+void vfs_atfork()
+{
+    pthread_atfork(vfs_lock, vfs_unlock, vfs_unlock);
+}
+
+bool vfs_active()
+{
+    return vfs.enabled && wrap_monitoring;
+}
+
+void vfs_enable()
+{
+    vfs.enabled = true;
+}
+
+// "./f.dat" and "f.dat" are the same file
+static const char *vfs_path(const char *path)
+{
+    while (path[0] == '.' && path[1] == '/')
+        path += 2;
+    return path;
+}
+
+static struct vfs_file_t *vfs_find(const char *path)
+{
+    path = vfs_path(path);
+    for (int i = 0; i < VFS_FILES_MAX; i++) {
+        if (vfs.files[i].path[0] != '\0' && strcmp(vfs.files[i].path, path) == 0)
+            return &vfs.files[i];
+    }
+    return NULL;
+}
+
+static void vfs_unmap(struct vfs_file_t *f)
+{
+    if (f->map != NULL && f->map_len > 0)
+        __real_munmap(f->map, f->map_len);
+    f->map = NULL;
+    f->map_len = 0;
+}
+
+// umask of the process, which can only be read by setting it
+static mode_t vfs_umask(void)
+{
+    mode_t mask = umask(0);
+    umask(mask);
+    return mask;
+}
+
+// new empty file, NULL with errno set if there is no room
+static struct vfs_file_t *vfs_create(const char *path, mode_t mode)
+{
+    path = vfs_path(path);
+    if (strlen(path) >= VFS_PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    for (int i = 0; i < VFS_FILES_MAX; i++) {
+        struct vfs_file_t *f = &vfs.files[i];
+        if (f->path[0] != '\0')
+            continue;
+        f->fd = memfd_create(path, MFD_CLOEXEC);
+        if (f->fd < 0)
+            return NULL;
+        strcpy(f->path, path);
+        f->mode = mode & ~vfs_umask() & 07777;
+        f->map = NULL;
+        f->map_len = 0;
+        return f;
+    }
+    errno = ENOSPC;
+    return NULL;
+}
+
+static void vfs_remove(struct vfs_file_t *f)
+{
+    vfs_unmap(f);
+    __real_close(f->fd);
+    f->path[0] = '\0';
+}
+
+int vfs_write_file(const char *path, const void *data, size_t len)
+{
+    __real_pthread_mutex_lock(&vfs.lock);
+    struct vfs_file_t *f = vfs_find(path);
+    if (f == NULL)
+        f = vfs_create(path, 0644);
+    int ret = -1;
+    if (f != NULL && __real_ftruncate(f->fd, 0) == 0) {
+        ret = 0;
+        for (size_t done = 0; done < len && ret == 0; ) {
+            ssize_t n = __real_pwrite(f->fd, (const char *) data + done, len - done, done);
+            if (n < 0)
+                ret = -1;
+            else
+                done += n;
+        }
+    }
+    __real_pthread_mutex_unlock(&vfs.lock);
+    return ret;
+}
+
+const char *vfs_read_file(const char *path, size_t *len)
+{
+    __real_pthread_mutex_lock(&vfs.lock);
+    struct vfs_file_t *f = vfs_find(path);
+    const char *content = NULL;
+    *len = 0;
+    if (f != NULL) {
+        vfs_unmap(f);
+        struct stat st;
+        content = "";
+        if (__real_fstat(f->fd, &st) == 0 && st.st_size > 0) {
+            void *map = __real_mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, f->fd, 0);
+            if (map != MAP_FAILED) {
+                f->map = map;
+                f->map_len = st.st_size;
+                content = map;
+                *len = st.st_size;
+            }
+        }
+    }
+    __real_pthread_mutex_unlock(&vfs.lock);
+    return content;
+}
+
+bool vfs_exists(const char *path)
+{
+    __real_pthread_mutex_lock(&vfs.lock);
+    bool exists = vfs_find(path) != NULL;
+    __real_pthread_mutex_unlock(&vfs.lock);
+    return exists;
+}
+
+int vfs_chmod(const char *path, mode_t mode)
+{
+    __real_pthread_mutex_lock(&vfs.lock);
+    struct vfs_file_t *f = vfs_find(path);
+    if (f != NULL)
+        f->mode = mode & 07777;
+    __real_pthread_mutex_unlock(&vfs.lock);
+    return f != NULL ? 0 : -1;
+}
+
+int vfs_unlink(const char *path)
+{
+    __real_pthread_mutex_lock(&vfs.lock);
+    struct vfs_file_t *f = vfs_find(path);
+    if (f != NULL)
+        vfs_remove(f);
+    __real_pthread_mutex_unlock(&vfs.lock);
+    return f != NULL ? 0 : -1;
+}
+
+void vfs_reset()
+{
+    for (int i = 0; i < VFS_FILES_MAX; i++) {
+        if (vfs.files[i].path[0] != '\0')
+            vfs_remove(&vfs.files[i]);
+    }
+    vfs.enabled = false;
+}
+
+// true if the owner of f may open it with flags
+static bool vfs_allowed(struct vfs_file_t *f, int flags)
+{
+    int access = flags & O_ACCMODE;
+    if (access != O_WRONLY && !(f->mode & S_IRUSR))
+        return false;
+    if ((access != O_RDONLY || (flags & O_TRUNC)) && !(f->mode & S_IWUSR))
+        return false;
+    return true;
+}
+
+/*
+ * The permissions of an existing file are checked here, as those of the
+ * memfds are not used. A file created by open may be written with the
+ * descriptor returned, whatever its mode.
+ */
+int vfs_open(const char *path, int flags, mode_t mode)
+{
+    __real_pthread_mutex_lock(&vfs.lock);
+    struct vfs_file_t *f = vfs_find(path);
+    int fd = -1;
+    if (f == NULL && !(flags & O_CREAT))
+        errno = ENOENT;
+    else if (f != NULL && (flags & O_CREAT) && (flags & O_EXCL))
+        errno = EEXIST;
+    else if (f != NULL && !vfs_allowed(f, flags))
+        errno = EACCES;
+    else if (f != NULL || (f = vfs_create(path, mode)) != NULL) {
+        char proc[64];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", f->fd);
+        fd = __real_open(proc, flags & ~(O_CREAT | O_EXCL), 0);
+    }
+    __real_pthread_mutex_unlock(&vfs.lock);
+    return fd;
+}
+
+int vfs_stat(const char *path, struct stat *buf)
+{
+    __real_pthread_mutex_lock(&vfs.lock);
+    struct vfs_file_t *f = vfs_find(path);
+    int ret = -1;
+    if (f == NULL) {
+        errno = ENOENT;
+    } else if ((ret = __real_fstat(f->fd, buf)) == 0) {
+        buf->st_mode = S_IFREG | f->mode;
+    }
+    __real_pthread_mutex_unlock(&vfs.lock);
+    return ret;
+}
+
+// the mode of a file of the filesystem is the one it was created with
+int vfs_fstat(int fd, struct stat *buf)
+{
+    int ret = __real_fstat(fd, buf);
+    if (ret != 0 || !S_ISREG(buf->st_mode))
+        return ret;
+    __real_pthread_mutex_lock(&vfs.lock);
+    for (int i = 0; i < VFS_FILES_MAX; i++) {
+        struct vfs_file_t *f = &vfs.files[i];
+        struct stat st;
+        if (f->path[0] != '\0' && __real_fstat(f->fd, &st) == 0
+            && st.st_dev == buf->st_dev && st.st_ino == buf->st_ino) {
+            buf->st_mode = S_IFREG | f->mode;
+            break;
+        }
+    }
+    __real_pthread_mutex_unlock(&vfs.lock);
+    return ret;
+}
+
+/*
+ * Called in a child forked by the explorer of failures, which would
+ * otherwise share its files with the parent and the other children:
+ * each file is copied to a new memfd, and the descriptors of the
+ * student's code which refer to a file of the filesystem, or to a
+ * regular file on disk, are reopened with the same flags and offset, so
+ * that they get their own open file description. The content of the
+ * files on disk, and the pipes and sockets, stay shared.
+ */
+void vfs_fork_child()
+{
+    __real_pthread_mutex_lock(&vfs.lock);
+    int copy[VFS_FILES_MAX];
+    struct stat st[VFS_FILES_MAX];
+    for (int i = 0; i < VFS_FILES_MAX; i++) {
+        struct vfs_file_t *f = &vfs.files[i];
+        copy[i] = -1;
+        if (f->path[0] == '\0' || __real_fstat(f->fd, &st[i]) != 0)
+            continue;
+        copy[i] = memfd_create(f->path, MFD_CLOEXEC);
+        off_t off = 0;
+        if (copy[i] >= 0 && sendfile(copy[i], f->fd, &off, st[i].st_size) != st[i].st_size) {
+            __real_close(copy[i]);
+            copy[i] = -1;
+        }
+    }
+
+    DIR *dir = opendir("/proc/self/fd");
+    struct dirent *d;
+    while (dir != NULL && (d = readdir(dir)) != NULL) {
+        int fd = atoi(d->d_name);
+        struct stat fd_st;
+        if (d->d_name[0] == '.' || fd == dirfd(dir) || __real_fstat(fd, &fd_st) != 0
+            || !S_ISREG(fd_st.st_mode))
+            continue;
+        int source = fd;
+        for (int i = 0; i < VFS_FILES_MAX; i++) {
+            if (vfs.files[i].path[0] == '\0')
+                continue;
+            if (fd == vfs.files[i].fd || fd == copy[i]) {
+                source = -1;
+                break;
+            }
+            if (copy[i] >= 0 && fd_st.st_dev == st[i].st_dev && fd_st.st_ino == st[i].st_ino) {
+                source = copy[i];
+                break;
+            }
+        }
+        if (source < 0)
+            continue;
+        int flags = __real_fcntl(fd, F_GETFL);
+        int fd_flags = __real_fcntl(fd, F_GETFD);
+        off_t offset = __real_lseek(fd, 0, SEEK_CUR);
+        char proc[64];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", source);
+        int reopened = __real_open(proc, flags & ~(O_CREAT | O_EXCL | O_TRUNC), 0);
+        if (reopened < 0)
+            continue;
+        if (offset > 0)
+            __real_lseek(reopened, offset, SEEK_SET);
+        dup3(reopened, fd, fd_flags & FD_CLOEXEC ? O_CLOEXEC : 0);
+        __real_close(reopened);
+    }
+    if (dir != NULL)
+        closedir(dir);
+
+    for (int i = 0; i < VFS_FILES_MAX; i++) {
+        if (copy[i] < 0)
+            continue;
+        __real_close(vfs.files[i].fd);
+        vfs.files[i].fd = copy[i];
+    }
+    __real_pthread_mutex_unlock(&vfs.lock);
+}
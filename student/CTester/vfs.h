@@ -0,0 +1,45 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// In-memory filesystem for the sandboxes. Once enabled, open, creat
+// and stat only see its files, which are prepared and inspected by the
+// test with the functions below. The descriptors returned by open are
+// real ones, of memory files, so that read, write, lseek, fstat and
+// close work unchanged. A file created by open has the mode given to
+// open, without the bits of the umask, as returned by stat and fstat.
+// The files are removed at the end of each test.
+
+#define VFS_FILES_MAX 64
+#define VFS_PATH_MAX 256
+
+// enables the filesystem for the sandboxes of the current test
+void vfs_enable();
+// creates the file path, or replaces its content, with len bytes of
+// data. Returns 0, or -1 with errno set.
+int vfs_write_file(const char *path, const void *data, size_t len);
+// content of the file path, NULL if it does not exist. The buffer is
+// read-only, and valid until the file is read again or removed.
+const char *vfs_read_file(const char *path, size_t *len);
+// true if the file path exists
+bool vfs_exists(const char *path);
+// removes the file path, returns 0 or -1 if it does not exist
+int vfs_unlink(const char *path);
+// sets the permissions of the file path, returns 0 or -1 if it does
+// not exist. open fails with EACCES if the owner may not read or write
+// the file as requested, even when the tests run as root.
+int vfs_chmod(const char *path, mode_t mode);
+// removes all the files and disables the filesystem, called by start_test
+void vfs_reset();
+
+// makes fork wait until no thread holds the lock of the files
+void vfs_atfork();
+// gives a child forked by the explorer of failures its own files
+void vfs_fork_child();
+
+// used by the file wrappers
+bool vfs_active();
+int vfs_open(const char *path, int flags, mode_t mode);
+int vfs_stat(const char *path, struct stat *buf);
+int vfs_fstat(int fd, struct stat *buf);
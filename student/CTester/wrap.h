@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <errno.h>
+#include <pthread.h>
 
 // headers for all stats
 
@@ -10,6 +11,7 @@
 #include "wrap_malloc.h"
 #include "wrap_mutex.h"
 #include "wrap_sleep.h"
+#include "wrap_thread.h"
 
 // Basic structures for system call wrapper
 // verifies whether the system call needs to be monitored. Each
@@ -27,28 +29,105 @@ struct wrap_monitor_t {
   bool stat;
   bool fstat;
   bool lseek;
+  bool pread;
+  bool pwrite;
+  bool lstat;
+  bool dup;
+  bool dup2;
+  bool fcntl;
+  bool fsync;
+  bool ftruncate;
+  bool mmap;
+  bool munmap;
+  bool fopen;
+  bool fclose;
+  bool fdopen;
+  bool freopen;
+  bool tmpfile;
   bool free;
   bool malloc;
   bool calloc;
   bool realloc;
+  bool strdup;
+  bool strndup;
+  bool aligned_alloc;
+  bool posix_memalign;
+  bool reallocarray;
+  // malloc, calloc and realloc return blocks followed by a guard page
+  // (preceded by one if malloc_guard_left is set), see wrap_malloc.c
+  bool malloc_guard;
+  bool malloc_guard_left;
   bool pthread_mutex_lock;
   bool pthread_mutex_trylock;
   bool pthread_mutex_unlock;
   bool pthread_mutex_init;
   bool pthread_mutex_destroy;
   bool sleep;
+  bool pthread_create;
+  bool pthread_join;
+  bool pthread_exit;
+  bool pthread_cond_wait;
+  bool pthread_cond_signal;
+  bool pthread_cond_broadcast;
+  // contention profile of the mutexes (see wrap_mutex.h), independent of
+  // the statistics of pthread_mutex_lock, trylock and unlock
+  bool pthread_mutex_profile;
+  // aborts the sandbox as soon as the mutexes can deadlock, see wrap_mutex.c
+  bool pthread_mutex_deadlock;
+  // I/O profile of the file descriptors (see wrap_file.h), independent
+  // of the statistics of read, write and lseek
+  bool file_profile;
 };
 
-#define MAX_LOG 1000
-
 // log for specific system calls
+
+// malloc log: open-addressing hash table indexed by pointer, with
+// linear probing. It grows without limit (load factor <= 1/2), so
+// insertion, lookup and deletion are O(1) on average. Empty slots
+// have ptr == NULL. The table is allocated with __real_calloc and
+// released by malloc_log_reset() at the beginning of each test.
 struct malloc_t {
-    int n;
-    struct malloc_elem_t log[MAX_LOG];
+    size_t n;      // number of blocks currently allocated
+    size_t bytes;  // total size of the blocks currently allocated
+    size_t cap;    // number of slots in log (0 or a power of two)
+    uint64_t changes; // number of insertions and deletions
+    struct malloc_elem_t *log;
+};
+
+// callsites of the logged allocations, hash table indexed by caller
+struct malloc_sites_t {
+    size_t n;
+    size_t cap;
+    struct malloc_site_t *sites;
+};
+
+// mutex profiles, fixed size hash table indexed by mutex. Slots are
+// claimed with a compare and swap, and never released during a test.
+#define MUTEX_PROFILE_MAX 256
+
+struct mutex_profiles_t {
+    int n;        // number of mutexes profiled
+    int dropped;  // acquisitions not profiled because the table was full
+    struct mutex_profile_t profiles[MUTEX_PROFILE_MAX];
+};
+
+// file profiles, in the order the descriptors were opened. current maps
+// each open descriptor to 1 + the index of its profile, 0 if none.
+#define FILE_PROFILE_MAX 64
+#define FILE_FDS_MAX 1024
+
+struct file_profiles_t {
+    int n;        // number of profiles
+    int dropped;  // transfers not profiled because the table was full
+    int current[FILE_FDS_MAX];
+    struct file_profile_t profiles[FILE_PROFILE_MAX];
 };
 
 struct wrap_log_t {
   struct malloc_t malloc;
+  struct malloc_sites_t malloc_sites;
+  struct mutex_profiles_t mutex;
+  struct file_profiles_t file;
 } ;
 
 
@@ -68,56 +147,211 @@ struct wrap_log_t {
 
 #define FAIL(v) (((v & 0b00000000000000000000000000000001) == 0b00000000000000000000000000000001) )
 #define NEXT(v) (v==FAIL_ALWAYS ? FAIL_ALWAYS : v >> 1)
+
+// Beyond the first 32 calls, a schedule can also make a call fail.
+// Each call is counted (from 1, since the schedule was set), and fails
+// if its bit of the bitmask is set, or if one of the triggers of the
+// schedule matches, in constant time:
+//  - nth: the nth call fails
+//  - from, to: the calls from from to to (included) fail
+//  - every: one call out of every fails (the every-th, 2*every-th...)
+//  - probability: each call fails with this probability, drawn from
+//    seed and the number of the call, so that a seed always makes the
+//    same calls fail
+//  - after_bytes: the calls fail once after_bytes bytes have been
+//    passed to the calls that did not fail (read and write count, or
+//    size of an allocation)
+// A trigger set to 0 is disabled. For instance,
+// failures.write_schedule=FAIL_NTH(5000) makes the 5000th write fail.
+
+struct fail_schedule_t {
+  uint64_t nth;
+  uint64_t from, to;
+  uint64_t every;
+  double probability;
+  uint64_t seed;
+  size_t after_bytes;
+  uint64_t calls;     // number of calls so far
+  uint64_t bytes;     // bytes passed to the calls that did not fail
+};
+
+#define FAIL_NTH(n) ((struct fail_schedule_t) { .nth=(n) })
+#define FAIL_RANGE(first, last) ((struct fail_schedule_t) { .from=(first), .to=(last) })
+#define FAIL_EVERY(k) ((struct fail_schedule_t) { .every=(k) })
+#define FAIL_PROBABILITY(p, s) ((struct fail_schedule_t) { .probability=(p), .seed=(s) })
+#define FAIL_AFTER_BYTES(n) ((struct fail_schedule_t) { .after_bytes=(n) })
+
+// true if the next call fails, according to mask (which is shifted) and
+// schedule. bytes is the size passed to the call, for after_bytes.
+bool fail_call(uint32_t *mask, struct fail_schedule_t *schedule, size_t bytes);
+
 struct wrap_fail_t {
   // bool getpid - this call cannot fail
   uint32_t open;  // indicates whether next open will fail
+  struct fail_schedule_t open_schedule; // other calls that fail, see fail_schedule_t
   int open_ret;   // return value if open fails
   int open_errno; // errno value set if open fails
 
   uint32_t creat;
+  struct fail_schedule_t creat_schedule;
   int creat_ret;
   int creat_errno;
 
   uint32_t close;
+  struct fail_schedule_t close_schedule;
   int close_ret;
   int close_errno;
 
   uint32_t read;
+  struct fail_schedule_t read_schedule;
   int read_ret;
   int read_errno;
 
   uint32_t write;
+  struct fail_schedule_t write_schedule;
   int write_ret;
   int write_errno;
 
   uint32_t stat;
+  struct fail_schedule_t stat_schedule;
   int stat_ret;
   int stat_errno;
 
   uint32_t fstat;
+  struct fail_schedule_t fstat_schedule;
   int fstat_ret;
   int fstat_errno;
 
   uint32_t lseek;
+  struct fail_schedule_t lseek_schedule;
   int lseek_ret;
   int lseek_errno;
 
+  uint32_t pread;
+  struct fail_schedule_t pread_schedule;
+  int pread_ret;
+  int pread_errno;
+
+  uint32_t pwrite;
+  struct fail_schedule_t pwrite_schedule;
+  int pwrite_ret;
+  int pwrite_errno;
+
+  uint32_t lstat;
+  struct fail_schedule_t lstat_schedule;
+  int lstat_ret;
+  int lstat_errno;
+
+  uint32_t dup;
+  struct fail_schedule_t dup_schedule;
+  int dup_ret;
+  int dup_errno;
+
+  uint32_t dup2;
+  struct fail_schedule_t dup2_schedule;
+  int dup2_ret;
+  int dup2_errno;
+
+  uint32_t fcntl;
+  struct fail_schedule_t fcntl_schedule;
+  int fcntl_ret;
+  int fcntl_errno;
+
+  uint32_t fsync;
+  struct fail_schedule_t fsync_schedule;
+  int fsync_ret;
+  int fsync_errno;
+
+  uint32_t ftruncate;
+  struct fail_schedule_t ftruncate_schedule;
+  int ftruncate_ret;
+  int ftruncate_errno;
+
+  uint32_t mmap;
+  struct fail_schedule_t mmap_schedule;
+  void *mmap_ret;    // MAP_FAILED by default
+  int mmap_errno;    // ENOMEM by default
+
+  uint32_t munmap;
+  struct fail_schedule_t munmap_schedule;
+  int munmap_ret;
+  int munmap_errno;
+
+  uint32_t fopen;
+  struct fail_schedule_t fopen_schedule;
+  FILE *fopen_ret;
+  int fopen_errno;
+
+  uint32_t fclose;
+  struct fail_schedule_t fclose_schedule;
+  int fclose_ret;
+  int fclose_errno;
+
+  uint32_t fdopen;
+  struct fail_schedule_t fdopen_schedule;
+  FILE *fdopen_ret;
+  int fdopen_errno;
+
+  uint32_t freopen;
+  struct fail_schedule_t freopen_schedule;
+  FILE *freopen_ret;
+  int freopen_errno;
+
+  uint32_t tmpfile;
+  struct fail_schedule_t tmpfile_schedule;
+  FILE *tmpfile_ret;
+  int tmpfile_errno;
+
   uint32_t malloc;
+  struct fail_schedule_t malloc_schedule;
   void *malloc_ret;
 
   uint32_t calloc;
+  struct fail_schedule_t calloc_schedule;
   void *calloc_ret;
   
   uint32_t realloc;
+  struct fail_schedule_t realloc_schedule;
   void *realloc_ret;
 
   uint32_t free;
+  struct fail_schedule_t free_schedule;
+
+  uint32_t strdup;
+  struct fail_schedule_t strdup_schedule;
+  char *strdup_ret;
+
+  uint32_t strndup;
+  struct fail_schedule_t strndup_schedule;
+  char *strndup_ret;
 
+  uint32_t aligned_alloc;
+  struct fail_schedule_t aligned_alloc_schedule;
+  void *aligned_alloc_ret;
+
+  uint32_t posix_memalign;
+  struct fail_schedule_t posix_memalign_schedule;
+  int posix_memalign_ret;
+
+  uint32_t reallocarray;
+  struct fail_schedule_t reallocarray_schedule;
+  void *reallocarray_ret;
+
+  // maximum number of bytes allocated by the monitored allocation
+  // functions and anonymous mmap (monitored or not), 0 for no limit. Allocations above it
+  // fail with errno set to ENOMEM.
+  size_t memory_budget;
+
+  // the pthread functions return the error instead of setting errno:
+  // a failed call returns its _ret, or if it is 0, EAGAIN for lock,
+  // EBUSY for trylock and ENOMEM for init, without changing the mutex
   uint32_t pthread_mutex_lock;
+  struct fail_schedule_t pthread_mutex_lock_schedule;
   int pthread_mutex_lock_ret;
   int pthread_mutex_lock_errno;
 
   uint32_t pthread_mutex_trylock;
+  struct fail_schedule_t pthread_mutex_trylock_schedule;
   int pthread_mutex_trylock_ret;
   int pthread_mutex_trylock_errno;
 
@@ -126,6 +360,7 @@ struct wrap_fail_t {
   int pthread_mutex_unlock_errno;
 
   uint32_t pthread_mutex_init;
+  struct fail_schedule_t pthread_mutex_init_schedule;
   int pthread_mutex_init_ret;
   int pthread_mutex_init_errno;
 
@@ -134,12 +369,27 @@ struct wrap_fail_t {
   int pthread_mutex_destroy_errno;
 
   uint32_t sleep;
+  struct fail_schedule_t sleep_schedule;
   unsigned int sleep_ret;
 
 } ;
 
+// sets the return values and errno of the failed calls in f to those of
+// the real functions (-1 and EIO, NULL and ENOMEM, MAP_FAILED...), used
+// by the explorer of failures
+void fail_natural(struct wrap_fail_t *f);
+
+
+// resources used by the sandboxes of the current test
+
+struct stats_sandbox_t {
+  uint64_t timeout_us;      // CPU time limit of the last sandbox, in us
+  uint64_t cpu_time;        // CPU time consumed by the last sandbox, in ns
+  uint64_t total_cpu_time;  // CPU time consumed by all the sandboxes of the test, in ns
+};
 
 struct wrap_stats_t {
+  struct stats_sandbox_t sandbox;
   struct stats_getpid_t getpid;
   struct stats_open_t open;
   struct stats_creat_t creat;
@@ -149,15 +399,63 @@ struct wrap_stats_t {
   struct stats_stat_t stat;
   struct stats_fstat_t fstat;
   struct stats_lseek_t lseek;
+  struct stats_pread_t pread;
+  struct stats_pwrite_t pwrite;
+  struct stats_lstat_t lstat;
+  struct stats_dup_t dup;
+  struct stats_dup2_t dup2;
+  struct stats_fcntl_t fcntl;
+  struct stats_fsync_t fsync;
+  struct stats_ftruncate_t ftruncate;
+  struct stats_mmap_t mmap;
+  struct stats_munmap_t munmap;
+  struct stats_fopen_t fopen;
+  struct stats_fclose_t fclose;
+  struct stats_fdopen_t fdopen;
+  struct stats_freopen_t freopen;
+  struct stats_tmpfile_t tmpfile;
   struct stats_malloc_t malloc;
   struct stats_calloc_t calloc;
   struct stats_memory_t memory;
   struct stats_free_t free;
   struct stats_realloc_t realloc;
+  struct stats_strdup_t strdup;
+  struct stats_strndup_t strndup;
+  struct stats_aligned_alloc_t aligned_alloc;
+  struct stats_posix_memalign_t posix_memalign;
+  struct stats_reallocarray_t reallocarray;
   struct stats_pthread_mutex_lock_t pthread_mutex_lock;
   struct stats_pthread_mutex_trylock_t pthread_mutex_trylock;
   struct stats_pthread_mutex_unlock_t pthread_mutex_unlock;
   struct stats_pthread_mutex_unlock_t pthread_mutex_init;
   struct stats_pthread_mutex_unlock_t pthread_mutex_destroy;
   struct stats_sleep_t sleep;
+  struct stats_pthread_create_t pthread_create;
+  struct stats_pthread_join_t pthread_join;
+  struct stats_pthread_exit_t pthread_exit;
+  struct stats_threads_t threads;
+  struct stats_pthread_cond_t pthread_cond_wait;
+  struct stats_pthread_cond_t pthread_cond_signal;
+  struct stats_pthread_cond_t pthread_cond_broadcast;
 };
+
+// Statistics to be updated by the wrapper of function f in the calling
+// thread, see wrap_stats.c. A wrapper calls it once, then updates the
+// fields of f in the returned structure.
+#define STATS_SHARD(f) stats_shard(offsetof(struct wrap_stats_t, f))
+
+struct wrap_stats_t *stats_shard(size_t offset);
+// the calling thread updates stats directly, called by sandbox_begin
+void stats_sandbox_thread();
+// adds the statistics of the other threads to stats, called by sandbox_end
+void stats_merge();
+// thread running the sandbox, set by stats_sandbox_thread
+extern pthread_t sandbox_thread;
+
+// aborts the sandbox after a deadlock detected by the wrappers, with msg
+// for the student. It only returns in another thread than the sandbox
+// one, after signalling it.
+void sandbox_deadlock(const char *msg);
+// restarts the timers of the sandbox and drops the output, in a child
+// forked in the sandbox
+void sandbox_fork_child();
@@ -0,0 +1,153 @@
+/*
+ * Failures of the wrapped calls
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#include "wrap.h"
+#include "explore.h"
+
+extern struct wrap_fail_t failures;
+
+// names of the functions, from the offset of their bitmask in failures
+struct fail_name_t {
+  size_t offset;
+  const char *name;
+};
+
+#define FAIL_NAME(f) { offsetof(struct wrap_fail_t, f), #f }
+
+static const struct fail_name_t fail_names[] = {
+  FAIL_NAME(open),
+  FAIL_NAME(creat),
+  FAIL_NAME(close),
+  FAIL_NAME(read),
+  FAIL_NAME(write),
+  FAIL_NAME(stat),
+  FAIL_NAME(fstat),
+  FAIL_NAME(lseek),
+  FAIL_NAME(pread),
+  FAIL_NAME(pwrite),
+  FAIL_NAME(lstat),
+  FAIL_NAME(dup),
+  FAIL_NAME(dup2),
+  FAIL_NAME(fcntl),
+  FAIL_NAME(fsync),
+  FAIL_NAME(ftruncate),
+  FAIL_NAME(mmap),
+  FAIL_NAME(munmap),
+  FAIL_NAME(fopen),
+  FAIL_NAME(fclose),
+  FAIL_NAME(fdopen),
+  FAIL_NAME(freopen),
+  FAIL_NAME(tmpfile),
+  FAIL_NAME(malloc),
+  FAIL_NAME(calloc),
+  FAIL_NAME(realloc),
+  FAIL_NAME(free),
+  FAIL_NAME(strdup),
+  FAIL_NAME(strndup),
+  FAIL_NAME(aligned_alloc),
+  FAIL_NAME(posix_memalign),
+  FAIL_NAME(reallocarray),
+  FAIL_NAME(pthread_mutex_lock),
+  FAIL_NAME(pthread_mutex_trylock),
+  FAIL_NAME(pthread_mutex_init),
+  FAIL_NAME(sleep),
+};
+
+static const char *fail_name(uint32_t *mask) {
+  size_t offset=(char *) mask-(char *) &failures;
+  for(size_t i=0;i<sizeof(fail_names)/sizeof(fail_names[0]);i++) {
+    if(fail_names[i].offset==offset)
+      return fail_names[i].name;
+  }
+  return "?";
+}
+
+void fail_natural(struct wrap_fail_t *f) {
+  f->open_ret=-1;      f->open_errno=ENOENT;
+  f->creat_ret=-1;     f->creat_errno=ENOSPC;
+  f->close_ret=-1;     f->close_errno=EIO;
+  f->read_ret=-1;      f->read_errno=EIO;
+  f->write_ret=-1;     f->write_errno=ENOSPC;
+  f->stat_ret=-1;      f->stat_errno=ENOENT;
+  f->fstat_ret=-1;     f->fstat_errno=EIO;
+  f->lseek_ret=-1;     f->lseek_errno=EINVAL;
+  f->pread_ret=-1;     f->pread_errno=EIO;
+  f->pwrite_ret=-1;    f->pwrite_errno=ENOSPC;
+  f->lstat_ret=-1;     f->lstat_errno=ENOENT;
+  f->dup_ret=-1;       f->dup_errno=EMFILE;
+  f->dup2_ret=-1;      f->dup2_errno=EMFILE;
+  f->fcntl_ret=-1;     f->fcntl_errno=EINVAL;
+  f->fsync_ret=-1;     f->fsync_errno=EIO;
+  f->ftruncate_ret=-1; f->ftruncate_errno=EIO;
+  f->mmap_ret=MAP_FAILED; f->mmap_errno=ENOMEM;
+  f->munmap_ret=-1;    f->munmap_errno=EINVAL;
+  f->fopen_ret=NULL;   f->fopen_errno=ENOENT;
+  f->fclose_ret=EOF;   f->fclose_errno=EIO;
+  f->fdopen_ret=NULL;  f->fdopen_errno=ENOMEM;
+  f->freopen_ret=NULL; f->freopen_errno=ENOENT;
+  f->tmpfile_ret=NULL; f->tmpfile_errno=ENOSPC;
+  // the allocation functions set errno to ENOMEM when they fail
+  f->malloc_ret=NULL;
+  f->calloc_ret=NULL;
+  f->realloc_ret=NULL;
+  f->strdup_ret=NULL;
+  f->strndup_ret=NULL;
+  f->aligned_alloc_ret=NULL;
+  f->posix_memalign_ret=ENOMEM;
+  f->reallocarray_ret=NULL;
+  // 0 is their default error, see wrap_mutex.c
+  f->pthread_mutex_lock_ret=0;
+  f->pthread_mutex_trylock_ret=0;
+  f->pthread_mutex_init_ret=0;
+}
+
+// splitmix64, a random number from the seed and the number of the call,
+// which does not depend on the order of the calls of the threads
+static uint64_t fail_random(uint64_t seed, uint64_t call) {
+  uint64_t z=seed+call*0x9E3779B97F4A7C15ULL;
+  z=(z^(z >> 30))*0xBF58476D1CE4E5B9ULL;
+  z=(z^(z >> 27))*0x94D049BB133111EBULL;
+  return z^(z >> 31);
+}
+
+bool fail_call(uint32_t *mask, struct fail_schedule_t *schedule, size_t bytes) {
+  // the explorer of failures decides alone
+  if(explore_running())
+    return explore_call(fail_name(mask));
+  bool fail=FAIL(*mask);
+  *mask=NEXT(*mask);
+  uint64_t call=__atomic_add_fetch(&schedule->calls, 1, __ATOMIC_RELAXED);
+  if(schedule->nth!=0 && call==schedule->nth)
+    fail=true;
+  if(schedule->to!=0 && call>=schedule->from && call<=schedule->to)
+    fail=true;
+  if(schedule->every!=0 && call%schedule->every==0)
+    fail=true;
+  // 53 random bits, uniform in [0, 1)
+  if(schedule->probability>0
+     && (fail_random(schedule->seed, call) >> 11)*0x1.0p-53<schedule->probability)
+    fail=true;
+  if(schedule->after_bytes!=0) {
+    if(__atomic_load_n(&schedule->bytes, __ATOMIC_RELAXED)>=schedule->after_bytes)
+      fail=true;
+    else if(!fail)
+      __atomic_add_fetch(&schedule->bytes, bytes, __ATOMIC_RELAXED);
+  }
+  return fail;
+}
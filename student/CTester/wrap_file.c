@@ -1,11 +1,20 @@
 // wrapper for the file operations, open, read, write
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <stdarg.h>
 
 #include "wrap.h"
+#include "vfs.h"
 
 int __real_open(const char *pathname, int flags, mode_t mode);
 int __real_creat(const char *pathname, mode_t mode);
@@ -18,6 +27,19 @@ int __real_lstat(const char* path, struct stat *buf);
 ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
 ssize_t __real_pwrite(int fd, const void *buf, size_t count, off_t offset);
 off_t __real_lseek(int fd, off_t offset, int whence);
+int __real_dup(int oldfd);
+int __real_dup2(int oldfd, int newfd);
+int __real_fcntl(int fd, int cmd, ...);
+int __real_fsync(int fd);
+int __real_ftruncate(int fd, off_t length);
+void *__real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int __real_munmap(void *addr, size_t length);
+FILE *__real_fopen(const char *pathname, const char *mode);
+int __real_fclose(FILE *stream);
+FILE *__real_fdopen(int fd, const char *mode);
+FILE *__real_freopen(const char *pathname, const char *mode, FILE *stream);
+FILE *__real_tmpfile(void);
+int __real_fileno(FILE *stream);
 
 extern bool wrap_monitoring;
 extern struct wrap_stats_t stats;
@@ -25,26 +47,325 @@ extern struct wrap_monitor_t monitored;
 extern struct wrap_fail_t failures;
 extern struct wrap_log_t logs;
 
+void push_info_msg(char *msg);
+
+#include <libintl.h>
+#define _(STRING) gettext(STRING)
+
+// the paths are those of the in-memory filesystem when it is enabled
+
+static int file_open(const char *pathname, int flags, mode_t mode) {
+  if(vfs_active())
+    return vfs_open(pathname, flags, mode);
+  return __real_open(pathname, flags, mode);
+}
+
+static int file_creat(const char *pathname, mode_t mode) {
+  if(vfs_active())
+    return vfs_open(pathname, O_CREAT|O_WRONLY|O_TRUNC, mode);
+  return __real_creat(pathname, mode);
+}
+
+static int file_stat(const char *path, struct stat *buf) {
+  if(vfs_active())
+    return vfs_stat(path, buf);
+  return __real_stat(path, buf);
+}
+
+static int file_lstat(const char *path, struct stat *buf) {
+  if(vfs_active())
+    return vfs_stat(path, buf);
+  return __real_lstat(path, buf);
+}
+
+static int file_fstat(int fd, struct stat *buf) {
+  if(vfs_active())
+    return vfs_fstat(fd, buf);
+  return __real_fstat(fd, buf);
+}
+
+//
+// I/O profiles, enabled by monitored.file_profile. The counters of a
+// descriptor shared by several threads are updated atomically, but its
+// offset and the pattern of its transfers are only approximate.
+//
+
+static bool file_profiled() {
+  return wrap_monitoring && monitored.file_profile;
+}
+
+static uint64_t file_now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec*1000000000+t.tv_nsec;
+}
+
+// "./f.dat" and "f.dat" are the same file
+static const char *file_path(const char *path) {
+  while(path[0]=='.' && path[1]=='/')
+    path+=2;
+  return path;
+}
+
+// new profile for fd, NULL if the table is full
+static struct file_profile_t *file_profile_new(int fd, const char *path) {
+  if(fd<0 || fd>=FILE_FDS_MAX)
+    return NULL;
+  int i=__atomic_fetch_add(&logs.file.n, 1, __ATOMIC_RELAXED);
+  if(i>=FILE_PROFILE_MAX) {
+    __atomic_store_n(&logs.file.n, FILE_PROFILE_MAX, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&logs.file.dropped, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  struct file_profile_t *p=&logs.file.profiles[i];
+  p->fd=fd;
+  p->descriptors=1;
+  if(path!=NULL)
+    snprintf(p->path, FILE_PATH_MAX, "%s", file_path(path));
+  __atomic_store_n(&logs.file.current[fd], i+1, __ATOMIC_RELEASE);
+  return p;
+}
+
+// profile of the open descriptor fd, created if needed
+static struct file_profile_t *file_profile_get(int fd) {
+  if(fd<0 || fd>=FILE_FDS_MAX)
+    return NULL;
+  int i=__atomic_load_n(&logs.file.current[fd], __ATOMIC_ACQUIRE);
+  if(i>0)
+    return &logs.file.profiles[i-1];
+  return file_profile_new(fd, NULL);
+}
+
+static void file_profile_opened(int fd, const char *path) {
+  if(fd>=0 && file_profiled())
+    file_profile_new(fd, path);
+}
+
+static void file_profile_closed(int fd) {
+  if(fd<0 || fd>=FILE_FDS_MAX)
+    return;
+  int i=__atomic_exchange_n(&logs.file.current[fd], 0, __ATOMIC_ACQ_REL);
+  if(i>0 && __atomic_sub_fetch(&logs.file.profiles[i-1].descriptors, 1, __ATOMIC_ACQ_REL)<=0)
+    logs.file.profiles[i-1].closed=true;
+}
+
+// newfd, a copy of oldfd, shares its profile. A descriptor replaced by
+// dup2 was closed.
+static void file_profile_dup(int oldfd, int newfd) {
+  if(newfd<0 || newfd==oldfd || newfd>=FILE_FDS_MAX || !file_profiled())
+    return;
+  file_profile_closed(newfd);
+  struct file_profile_t *p=file_profile_get(oldfd);
+  if(p==NULL)
+    return;
+  __atomic_add_fetch(&p->descriptors, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&logs.file.current[newfd], p-logs.file.profiles+1, __ATOMIC_RELEASE);
+}
+
+// transfer of count bytes at offset (-1 for the offset of the
+// descriptor), which returned ret after ns
+static void file_profile_io(int fd, bool write, size_t count, off_t offset, ssize_t ret, uint64_t ns) {
+  if(ret<0)
+    return;
+  struct file_profile_t *p=file_profile_get(fd);
+  if(p==NULL)
+    return;
+  struct file_io_t *io=write ? &p->write : &p->read;
+  __atomic_add_fetch(&io->calls, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&io->bytes, ret, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&io->ns, ns, __ATOMIC_RELAXED);
+  int bucket=count ? 63-__builtin_clzll(count) : 0;
+  if(bucket>=FILE_SIZE_BUCKETS)
+    bucket=FILE_SIZE_BUCKETS-1;
+  __atomic_add_fetch(&io->size_hist[bucket], 1, __ATOMIC_RELAXED);
+  if(ret==0)
+    return;
+  off_t start=offset;
+  if(offset<0) {
+    start=p->pos;
+    p->pos+=ret;
+  }
+  if(start==p->end)
+    __atomic_add_fetch(&p->sequential, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_add_fetch(&p->random, 1, __ATOMIC_RELAXED);
+  p->end=start+ret;
+}
+
+static void file_profile_seek(int fd, off_t ret) {
+  if(ret<0)
+    return;
+  struct file_profile_t *p=file_profile_get(fd);
+  if(p==NULL)
+    return;
+  if(ret!=p->pos)
+    __atomic_add_fetch(&p->seeks, 1, __ATOMIC_RELAXED);
+  p->pos=ret;
+}
+
+// the real calls, profiled
+
+static ssize_t file_read(int fd, void *buf, size_t count) {
+  if(!file_profiled())
+    return __real_read(fd, buf, count);
+  uint64_t start=file_now();
+  ssize_t ret=__real_read(fd, buf, count);
+  file_profile_io(fd, false, count, -1, ret, file_now()-start);
+  return ret;
+}
+
+static ssize_t file_write(int fd, const void *buf, size_t count) {
+  if(!file_profiled())
+    return __real_write(fd, buf, count);
+  uint64_t start=file_now();
+  ssize_t ret=__real_write(fd, buf, count);
+  file_profile_io(fd, true, count, -1, ret, file_now()-start);
+  return ret;
+}
+
+static ssize_t file_pread(int fd, void *buf, size_t count, off_t offset) {
+  if(!file_profiled())
+    return __real_pread(fd, buf, count, offset);
+  uint64_t start=file_now();
+  ssize_t ret=__real_pread(fd, buf, count, offset);
+  file_profile_io(fd, false, count, offset, ret, file_now()-start);
+  return ret;
+}
+
+static ssize_t file_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+  if(!file_profiled())
+    return __real_pwrite(fd, buf, count, offset);
+  uint64_t start=file_now();
+  ssize_t ret=__real_pwrite(fd, buf, count, offset);
+  file_profile_io(fd, true, count, offset, ret, file_now()-start);
+  return ret;
+}
+
+static off_t file_lseek(int fd, off_t offset, int whence) {
+  off_t ret=__real_lseek(fd, offset, whence);
+  if(file_profiled())
+    file_profile_seek(fd, ret);
+  return ret;
+}
+
+static int file_dup(int oldfd) {
+  int ret=__real_dup(oldfd);
+  file_profile_dup(oldfd, ret);
+  return ret;
+}
+
+static int file_dup2(int oldfd, int newfd) {
+  int ret=__real_dup2(oldfd, newfd);
+  file_profile_dup(oldfd, ret);
+  return ret;
+}
+
+static int file_fcntl(int fd, int cmd, void *arg) {
+  int ret=__real_fcntl(fd, cmd, arg);
+  if(cmd==F_DUPFD || cmd==F_DUPFD_CLOEXEC)
+    file_profile_dup(fd, ret);
+  return ret;
+}
+
+static int file_close(int fd) {
+  int ret=__real_close(fd);
+  if(ret==0)
+    file_profile_closed(fd);
+  return ret;
+}
+
+struct file_profile_t *file_profile(int fd) {
+  int current=fd>=0 && fd<FILE_FDS_MAX ? logs.file.current[fd] : 0;
+  if(current>0)
+    return &logs.file.profiles[current-1];
+  for(int i=logs.file.n-1;i>=0;i--) {
+    if(logs.file.profiles[i].fd==fd)
+      return &logs.file.profiles[i];
+  }
+  return NULL;
+}
+
+static void file_io_add(struct file_io_t *total, struct file_io_t *io) {
+  total->calls+=io->calls;
+  total->bytes+=io->bytes;
+  total->ns+=io->ns;
+  for(int i=0;i<FILE_SIZE_BUCKETS;i++)
+    total->size_hist[i]+=io->size_hist[i];
+}
+
+int file_profile_total(const char *path, struct file_profile_t *total) {
+  memset(total, 0, sizeof(*total));
+  total->fd=-1;
+  if(path!=NULL)
+    snprintf(total->path, FILE_PATH_MAX, "%s", file_path(path));
+  int nb=0;
+  for(int i=0;i<logs.file.n;i++) {
+    struct file_profile_t *p=&logs.file.profiles[i];
+    if(path!=NULL && strcmp(p->path, total->path)!=0)
+      continue;
+    file_io_add(&total->read, &p->read);
+    file_io_add(&total->write, &p->write);
+    total->seeks+=p->seeks;
+    total->sequential+=p->sequential;
+    total->random+=p->random;
+    nb++;
+  }
+  return nb;
+}
+
+double file_io_average(struct file_io_t *io) {
+  return io->calls ? (double) io->bytes/io->calls : 0;
+}
+
+static bool file_check_size(const char *path, size_t min, bool write) {
+  struct file_profile_t total;
+  file_profile_total(path, &total);
+  struct file_io_t *io=write ? &total.write : &total.read;
+  double average=file_io_average(io);
+  if(io->calls==0 || average>=min)
+    return true;
+  const char *name=path!=NULL ? total.path : _("the files");
+  char msg[512];
+  if(write)
+    snprintf(msg, sizeof(msg), _("Your code writes %s with %llu calls to write, of %.0f bytes on average. Each call is a system call, which is slow: write blocks of at least %zu bytes."),
+             name, (unsigned long long) io->calls, average, min);
+  else
+    snprintf(msg, sizeof(msg), _("Your code reads %s with %llu calls to read, of %.0f bytes on average. Each call is a system call, which is slow: read blocks of at least %zu bytes."),
+             name, (unsigned long long) io->calls, average, min);
+  push_info_msg(msg);
+  return false;
+}
+
+bool file_check_read_size(const char *path, size_t min) {
+  return file_check_size(path, min, false);
+}
+
+bool file_check_write_size(const char *path, size_t min) {
+  return file_check_size(path, min, true);
+}
+
 int __wrap_open(char *pathname, int flags, mode_t mode) {
 
   if(!wrap_monitoring || !monitored.open) {
-    return __real_open(pathname,flags,mode); 
+    int ret=file_open(pathname,flags,mode);
+    file_profile_opened(ret, pathname);
+    return ret;
   }
-  stats.open.called++;
-  stats.open.last_params.pathname=pathname;
-  stats.open.last_params.flags=flags;
-  stats.open.last_params.mode=mode;
+  struct wrap_stats_t *shard=STATS_SHARD(open);
+  shard->open.called++;
+  shard->open.last_params.pathname=pathname;
+  shard->open.last_params.flags=flags;
+  shard->open.last_params.mode=mode;
   
-  if (FAIL(failures.open)) {
-    failures.open=NEXT(failures.open);
+  if (fail_call(&failures.open, &failures.open_schedule, 0)) {
     errno=failures.open_errno;
-    stats.open.last_return=failures.open_ret;
+    shard->open.last_return=failures.open_ret;
     return failures.open_ret;
   }
-  failures.open=NEXT(failures.open);
   // did not fail
-  int ret=__real_open(pathname, flags, mode);
-  stats.open.last_return=ret;
+  int ret=file_open(pathname, flags, mode);
+  file_profile_opened(ret, pathname);
+  shard->open.last_return=ret;
   return ret;
 
 }
@@ -53,22 +374,24 @@ int __wrap_creat(char *pathname, mode_t mode) {
 
 
   if(!wrap_monitoring || !monitored.creat) {
-    return __real_creat(pathname,mode); 
+    int ret=file_creat(pathname,mode);
+    file_profile_opened(ret, pathname);
+    return ret;
   }
-  stats.creat.called++;
-  stats.creat.last_params.pathname=pathname;
-  stats.creat.last_params.mode=mode;
+  struct wrap_stats_t *shard=STATS_SHARD(creat);
+  shard->creat.called++;
+  shard->creat.last_params.pathname=pathname;
+  shard->creat.last_params.mode=mode;
   
-  if (FAIL(failures.creat)) {
-    failures.creat=NEXT(failures.creat);
+  if (fail_call(&failures.creat, &failures.creat_schedule, 0)) {
     errno=failures.creat_errno;
-    stats.creat.last_return=failures.creat_ret;
+    shard->creat.last_return=failures.creat_ret;
     return failures.creat_ret;
   }
-  failures.creat=NEXT(failures.creat);
   // did not fail
-  int ret=__real_creat(pathname, mode);
-  stats.creat.last_return=ret;
+  int ret=file_creat(pathname, mode);
+  file_profile_opened(ret, pathname);
+  shard->creat.last_return=ret;
   return ret;
 
 }
@@ -76,21 +399,20 @@ int __wrap_creat(char *pathname, mode_t mode) {
 int __wrap_close(int fd){
 
   if(!wrap_monitoring || !monitored.close) {
-    return __real_close(fd); 
+    return file_close(fd);
   }
-  stats.close.called++;
-  stats.close.last_params.fd=fd;
+  struct wrap_stats_t *shard=STATS_SHARD(close);
+  shard->close.called++;
+  shard->close.last_params.fd=fd;
   
-  if (FAIL(failures.close)) {
-    failures.close=NEXT(failures.close);
+  if (fail_call(&failures.close, &failures.close_schedule, 0)) {
     errno=failures.close_errno;
-    stats.close.last_return=failures.close_ret;
+    shard->close.last_return=failures.close_ret;
     return failures.close_ret;
   }
-  failures.close=NEXT(failures.close);
   // did not fail
-  int ret=__real_close(fd);
-  stats.close.last_return=ret;
+  int ret=file_close(fd);
+  shard->close.last_return=ret;
   return ret;
 
 }
@@ -98,23 +420,22 @@ int __wrap_close(int fd){
 ssize_t __wrap_read(int fd, void *buf, size_t count){
 
   if(!wrap_monitoring || !monitored.read) {
-    return __real_read(fd,buf,count); 
+    return file_read(fd,buf,count); 
   }
-  stats.read.called++;
-  stats.read.last_params.fd=fd;
-  stats.read.last_params.buf=buf;
-  stats.read.last_params.count=count;
+  struct wrap_stats_t *shard=STATS_SHARD(read);
+  shard->read.called++;
+  shard->read.last_params.fd=fd;
+  shard->read.last_params.buf=buf;
+  shard->read.last_params.count=count;
   
-  if (FAIL(failures.read)) {
-    failures.read=NEXT(failures.read);
+  if (fail_call(&failures.read, &failures.read_schedule, count)) {
     errno=failures.read_errno;
-    stats.read.last_return=failures.read_ret;
+    shard->read.last_return=failures.read_ret;
     return failures.read_ret;
   }
-  failures.read=NEXT(failures.read);
   // did not fail
-  int ret=__real_read(fd,buf,count);
-  stats.read.last_return=ret;
+  ssize_t ret=file_read(fd,buf,count);
+  shard->read.last_return=ret;
   return ret;
 
 }
@@ -123,23 +444,22 @@ ssize_t __wrap_read(int fd, void *buf, size_t count){
 ssize_t __wrap_write(int fd, void *buf, size_t count){
 
   if(!wrap_monitoring || !monitored.write) {
-    return __real_write(fd,buf,count); 
+    return file_write(fd,buf,count); 
   }
-  stats.write.called++;
-  stats.write.last_params.fd=fd;
-  stats.write.last_params.buf=buf;
-  stats.write.last_params.count=count;
+  struct wrap_stats_t *shard=STATS_SHARD(write);
+  shard->write.called++;
+  shard->write.last_params.fd=fd;
+  shard->write.last_params.buf=buf;
+  shard->write.last_params.count=count;
   
-  if (FAIL(failures.write)) {
-    failures.write=NEXT(failures.write);
+  if (fail_call(&failures.write, &failures.write_schedule, count)) {
     errno=failures.write_errno;
-    stats.write.last_return=failures.write_ret;
+    shard->write.last_return=failures.write_ret;
     return failures.write_ret;
   }
-  failures.write=NEXT(failures.write);
   // did not fail
-  int ret=__real_write(fd,buf,count);
-  stats.write.last_return=ret;
+  ssize_t ret=file_write(fd,buf,count);
+  shard->write.last_return=ret;
   return ret;
 
 }
@@ -147,35 +467,34 @@ ssize_t __wrap_write(int fd, void *buf, size_t count){
 int __wrap_stat(char *path, struct stat *buf) {
   
   if(!wrap_monitoring || !monitored.stat) {
-return __real_stat(path,buf); 
+return file_stat(path,buf); 
   }
-  stats.stat.called++;
-  stats.stat.last_params.path=path;
-  stats.stat.last_params.buf=buf;
+  struct wrap_stats_t *shard=STATS_SHARD(stat);
+  shard->stat.called++;
+  shard->stat.last_params.path=path;
+  shard->stat.last_params.buf=buf;
   
-  if (FAIL(failures.stat)) {
-    failures.stat=NEXT(failures.stat);
+  if (fail_call(&failures.stat, &failures.stat_schedule, 0)) {
     errno=failures.stat_errno;
-    stats.stat.last_return=failures.stat_ret;
+    shard->stat.last_return=failures.stat_ret;
     return failures.stat_ret;
   }
-  failures.stat=NEXT(failures.stat);
   // did not fail
-  int ret=__real_stat(path,buf);
-  stats.stat.returned_stat.st_dev=buf->st_dev;
-  stats.stat.returned_stat.st_ino=buf->st_ino;
-  stats.stat.returned_stat.st_mode=buf->st_mode;
-  stats.stat.returned_stat.st_nlink=buf->st_nlink;
-  stats.stat.returned_stat.st_uid=buf->st_uid;
-  stats.stat.returned_stat.st_gid=buf->st_gid;
-  stats.stat.returned_stat.st_rdev=buf->st_rdev;
-  stats.stat.returned_stat.st_size=buf->st_size;
-  stats.stat.returned_stat.st_blksize=buf->st_blksize;
-  stats.stat.returned_stat.st_blocks=buf->st_blocks;
-  stats.stat.returned_stat.st_atime=buf->st_atime;
-  stats.stat.returned_stat.st_mtime=buf->st_mtime;
-  stats.stat.returned_stat.st_ctime=buf->st_ctime;
-  stats.stat.last_return=ret;
+  int ret=file_stat(path,buf);
+  shard->stat.returned_stat.st_dev=buf->st_dev;
+  shard->stat.returned_stat.st_ino=buf->st_ino;
+  shard->stat.returned_stat.st_mode=buf->st_mode;
+  shard->stat.returned_stat.st_nlink=buf->st_nlink;
+  shard->stat.returned_stat.st_uid=buf->st_uid;
+  shard->stat.returned_stat.st_gid=buf->st_gid;
+  shard->stat.returned_stat.st_rdev=buf->st_rdev;
+  shard->stat.returned_stat.st_size=buf->st_size;
+  shard->stat.returned_stat.st_blksize=buf->st_blksize;
+  shard->stat.returned_stat.st_blocks=buf->st_blocks;
+  shard->stat.returned_stat.st_atime=buf->st_atime;
+  shard->stat.returned_stat.st_mtime=buf->st_mtime;
+  shard->stat.returned_stat.st_ctime=buf->st_ctime;
+  shard->stat.last_return=ret;
   return ret;
 
 }
@@ -183,35 +502,34 @@ return __real_stat(path,buf);
 int __wrap_fstat(int fd, struct stat *buf) {
 
   if(!wrap_monitoring || !monitored.fstat) {
-    return __real_fstat(fd,buf);
+    return file_fstat(fd,buf);
   }
-  stats.fstat.called++;
-  stats.fstat.last_params.fd=fd;
-  stats.fstat.last_params.buf=buf;
+  struct wrap_stats_t *shard=STATS_SHARD(fstat);
+  shard->fstat.called++;
+  shard->fstat.last_params.fd=fd;
+  shard->fstat.last_params.buf=buf;
   
-  if (FAIL(failures.fstat)) {
-    failures.fstat=NEXT(failures.fstat);
+  if (fail_call(&failures.fstat, &failures.fstat_schedule, 0)) {
     errno=failures.fstat_errno;
     return failures.fstat_ret;
   }
-  failures.fstat=NEXT(failures.fstat);
   // did not fail
-  int ret=__real_fstat(fd,buf);
-  stats.fstat.returned_stat.st_dev=buf->st_dev;
-  stats.fstat.returned_stat.st_ino=buf->st_ino;
-  stats.fstat.returned_stat.st_mode=buf->st_mode;
-  stats.fstat.returned_stat.st_nlink=buf->st_nlink;
-  stats.fstat.returned_stat.st_uid=buf->st_uid;
-  stats.fstat.returned_stat.st_gid=buf->st_gid;
-  stats.fstat.returned_stat.st_rdev=buf->st_rdev;
-  stats.fstat.returned_stat.st_size=buf->st_size;
-  stats.fstat.returned_stat.st_blksize=buf->st_blksize;
-  stats.fstat.returned_stat.st_blocks=buf->st_blocks;
-  stats.fstat.returned_stat.st_atime=buf->st_atime;
-  stats.fstat.returned_stat.st_mtime=buf->st_mtime;
-  stats.fstat.returned_stat.st_ctime=buf->st_ctime;
+  int ret=file_fstat(fd,buf);
+  shard->fstat.returned_stat.st_dev=buf->st_dev;
+  shard->fstat.returned_stat.st_ino=buf->st_ino;
+  shard->fstat.returned_stat.st_mode=buf->st_mode;
+  shard->fstat.returned_stat.st_nlink=buf->st_nlink;
+  shard->fstat.returned_stat.st_uid=buf->st_uid;
+  shard->fstat.returned_stat.st_gid=buf->st_gid;
+  shard->fstat.returned_stat.st_rdev=buf->st_rdev;
+  shard->fstat.returned_stat.st_size=buf->st_size;
+  shard->fstat.returned_stat.st_blksize=buf->st_blksize;
+  shard->fstat.returned_stat.st_blocks=buf->st_blocks;
+  shard->fstat.returned_stat.st_atime=buf->st_atime;
+  shard->fstat.returned_stat.st_mtime=buf->st_mtime;
+  shard->fstat.returned_stat.st_ctime=buf->st_ctime;
 
-  stats.fstat.last_return=ret;
+  shard->fstat.last_return=ret;
   return ret;
 
 }
@@ -219,21 +537,648 @@ int __wrap_fstat(int fd, struct stat *buf) {
 off_t __wrap_lseek(int fd, off_t offset, int whence) {
   
   if(!wrap_monitoring || !monitored.lseek) {
-    return __real_lseek(fd,offset,whence);
+    return file_lseek(fd,offset,whence);
   }
-  stats.lseek.called++;
-  stats.lseek.last_params.fd=fd;
-  stats.lseek.last_params.offset=offset;
-  stats.lseek.last_params.whence=whence;
+  struct wrap_stats_t *shard=STATS_SHARD(lseek);
+  shard->lseek.called++;
+  shard->lseek.last_params.fd=fd;
+  shard->lseek.last_params.offset=offset;
+  shard->lseek.last_params.whence=whence;
 
-  if (FAIL(failures.lseek)) {
-    failures.lseek=NEXT(failures.lseek);
+  if (fail_call(&failures.lseek, &failures.lseek_schedule, 0)) {
     errno=failures.lseek_errno;
     return failures.lseek_ret;
   }
-  failures.lseek=NEXT(failures.lseek);
   // did not fail
-  off_t ret=__real_lseek(fd,offset,whence);
-  stats.lseek.last_return=ret;
+  off_t ret=file_lseek(fd,offset,whence);
+  shard->lseek.last_return=ret;
+  return ret;
+}
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset) {
+
+  if(!wrap_monitoring || !monitored.pread) {
+    return file_pread(fd,buf,count,offset);
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(pread);
+  shard->pread.called++;
+  shard->pread.last_params.fd=fd;
+  shard->pread.last_params.buf=buf;
+  shard->pread.last_params.count=count;
+  shard->pread.last_params.offset=offset;
+
+  if (fail_call(&failures.pread, &failures.pread_schedule, count)) {
+    errno=failures.pread_errno;
+    shard->pread.last_return=failures.pread_ret;
+    return failures.pread_ret;
+  }
+  // did not fail
+  ssize_t ret=file_pread(fd,buf,count,offset);
+  shard->pread.last_return=ret;
+  return ret;
+}
+
+ssize_t __wrap_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+
+  if(!wrap_monitoring || !monitored.pwrite) {
+    return file_pwrite(fd,buf,count,offset);
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(pwrite);
+  shard->pwrite.called++;
+  shard->pwrite.last_params.fd=fd;
+  shard->pwrite.last_params.buf=(void *) buf;
+  shard->pwrite.last_params.count=count;
+  shard->pwrite.last_params.offset=offset;
+
+  if (fail_call(&failures.pwrite, &failures.pwrite_schedule, count)) {
+    errno=failures.pwrite_errno;
+    shard->pwrite.last_return=failures.pwrite_ret;
+    return failures.pwrite_ret;
+  }
+  // did not fail
+  ssize_t ret=file_pwrite(fd,buf,count,offset);
+  shard->pwrite.last_return=ret;
+  return ret;
+}
+
+int __wrap_lstat(char *path, struct stat *buf) {
+
+  if(!wrap_monitoring || !monitored.lstat) {
+    return file_lstat(path,buf);
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(lstat);
+  shard->lstat.called++;
+  shard->lstat.last_params.path=path;
+  shard->lstat.last_params.buf=buf;
+
+  if (fail_call(&failures.lstat, &failures.lstat_schedule, 0)) {
+    errno=failures.lstat_errno;
+    shard->lstat.last_return=failures.lstat_ret;
+    return failures.lstat_ret;
+  }
+  // did not fail
+  int ret=file_lstat(path,buf);
+  if(ret==0)
+    shard->lstat.returned_stat=*buf;
+  shard->lstat.last_return=ret;
+  return ret;
+}
+
+int __wrap_dup(int oldfd) {
+
+  if(!wrap_monitoring || !monitored.dup) {
+    return file_dup(oldfd);
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(dup);
+  shard->dup.called++;
+  shard->dup.last_params.oldfd=oldfd;
+
+  if (fail_call(&failures.dup, &failures.dup_schedule, 0)) {
+    errno=failures.dup_errno;
+    shard->dup.last_return=failures.dup_ret;
+    return failures.dup_ret;
+  }
+  // did not fail
+  int ret=file_dup(oldfd);
+  shard->dup.last_return=ret;
+  return ret;
+}
+
+int __wrap_dup2(int oldfd, int newfd) {
+
+  if(!wrap_monitoring || !monitored.dup2) {
+    return file_dup2(oldfd,newfd);
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(dup2);
+  shard->dup2.called++;
+  shard->dup2.last_params.oldfd=oldfd;
+  shard->dup2.last_params.newfd=newfd;
+
+  if (fail_call(&failures.dup2, &failures.dup2_schedule, 0)) {
+    errno=failures.dup2_errno;
+    shard->dup2.last_return=failures.dup2_ret;
+    return failures.dup2_ret;
+  }
+  // did not fail
+  int ret=file_dup2(oldfd,newfd);
+  shard->dup2.last_return=ret;
+  return ret;
+}
+
+// the third argument of fcntl, according to cmd
+enum fcntl_arg_t { FCNTL_ARG_NONE, FCNTL_ARG_INT, FCNTL_ARG_PTR };
+
+static enum fcntl_arg_t fcntl_arg(int cmd) {
+  switch(cmd) {
+  case F_GETFD:
+  case F_GETFL:
+  case F_GETOWN:
+  case F_GETSIG:
+  case F_GETLEASE:
+  case F_GETPIPE_SZ:
+  case F_GET_SEALS:
+    return FCNTL_ARG_NONE;
+  case F_DUPFD:
+  case F_DUPFD_CLOEXEC:
+  case F_SETFD:
+  case F_SETFL:
+  case F_SETOWN:
+  case F_SETSIG:
+  case F_SETLEASE:
+  case F_NOTIFY:
+  case F_SETPIPE_SZ:
+  case F_ADD_SEALS:
+    return FCNTL_ARG_INT;
+  default:
+    // F_GETLK, F_SETLK, F_SETLKW, F_OFD_*, F_GETOWN_EX... take a pointer,
+    // as the commands unknown here are assumed to do
+    return FCNTL_ARG_PTR;
+  }
+}
+
+// the third argument is read only for the commands which take one, and
+// passed on in a register, as a long or a pointer
+int __wrap_fcntl(int fd, int cmd, ...) {
+  void *arg=NULL;
+  va_list ap;
+  va_start(ap, cmd);
+  switch(fcntl_arg(cmd)) {
+  case FCNTL_ARG_NONE:
+    break;
+  case FCNTL_ARG_INT:
+    arg=(void *) (long) va_arg(ap, int);
+    break;
+  case FCNTL_ARG_PTR:
+    arg=va_arg(ap, void *);
+    break;
+  }
+  va_end(ap);
+
+  if(!wrap_monitoring || !monitored.fcntl) {
+    return file_fcntl(fd,cmd,arg);
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(fcntl);
+  shard->fcntl.called++;
+  shard->fcntl.last_params.fd=fd;
+  shard->fcntl.last_params.cmd=cmd;
+  shard->fcntl.last_params.arg=(long) arg;
+
+  if (fail_call(&failures.fcntl, &failures.fcntl_schedule, 0)) {
+    errno=failures.fcntl_errno;
+    shard->fcntl.last_return=failures.fcntl_ret;
+    return failures.fcntl_ret;
+  }
+  // did not fail
+  int ret=file_fcntl(fd,cmd,arg);
+  shard->fcntl.last_return=ret;
+  return ret;
+}
+
+int __wrap_fsync(int fd) {
+
+  if(!wrap_monitoring || !monitored.fsync) {
+    return __real_fsync(fd);
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(fsync);
+  shard->fsync.called++;
+  shard->fsync.last_params.fd=fd;
+
+  if (fail_call(&failures.fsync, &failures.fsync_schedule, 0)) {
+    errno=failures.fsync_errno;
+    shard->fsync.last_return=failures.fsync_ret;
+    return failures.fsync_ret;
+  }
+  // did not fail
+  int ret=__real_fsync(fd);
+  shard->fsync.last_return=ret;
+  return ret;
+}
+
+int __wrap_ftruncate(int fd, off_t length) {
+
+  if(!wrap_monitoring || !monitored.ftruncate) {
+    return __real_ftruncate(fd,length);
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(ftruncate);
+  shard->ftruncate.called++;
+  shard->ftruncate.last_params.fd=fd;
+  shard->ftruncate.last_params.length=length;
+
+  if (fail_call(&failures.ftruncate, &failures.ftruncate_schedule, 0)) {
+    errno=failures.ftruncate_errno;
+    shard->ftruncate.last_return=failures.ftruncate_ret;
+    return failures.ftruncate_ret;
+  }
+  // did not fail
+  int ret=__real_ftruncate(fd,length);
+  shard->ftruncate.last_return=ret;
+  return ret;
+}
+
+// anonymous mappings are memory allocated by the student's code,
+// counted with the blocks of malloc whether mmap is monitored or not
+static void *mmap_counted(void *addr, size_t length, int prot, int flags, int fd, off_t offset, void *caller) {
+  bool anonymous=flags & MAP_ANONYMOUS;
+  if(anonymous && !malloc_map_budget(length))
+    return MAP_FAILED;
+  void *ret=__real_mmap(addr,length,prot,flags,fd,offset);
+  if(anonymous && ret!=MAP_FAILED)
+    malloc_map(ret,length,caller);
+  return ret;
+}
+
+void *__wrap_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+
+  if(!wrap_monitoring) {
+    return __real_mmap(addr,length,prot,flags,fd,offset);
+  }
+  if(!monitored.mmap) {
+    return mmap_counted(addr,length,prot,flags,fd,offset,__builtin_return_address(0));
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(mmap);
+  shard->mmap.called++;
+  shard->mmap.last_params.addr=addr;
+  shard->mmap.last_params.length=length;
+  shard->mmap.last_params.prot=prot;
+  shard->mmap.last_params.flags=flags;
+  shard->mmap.last_params.fd=fd;
+  shard->mmap.last_params.offset=offset;
+
+  if (fail_call(&failures.mmap, &failures.mmap_schedule, length)) {
+    errno=failures.mmap_errno;
+    shard->mmap.last_return=failures.mmap_ret;
+    return failures.mmap_ret;
+  }
+  // did not fail
+  void *ret=mmap_counted(addr,length,prot,flags,fd,offset,__builtin_return_address(0));
+  shard->mmap.last_return=ret;
+  return ret;
+}
+
+int __wrap_munmap(void *addr, size_t length) {
+
+  if(!wrap_monitoring) {
+    return __real_munmap(addr,length);
+  }
+  if(!monitored.munmap) {
+    int ret=__real_munmap(addr,length);
+    if(ret==0)
+      malloc_unmap(addr);
+    return ret;
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(munmap);
+  shard->munmap.called++;
+  shard->munmap.last_params.addr=addr;
+  shard->munmap.last_params.length=length;
+
+  if (fail_call(&failures.munmap, &failures.munmap_schedule, 0)) {
+    errno=failures.munmap_errno;
+    shard->munmap.last_return=failures.munmap_ret;
+    return failures.munmap_ret;
+  }
+  // did not fail
+  int ret=__real_munmap(addr,length);
+  shard->munmap.last_return=ret;
+  if(ret==0)
+    malloc_unmap(addr);
+  return ret;
+}
+
+// Streams on a file descriptor, whose reads, writes and seeks are those
+// of the wrappers. The cookie of a stream is its slot in streams, which
+// gives fileno the descriptor. Once all the slots are used, the next
+// streams are those of the libc, whose I/O is not counted. A stream
+// may both read and write, the descriptor refusing what its mode does
+// not allow with EBADF as for the streams of the libc, so that freopen
+// can give it a descriptor with another mode.
+
+#define STREAMS_MAX 256
+
+struct stream_t {
+  bool used;
+  int fd;
+  FILE *stream;
+  bool reopening;  // the seeks of freopen are not those of the student
+};
+
+static struct stream_t streams[STREAMS_MAX];
+
+static ssize_t stream_read(void *cookie, char *buf, size_t size) {
+  return read(((struct stream_t *) cookie)->fd, buf, size);
+}
+
+static ssize_t stream_write(void *cookie, const char *buf, size_t size) {
+  return write(((struct stream_t *) cookie)->fd, buf, size);
+}
+
+static int stream_seek(void *cookie, off64_t *offset, int whence) {
+  struct stream_t *s=cookie;
+  off_t ret=s->reopening ? __real_lseek(s->fd, *offset, whence) : lseek(s->fd, *offset, whence);
+  if(ret<0)
+    return -1;
+  *offset=ret;
+  return 0;
+}
+
+static int stream_close(void *cookie) {
+  struct stream_t *s=cookie;
+  int fd=s->fd;
+  __atomic_store_n(&s->stream, NULL, __ATOMIC_RELAXED);
+  __atomic_store_n(&s->used, false, __ATOMIC_RELEASE);
+  return close(fd);
+}
+
+static cookie_io_functions_t stream_functions = {
+  .read=stream_read,
+  .write=stream_write,
+  .seek=stream_seek,
+  .close=stream_close,
+};
+
+// the streams of the sandbox go through the wrappers
+static bool stream_wrapped() {
+  return wrap_monitoring && (monitored.read || monitored.write || monitored.lseek
+                             || monitored.file_profile || vfs_active());
+}
+
+// stream on the open descriptor fd, NULL if it cannot be created
+static FILE *stream_new(int fd, const char *mode) {
+  for(int i=0;i<STREAMS_MAX;i++) {
+    struct stream_t *s=&streams[i];
+    bool used=false;
+    if(!__atomic_compare_exchange_n(&s->used, &used, true, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      continue;
+    s->fd=fd;
+    s->reopening=false;
+    FILE *stream=fopencookie(s, mode[0]=='a' ? "a+" : "r+", stream_functions);
+    if(stream==NULL)
+      __atomic_store_n(&s->used, false, __ATOMIC_RELEASE);
+    else
+      __atomic_store_n(&s->stream, stream, __ATOMIC_RELAXED);
+    return stream;
+  }
+  return __real_fdopen(fd, mode);
+}
+
+// flags of open for the mode of fopen, -1 if it is invalid
+static int stream_flags(const char *mode) {
+  int flags;
+  switch(mode[0]) {
+  case 'r':
+    flags=O_RDONLY;
+    break;
+  case 'w':
+    flags=O_WRONLY|O_CREAT|O_TRUNC;
+    break;
+  case 'a':
+    flags=O_WRONLY|O_CREAT|O_APPEND;
+    break;
+  default:
+    return -1;
+  }
+  for(const char *m=mode+1;*m!='\0';m++) {
+    if(*m=='+')
+      flags=(flags & ~O_ACCMODE)|O_RDWR;
+    else if(*m=='x')
+      flags|=O_EXCL;
+    else if(*m=='e')
+      flags|=O_CLOEXEC;
+  }
+  return flags;
+}
+
+static FILE *stream_open(const char *pathname, const char *mode) {
+  if(!stream_wrapped())
+    return __real_fopen(pathname, mode);
+  int flags=stream_flags(mode);
+  if(flags<0) {
+    errno=EINVAL;
+    return NULL;
+  }
+  int fd=open(pathname, flags, 0666);
+  if(fd<0)
+    return NULL;
+  FILE *stream=stream_new(fd, mode);
+  if(stream==NULL)
+    __real_close(fd);
+  return stream;
+}
+
+static FILE *stream_fdopen(int fd, const char *mode) {
+  if(!stream_wrapped())
+    return __real_fdopen(fd, mode);
+  int flags=stream_flags(mode);
+  int fd_flags=__real_fcntl(fd, F_GETFL);
+  if(fd_flags<0)
+    return NULL;
+  // the mode must be allowed by the descriptor, and appends to it, as
+  // fdopen of the libc
+  int access=fd_flags & O_ACCMODE;
+  if(flags<0 || (access!=O_RDWR && access!=(flags & O_ACCMODE))) {
+    errno=EINVAL;
+    return NULL;
+  }
+  if((flags & O_APPEND) && !(fd_flags & O_APPEND)
+     && __real_fcntl(fd, F_SETFL, fd_flags|O_APPEND)<0)
+    return NULL;
+  return stream_new(fd, mode);
+}
+
+// slot of a stream created by stream_new, NULL for another stream
+static struct stream_t *stream_find(FILE *stream) {
+  for(int i=0;i<STREAMS_MAX;i++) {
+    struct stream_t *s=&streams[i];
+    if(__atomic_load_n(&s->used, __ATOMIC_ACQUIRE) && __atomic_load_n(&s->stream, __ATOMIC_RELAXED)==stream)
+      return s;
+  }
+  return NULL;
+}
+
+// freopen of the libc crashes on a stream of fopencookie: the stream
+// gets the new descriptor instead, and starts at its beginning
+static FILE *stream_swap(struct stream_t *s, const char *pathname, const char *mode, FILE *stream) {
+  int flags=stream_flags(mode);
+  int fd=-1;
+  if(flags<0) {
+    errno=EINVAL;
+  } else if(pathname!=NULL) {
+    fd=open(pathname, flags, 0666);
+  } else {
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", s->fd);
+    fd=__real_open(proc, flags & ~(O_CREAT|O_EXCL), 0);
+  }
+  if(fd<0) {
+    int err=errno;
+    __real_fclose(stream);
+    errno=err;
+    return NULL;
+  }
+  s->reopening=true;
+  fflush(stream);
+  int old=s->fd;
+  s->fd=fd;
+  close(old);
+  clearerr(stream);
+  fseek(stream, 0, SEEK_SET);
+  s->reopening=false;
+  return stream;
+}
+
+// The libc cannot give its own stream, stdin for example, the functions
+// of a cookie. The file is opened with open, to be found in the
+// in-memory filesystem, and the stream reopened on its descriptor.
+static FILE *stream_reopen(const char *pathname, const char *mode, FILE *stream) {
+  struct stream_t *s=stream_find(stream);
+  int fd;
+  if(s!=NULL) {
+    return stream_swap(s, pathname, mode, stream);
+  } else if(pathname==NULL || !stream_wrapped()) {
+    return __real_freopen(pathname, mode, stream);
+  } else {
+    int flags=stream_flags(mode);
+    if(flags<0)
+      errno=EINVAL;
+    fd=flags<0 ? -1 : open(pathname, flags, 0666);
+  }
+  if(fd<0) {
+    int err=errno;
+    __real_fclose(stream);
+    errno=err;
+    return NULL;
+  }
+  // the file exists and is already truncated
+  char reopen_mode[8];
+  int n=0;
+  for(const char *m=mode;*m!='\0' && n<(int) sizeof(reopen_mode)-1;m++) {
+    if(*m!='x')
+      reopen_mode[n++]=*m;
+  }
+  reopen_mode[n]='\0';
+  char proc[64];
+  snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+  FILE *ret=__real_freopen(proc, reopen_mode, stream);
+  __real_close(fd);
+  return ret;
+}
+
+// an anonymous file in memory, which does not appear in the filesystem
+static FILE *stream_tmpfile() {
+  if(!stream_wrapped())
+    return __real_tmpfile();
+  int fd=memfd_create("tmpfile", 0);
+  if(fd<0)
+    return NULL;
+  FILE *stream=stream_new(fd, "w+");
+  if(stream==NULL)
+    __real_close(fd);
+  return stream;
+}
+
+int __wrap_fileno(FILE *stream) {
+  struct stream_t *s=stream_find(stream);
+  return s!=NULL ? s->fd : __real_fileno(stream);
+}
+
+FILE *__wrap_fopen(const char *pathname, const char *mode) {
+
+  if(!wrap_monitoring || !monitored.fopen) {
+    return stream_open(pathname,mode);
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(fopen);
+  shard->fopen.called++;
+  shard->fopen.last_params.pathname=(char *) pathname;
+  shard->fopen.last_params.mode=(char *) mode;
+
+  if (fail_call(&failures.fopen, &failures.fopen_schedule, 0)) {
+    errno=failures.fopen_errno;
+    shard->fopen.last_return=failures.fopen_ret;
+    return failures.fopen_ret;
+  }
+  // did not fail
+  FILE *ret=stream_open(pathname,mode);
+  shard->fopen.last_return=ret;
+  return ret;
+}
+
+int __wrap_fclose(FILE *stream) {
+
+  if(!wrap_monitoring || !monitored.fclose) {
+    return __real_fclose(stream);
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(fclose);
+  shard->fclose.called++;
+  shard->fclose.last_params.stream=stream;
+
+  if (fail_call(&failures.fclose, &failures.fclose_schedule, 0)) {
+    errno=failures.fclose_errno;
+    shard->fclose.last_return=failures.fclose_ret;
+    return failures.fclose_ret;
+  }
+  // did not fail
+  int ret=__real_fclose(stream);
+  shard->fclose.last_return=ret;
+  return ret;
+}
+
+FILE *__wrap_fdopen(int fd, const char *mode) {
+
+  if(!wrap_monitoring || !monitored.fdopen) {
+    return stream_fdopen(fd,mode);
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(fdopen);
+  shard->fdopen.called++;
+  shard->fdopen.last_params.fd=fd;
+  shard->fdopen.last_params.mode=(char *) mode;
+
+  if (fail_call(&failures.fdopen, &failures.fdopen_schedule, 0)) {
+    errno=failures.fdopen_errno;
+    shard->fdopen.last_return=failures.fdopen_ret;
+    return failures.fdopen_ret;
+  }
+  // did not fail
+  FILE *ret=stream_fdopen(fd,mode);
+  shard->fdopen.last_return=ret;
+  return ret;
+}
+
+FILE *__wrap_freopen(const char *pathname, const char *mode, FILE *stream) {
+
+  if(!wrap_monitoring || !monitored.freopen) {
+    return stream_reopen(pathname,mode,stream);
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(freopen);
+  shard->freopen.called++;
+  shard->freopen.last_params.pathname=(char *) pathname;
+  shard->freopen.last_params.mode=(char *) mode;
+  shard->freopen.last_params.stream=stream;
+
+  if (fail_call(&failures.freopen, &failures.freopen_schedule, 0)) {
+    errno=failures.freopen_errno;
+    shard->freopen.last_return=failures.freopen_ret;
+    return failures.freopen_ret;
+  }
+  // did not fail
+  FILE *ret=stream_reopen(pathname,mode,stream);
+  shard->freopen.last_return=ret;
+  return ret;
+}
+
+FILE *__wrap_tmpfile(void) {
+
+  if(!wrap_monitoring || !monitored.tmpfile) {
+    return stream_tmpfile();
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(tmpfile);
+  shard->tmpfile.called++;
+
+  if (fail_call(&failures.tmpfile, &failures.tmpfile_schedule, 0)) {
+    errno=failures.tmpfile_errno;
+    shard->tmpfile.last_return=failures.tmpfile_ret;
+    return failures.tmpfile_ret;
+  }
+  // did not fail
+  FILE *ret=stream_tmpfile();
+  shard->tmpfile.last_return=ret;
   return ret;
 }
@@ -2,6 +2,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdio.h>
 
 // basic structure to record the parameters of the last open call
 
@@ -118,3 +119,241 @@ struct stats_lseek_t {
   struct params_lseek_t last_params; // parameters for the last call issued
   int last_return;   // return value of the last lseek call issued
 };
+
+struct params_pread_t {
+  int fd;
+  void *buf;
+  ssize_t count;
+  off_t offset;
+};
+
+// basic statistics for the utilisation of the pread and pwrite system calls
+
+struct stats_pread_t {
+  int called;  // number of times the pread system call has been issued
+  struct params_pread_t last_params; // parameters for the last call issued
+  ssize_t last_return;   // return value of the last pread call issued
+};
+
+struct stats_pwrite_t {
+  int called;  // number of times the pwrite system call has been issued
+  struct params_pread_t last_params; // parameters for the last call issued
+  ssize_t last_return;   // return value of the last pwrite call issued
+};
+
+// basic statistics for the utilisation of the lstat system call
+
+struct stats_lstat_t {
+  int called;  // number of times the lstat system call has been issued
+  struct params_stat_t last_params; // parameters for the last call issued
+  int last_return;   // return value of the last lstat call issued
+  struct stat returned_stat; // last returned stat structure
+};
+
+struct params_dup_t {
+  int oldfd;
+};
+
+// basic statistics for the utilisation of the dup system call
+
+struct stats_dup_t {
+  int called;  // number of times the dup system call has been issued
+  struct params_dup_t last_params; // parameters for the last call issued
+  int last_return;   // return value of the last dup call issued
+};
+
+struct params_dup2_t {
+  int oldfd;
+  int newfd;
+};
+
+// basic statistics for the utilisation of the dup2 system call
+
+struct stats_dup2_t {
+  int called;  // number of times the dup2 system call has been issued
+  struct params_dup2_t last_params; // parameters for the last call issued
+  int last_return;   // return value of the last dup2 call issued
+};
+
+struct params_fcntl_t {
+  int fd;
+  int cmd;
+  long arg;  // third argument, an integer or the address of a structure
+};
+
+// basic statistics for the utilisation of the fcntl system call
+
+struct stats_fcntl_t {
+  int called;  // number of times the fcntl system call has been issued
+  struct params_fcntl_t last_params; // parameters for the last call issued
+  int last_return;   // return value of the last fcntl call issued
+};
+
+struct params_fsync_t {
+  int fd;
+};
+
+// basic statistics for the utilisation of the fsync system call
+
+struct stats_fsync_t {
+  int called;  // number of times the fsync system call has been issued
+  struct params_fsync_t last_params; // parameters for the last call issued
+  int last_return;   // return value of the last fsync call issued
+};
+
+struct params_ftruncate_t {
+  int fd;
+  off_t length;
+};
+
+// basic statistics for the utilisation of the ftruncate system call
+
+struct stats_ftruncate_t {
+  int called;  // number of times the ftruncate system call has been issued
+  struct params_ftruncate_t last_params; // parameters for the last call issued
+  int last_return;   // return value of the last ftruncate call issued
+};
+
+struct params_mmap_t {
+  void *addr;
+  size_t length;
+  int prot;
+  int flags;
+  int fd;
+  off_t offset;
+};
+
+// basic statistics for the utilisation of the mmap system call
+
+struct stats_mmap_t {
+  int called;  // number of times the mmap system call has been issued
+  struct params_mmap_t last_params; // parameters for the last call issued
+  void *last_return;   // return value of the last mmap call issued
+};
+
+struct params_munmap_t {
+  void *addr;
+  size_t length;
+};
+
+// basic statistics for the utilisation of the munmap system call
+
+struct stats_munmap_t {
+  int called;  // number of times the munmap system call has been issued
+  struct params_munmap_t last_params; // parameters for the last call issued
+  int last_return;   // return value of the last munmap call issued
+};
+
+// The streams opened by fopen, fdopen and tmpfile in the sandbox, when
+// read, write or lseek are monitored, or with the in-memory filesystem,
+// are built on a file descriptor with fopencookie: their buffered reads,
+// writes and seeks go through the wrappers of read, write and lseek, and
+// the statistics of these calls count them. fileno returns their file
+// descriptor. freopen opens the file with open, but the reads and writes
+// of the stream it returns are those of the libc.
+
+struct params_fopen_t {
+  char *pathname;
+  char *mode;
+};
+
+// basic statistics for the utilisation of fopen
+
+struct stats_fopen_t {
+  int called;  // number of times fopen has been called
+  struct params_fopen_t last_params; // parameters for the last call
+  FILE *last_return;   // return value of the last call
+};
+
+struct params_fclose_t {
+  FILE *stream;
+};
+
+// basic statistics for the utilisation of fclose
+
+struct stats_fclose_t {
+  int called;  // number of times fclose has been called
+  struct params_fclose_t last_params; // parameters for the last call
+  int last_return;   // return value of the last call
+};
+
+// I/O profile of a file descriptor, recorded when
+// monitored.file_profile is set, whether read and write are monitored
+// or not. A new profile starts each time a descriptor is opened (by
+// open, creat or fopen) in the sandbox. A descriptor returned by dup,
+// dup2 or fcntl(F_DUPFD) shares the profile of the original, as it
+// shares its offset. Descriptors used without being opened there
+// (stdin, pipes) get a profile without path at their first transfer.
+// Only the real calls are profiled, not the injected failures.
+
+#define FILE_SIZE_BUCKETS 32
+#define FILE_PATH_MAX 64
+
+struct file_io_t {
+  uint64_t calls;   // calls which did not fail
+  uint64_t bytes;   // bytes transferred
+  uint64_t ns;      // time spent in the system calls
+  int size_hist[FILE_SIZE_BUCKETS]; // size_hist[i]: calls for 2^i to 2^(i+1)-1 bytes, 0 in size_hist[0]
+};
+
+struct file_profile_t {
+  int fd;                   // descriptor returned by open
+  char path[FILE_PATH_MAX]; // path given to open, "" if unknown
+  int descriptors;          // open descriptors sharing the profile
+  bool closed;              // all of them are closed
+  struct file_io_t read;    // read and pread
+  struct file_io_t write;   // write and pwrite
+  uint64_t seeks;           // calls to lseek which moved the offset
+  uint64_t sequential;      // transfers starting where the previous one ended
+  uint64_t random;          // other transfers
+  off_t pos;                // offset of the descriptor, as seen by read, write and lseek
+  off_t end;                // end of the last transfer
+};
+
+// profile of the open descriptor fd, or else the last profile opened
+// as fd, NULL if it was not used while profiled
+struct file_profile_t *file_profile(int fd);
+// sum of the profiles of path (of all the descriptors if path is NULL)
+// in total, whose fd is -1. Returns the number of profiles summed.
+int file_profile_total(const char *path, struct file_profile_t *total);
+// average size of the transfers of io, 0 if none
+double file_io_average(struct file_io_t *io);
+// true if the reads (or writes) of path (NULL for all the descriptors)
+// transferred at least min bytes per call on average. Otherwise, adds
+// a message explaining it to the student, and returns false.
+bool file_check_read_size(const char *path, size_t min);
+bool file_check_write_size(const char *path, size_t min);
+
+struct params_fdopen_t {
+  int fd;
+  char *mode;
+};
+
+// basic statistics for the utilisation of fdopen
+
+struct stats_fdopen_t {
+  int called;  // number of times fdopen has been called
+  struct params_fdopen_t last_params; // parameters for the last call
+  FILE *last_return;   // return value of the last call
+};
+
+struct params_freopen_t {
+  char *pathname;
+  char *mode;
+  FILE *stream;
+};
+
+// basic statistics for the utilisation of freopen
+
+struct stats_freopen_t {
+  int called;  // number of times freopen has been called
+  struct params_freopen_t last_params; // parameters for the last call
+  FILE *last_return;   // return value of the last call
+};
+
+// basic statistics for the utilisation of tmpfile
+
+struct stats_tmpfile_t {
+  int called;  // number of times tmpfile has been called
+  FILE *last_return;   // return value of the last call
+};
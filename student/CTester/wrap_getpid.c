@@ -32,9 +32,10 @@ pid_t __wrap_getpid(void) {
   }
   // being monitored
 
-  stats.getpid.called++;
+  struct wrap_stats_t *shard=STATS_SHARD(getpid);
+  shard->getpid.called++;
   pid_t ret=__real_getpid();
-  stats.getpid.last_return=ret;
+  shard->getpid.last_return=ret;
   return ret;
 
 }
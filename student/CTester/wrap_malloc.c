@@ -13,11 +13,19 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include <malloc.h>
 
 #include  "wrap.h"
+#include  "trap.h"
 
 #include <libintl.h> 
 #include <locale.h> 
@@ -31,6 +39,7 @@ void * __real_malloc(size_t s);
 void * __real_calloc(size_t nmemb, size_t s);
 void __real_free(void *);
 void * __real_realloc(void *ptr, size_t size);
+void * __real_aligned_alloc(size_t alignment, size_t size);
 
 
 extern bool wrap_monitoring;
@@ -39,155 +48,846 @@ extern struct wrap_monitor_t monitored;
 extern struct wrap_fail_t failures;
 extern struct wrap_log_t logs;
 
+#define MALLOC_LOG_MINCAP 64
+
+// The hash tables below are used for the malloc log and for the index
+// of the quarantine of freed blocks
+
+static size_t malloc_log_hash(struct malloc_t *t, void *ptr) {
+  uint64_t h=((uintptr_t) ptr >> 4) * 0x9E3779B97F4A7C15ULL;
+  return (size_t) (h ^ (h >> 32)) & (t->cap-1);
+}
+
+// returns the slot holding ptr, or the empty slot where it should be
+// inserted. The table must not be full.
+static struct malloc_elem_t *malloc_log_slot(struct malloc_t *t, void *ptr) {
+  size_t i=malloc_log_hash(t, ptr);
+  while(t->log[i].ptr!=NULL && t->log[i].ptr!=ptr)
+    i=(i+1) & (t->cap-1);
+  return &t->log[i];
+}
+
+static int malloc_log_grow(struct malloc_t *t) {
+  size_t oldcap=t->cap;
+  struct malloc_elem_t *old=t->log;
+  size_t newcap=oldcap ? 2*oldcap : MALLOC_LOG_MINCAP;
+  struct malloc_elem_t *new=__real_calloc(newcap, sizeof(struct malloc_elem_t));
+  if(new==NULL)
+    return -1;
+  t->log=new;
+  t->cap=newcap;
+  for(size_t i=0;i<oldcap;i++) {
+    if(old[i].ptr!=NULL)
+      *malloc_log_slot(t, old[i].ptr)=old[i];
+  }
+  __real_free(old);
+  return 0;
+}
+
+static struct malloc_elem_t *malloc_log_find(struct malloc_t *t, void *ptr) {
+  if(ptr==NULL || t->n==0)
+    return NULL;
+  struct malloc_elem_t *e=malloc_log_slot(t, ptr);
+  return e->ptr==ptr ? e : NULL;
+}
+
+static void malloc_log_insert(struct malloc_t *t, void *ptr, size_t size, void *caller,
+                              enum malloc_kind_t kind) {
+  if(ptr==NULL)
+    return;
+  if(2*(t->n+1) > t->cap && malloc_log_grow(t))
+    return;
+  struct malloc_elem_t *e=malloc_log_slot(t, ptr);
+  if(e->ptr==ptr) {
+    // stale entry, the block was freed without being monitored
+    t->bytes-=e->size;
+  } else {
+    t->n++;
+  }
+  e->ptr=ptr;
+  e->size=size;
+  e->caller=caller;
+  e->kind=kind;
+  t->bytes+=size;
+  t->changes++;
+}
+
+// removes ptr from the table and returns its size, 0 if it was not there.
+// Uses backward shift deletion so that no tombstone is needed.
+static size_t malloc_log_remove(struct malloc_t *t, void *ptr) {
+  struct malloc_elem_t *e=malloc_log_find(t, ptr);
+  if(e==NULL)
+    return 0;
+  size_t size=e->size;
+  size_t mask=t->cap-1;
+  size_t i=e-t->log;
+  size_t j=i;
+  for(;;) {
+    j=(j+1) & mask;
+    if(t->log[j].ptr==NULL)
+      break;
+    size_t k=malloc_log_hash(t, t->log[j].ptr);
+    // move the entry in j to the hole in i if its home slot k does
+    // not lie cyclically in (i, j]
+    if((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+      t->log[i]=t->log[j];
+      i=j;
+    }
+  }
+  t->log[i].ptr=NULL;
+  t->log[i].size=0;
+  t->n--;
+  t->bytes-=size;
+  t->changes++;
+  return size;
+}
+
 //
-// keeps only MAX_LOG in memory
+// Allocations are aggregated per callsite, the return address of the
+// wrapper, in another hash table. Callsites are never removed.
 //
-void log_malloc(void *ptr, size_t size) {
-  
-  if(ptr!=NULL && logs.malloc.n < MAX_LOG) {
-    logs.malloc.log[logs.malloc.n].size=size;
-    logs.malloc.log[logs.malloc.n].ptr=ptr;
-    logs.malloc.n++;
+
+static size_t malloc_site_hash(void *caller) {
+  uint64_t h=(uintptr_t) caller * 0x9E3779B97F4A7C15ULL;
+  return (size_t) (h ^ (h >> 32)) & (logs.malloc_sites.cap-1);
+}
+
+static struct malloc_site_t *malloc_site_slot(void *caller) {
+  size_t i=malloc_site_hash(caller);
+  while(logs.malloc_sites.sites[i].caller!=NULL && logs.malloc_sites.sites[i].caller!=caller)
+    i=(i+1) & (logs.malloc_sites.cap-1);
+  return &logs.malloc_sites.sites[i];
+}
+
+static struct malloc_site_t *malloc_site_get(void *caller) {
+  if(caller==NULL)
+    return NULL;
+  if(2*(logs.malloc_sites.n+1) > logs.malloc_sites.cap) {
+    size_t oldcap=logs.malloc_sites.cap;
+    struct malloc_site_t *old=logs.malloc_sites.sites;
+    size_t newcap=oldcap ? 2*oldcap : MALLOC_LOG_MINCAP;
+    struct malloc_site_t *new=__real_calloc(newcap, sizeof(struct malloc_site_t));
+    if(new==NULL)
+      return NULL;
+    logs.malloc_sites.sites=new;
+    logs.malloc_sites.cap=newcap;
+    for(size_t i=0;i<oldcap;i++) {
+      if(old[i].caller!=NULL)
+        *malloc_site_slot(old[i].caller)=old[i];
+    }
+    __real_free(old);
+  }
+  struct malloc_site_t *site=malloc_site_slot(caller);
+  if(site->caller==NULL) {
+    site->caller=caller;
+    logs.malloc_sites.n++;
   }
+  return site;
 }
 
-void update_realloc_block(void *ptr, size_t newsize) {
-   for(int i=0;i<MAX_LOG;i++) {
-     if(logs.malloc.log[i].ptr==ptr) {
-      logs.malloc.log[i].size=newsize;
-      return;
-     } 
+static struct malloc_site_t *malloc_site_find(void *caller) {
+  if(caller==NULL || logs.malloc_sites.n==0)
+    return NULL;
+  struct malloc_site_t *site=malloc_site_slot(caller);
+  return site->caller==caller ? site : NULL;
+}
+
+size_t malloc_free_ptr(void *ptr) {
+  struct malloc_elem_t *e=malloc_log_find(&logs.malloc, ptr);
+  if(e==NULL)
+    return 0;
+  struct malloc_site_t *site=malloc_site_find(e->caller);
+  if(site!=NULL) {
+    site->live--;
+    site->live_bytes-=e->size;
   }
-   return ;
+  return malloc_log_remove(&logs.malloc, ptr);
+}
+
+static void malloc_log_block(void *ptr, size_t size, void *caller, enum malloc_kind_t kind) {
+  if(ptr==NULL)
+    return;
+  // stale entry, the block was freed without being monitored
+  malloc_free_ptr(ptr);
+  malloc_log_insert(&logs.malloc, ptr, size, caller, kind);
+  struct malloc_site_t *site=malloc_site_get(caller);
+  if(site!=NULL) {
+    site->calls++;
+    site->bytes+=size;
+    site->live++;
+    site->live_bytes+=size;
+  }
+}
+
+void log_malloc(void *ptr, size_t size, void *caller) {
+  malloc_log_block(ptr, size, caller, MALLOC_HEAP);
 }
 
 size_t find_size_malloc(void *ptr) {
-  for(int i=0;i<MAX_LOG;i++) {
-    if(logs.malloc.log[i].ptr==ptr) 
-      return logs.malloc.log[i].size;
+  struct malloc_elem_t *e=malloc_log_find(&logs.malloc, ptr);
+  return e!=NULL ? e->size : 0;
+}
+
+//
+// Quarantine: the blocks freed in the sandbox are not given back to
+// malloc immediately, but kept in a FIFO of at most QUARANTINE_MAX
+// blocks and QUARANTINE_BYTES bytes. As their addresses cannot be
+// reused meanwhile, freeing one of them again is a double free.
+//
+#define QUARANTINE_MAX 4096
+#define QUARANTINE_BYTES (32*1024*1024)
+
+static struct malloc_t quarantine;  // index of the blocks in the FIFO
+static void *quarantine_fifo[QUARANTINE_MAX];
+static size_t quarantine_head;
+
+// The blocks evicted from the quarantine are given back to malloc, but
+// their addresses are remembered until malloc returns them again, so
+// that freeing them again is still detected. At most EVICTED_MAX
+// addresses are remembered in a test.
+#define EVICTED_MAX 65536
+static struct malloc_t evicted;
+
+// gives a block back to malloc, or its slot if it is guarded
+static void malloc_release(void *ptr) {
+  if(!trap_release(ptr))
+    __real_free(ptr);
+}
+
+static void quarantine_evict() {
+  void *ptr=quarantine_fifo[quarantine_head];
+  quarantine_head=(quarantine_head+1) % QUARANTINE_MAX;
+  malloc_log_remove(&quarantine, ptr);
+  if(evicted.n < EVICTED_MAX)
+    malloc_log_insert(&evicted, ptr, 0, NULL, MALLOC_HEAP);
+  malloc_release(ptr);
+}
+
+// a guarded block becomes inaccessible as soon as it is in the
+// quarantine, so that using it after free is a segfault. A block which
+// is already in the FIFO is left there: it must be released only once.
+static void quarantine_push(void *ptr, size_t size) {
+  if(malloc_log_find(&quarantine, ptr)!=NULL)
+    return;
+  trap_retire(ptr);
+  while(quarantine.n > 0 && (quarantine.n == QUARANTINE_MAX ||
+                             quarantine.bytes+size > QUARANTINE_BYTES))
+    quarantine_evict();
+  size_t n=quarantine.n;
+  malloc_log_insert(&quarantine, ptr, size, NULL, MALLOC_HEAP);
+  if(quarantine.n==n) {
+    // could not be indexed
+    malloc_release(ptr);
+    return;
+  }
+  quarantine_fifo[(quarantine_head+n) % QUARANTINE_MAX]=ptr;
+}
+
+static bool quarantined(void *ptr) {
+  return malloc_log_find(&quarantine, ptr)!=NULL;
+}
+
+// true if ptr cannot have been returned by malloc: misaligned, inside a
+// loaded object (code, string literal, global variable), or on the
+// stack of the calling thread. Called without the lock, as it may
+// enter the kernel.
+static bool malloc_foreign_ptr(void *ptr) {
+  if((uintptr_t) ptr % (2*sizeof(size_t)))
+    return true;
+
+  Dl_info info;
+  if(dladdr(ptr, &info))
+    return true;
+
+  static __thread char *stack_lo, *stack_hi;
+  if(stack_hi==NULL) {
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    if(pthread_getattr_np(pthread_self(), &attr)==0) {
+      if(pthread_attr_getstack(&attr, &addr, &size)==0) {
+        stack_lo=addr;
+        stack_hi=stack_lo+size;
+      }
+      pthread_attr_destroy(&attr);
+    }
+  }
+  return (char *) ptr >= stack_lo && (char *) ptr < stack_hi;
+}
+
+static struct malloc_elem_t *malloc_index_find(void *addr);
+
+// true if ptr is inside a logged block, however far from its start.
+// Called with the lock held.
+static bool malloc_interior_ptr(void *ptr) {
+  struct malloc_elem_t *e=malloc_index_find(ptr);
+  return e!=NULL && e->ptr!=ptr && (char *) ptr < (char *) e->ptr+e->size;
+}
+
+// gives back to malloc all the blocks of the quarantine
+void malloc_quarantine_flush() {
+  while(quarantine.n > 0)
+    quarantine_evict();
+  __real_free(quarantine.log);
+  bzero(&quarantine, sizeof(quarantine));
+  quarantine_head=0;
+  __real_free(evicted.log);
+  bzero(&evicted, sizeof(evicted));
+}
+
+// addresses of the logged blocks in increasing order, used by malloced
+// and free to find the block containing an address. It is rebuilt when the log
+// has changed since, which is rare once the sandbox is over.
+static struct {
+  bool valid;
+  uint64_t changes;  // logs.malloc.changes when it was built
+  size_t n;
+  void **ptr;
+} malloc_index;
+
+static void malloc_index_reset() {
+  __real_free(malloc_index.ptr);
+  bzero(&malloc_index, sizeof(malloc_index));
+}
+
+void malloc_log_reset() {
+  malloc_index_reset();
+  __real_free(logs.malloc.log);
+  bzero(&logs.malloc, sizeof(logs.malloc));
+  __real_free(logs.malloc_sites.sites);
+  bzero(&logs.malloc_sites, sizeof(logs.malloc_sites));
+  malloc_quarantine_flush();
+}
+
+// The log and the quarantine are shared by all the threads of the
+// student's code, and protected by a spinlock: the mutexes are wrapped.
+static int malloc_lock_flag;
+
+static void malloc_lock() {
+  while(__atomic_test_and_set(&malloc_lock_flag, __ATOMIC_ACQUIRE)) {
+    while(__atomic_load_n(&malloc_lock_flag, __ATOMIC_RELAXED))
+      sched_yield();
+  }
+}
+
+static void malloc_unlock() {
+  __atomic_clear(&malloc_lock_flag, __ATOMIC_RELEASE);
+}
+
+void malloc_atfork() {
+  pthread_atfork(malloc_lock, malloc_unlock, malloc_unlock);
+}
+
+// The pointers passed to free and realloc in the sandbox are checked,
+// and the freed blocks quarantined, when the allocations are monitored
+static bool malloc_checked() {
+  return wrap_monitoring && (monitored.malloc || monitored.calloc || monitored.realloc
+                             || monitored.free || monitored.malloc_guard);
+}
+
+// checks a pointer passed to free or realloc in the sandbox. Returns
+// true if it can be given to malloc, otherwise records the error.
+// Called with the lock held, which is released while checking a
+// pointer which is not logged.
+static bool malloc_check_free(void *ptr) {
+  if(ptr==NULL)
+    return true;
+  struct malloc_elem_t *e=malloc_log_find(&logs.malloc, ptr);
+  if(e!=NULL && e->kind==MALLOC_MMAP) {
+    // a mapping must be released by munmap
+    stats.free.invalid_free++;
+    stats.free.last_invalid=ptr;
+    return false;
+  }
+  if(e!=NULL)
+    return true;
+  if(quarantined(ptr) || malloc_log_find(&evicted, ptr)!=NULL) {
+    stats.free.double_free++;
+    stats.free.last_invalid=ptr;
+    return false;
+  }
+  malloc_unlock();
+  bool foreign=malloc_foreign_ptr(ptr);
+  malloc_lock();
+  if(foreign || malloc_interior_ptr(ptr)) {
+    stats.free.invalid_free++;
+    stats.free.last_invalid=ptr;
+    return false;
+  }
+  // allocated out of the monitoring
+  return true;
+}
+
+// a block returned by malloc is not a freed block anymore
+static void *malloc_fresh(void *ptr) {
+  if(ptr!=NULL && __atomic_load_n(&evicted.n, __ATOMIC_RELAXED) > 0) {
+    malloc_lock();
+    malloc_log_remove(&evicted, ptr);
+    malloc_unlock();
+  }
+  return ptr;
+}
+
+// true if replacing a block of old_size bytes by one of size bytes keeps
+// the memory used within failures.memory_budget
+static bool malloc_within_budget(size_t size, size_t old_size) {
+  if(failures.memory_budget==0 || size<=old_size
+     || __atomic_load_n(&stats.memory.used, __ATOMIC_RELAXED)-old_size+size<=failures.memory_budget)
+    return true;
+  __atomic_add_fetch(&stats.memory.over_budget, 1, __ATOMIC_RELAXED);
+  errno=ENOMEM;
+  return false;
+}
+
+// stats.memory is shared by the threads, a block can be freed by
+// another thread than the one that allocated it
+static void memory_alloc(size_t size) {
+  size_t used=__atomic_add_fetch(&stats.memory.used, size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats.memory.total_allocated, size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats.memory.allocations, 1, __ATOMIC_RELAXED);
+  size_t peak=__atomic_load_n(&stats.memory.peak, __ATOMIC_RELAXED);
+  while(used>peak && !__atomic_compare_exchange_n(&stats.memory.peak, &peak, used, true,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+static void memory_free(size_t size) {
+  __atomic_sub_fetch(&stats.memory.used, size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats.memory.frees, 1, __ATOMIC_RELAXED);
+}
+
+// counts and logs a block allocated by a monitored wrapper, whose
+// return address is caller
+static void malloc_account(void *ptr, size_t size, void *caller) {
+  if(ptr!=NULL)
+    memory_alloc(size);
+  malloc_lock();
+  log_malloc(ptr,size,caller);
+  malloc_unlock();
+}
+
+bool malloc_map_budget(size_t length) {
+  return malloc_within_budget(length, 0);
+}
+
+void malloc_map(void *addr, size_t length, void *caller) {
+  memory_alloc(length);
+  malloc_lock();
+  malloc_log_block(addr, length, caller, MALLOC_MMAP);
+  malloc_unlock();
+}
+
+// a mapping unmapped partially is forgotten as a whole
+void malloc_unmap(void *addr) {
+  malloc_lock();
+  struct malloc_elem_t *e=malloc_log_find(&logs.malloc, addr);
+  if(e!=NULL && e->kind==MALLOC_MMAP)
+    memory_free(malloc_free_ptr(addr));
+  malloc_unlock();
+}
+
+//
+// Guarded mode, enabled by monitored.malloc_guard: the blocks allocated
+// in the sandbox come from the slots of trap.c, with a guard page on one
+// side, so that overflowing them is a segfault. The blocks which cannot
+// be guarded (more than 128 pages, or too many blocks) come from malloc.
+// Guarded blocks are recognized by free and realloc even after the
+// sandbox, or once the mode is disabled.
+//
+
+static bool malloc_guarded() {
+  return wrap_monitoring && monitored.malloc_guard;
+}
+
+static void *malloc_block(size_t size) {
+  if(malloc_guarded()) {
+    void *ptr=trap_alloc(size, monitored.malloc_guard_left ? TRAP_LEFT : TRAP_RIGHT);
+    if(ptr!=NULL)
+      return malloc_fresh(ptr);
   }
-  return -1;
+  return malloc_fresh(__real_malloc(size));
 }
 
+static void *malloc_zeroed_block(size_t nmemb, size_t size) {
+  size_t bytes;
+  if(malloc_guarded() && !__builtin_mul_overflow(nmemb, size, &bytes)) {
+    // guarded blocks start zeroed
+    void *ptr=trap_alloc(bytes, monitored.malloc_guard_left ? TRAP_LEFT : TRAP_RIGHT);
+    if(ptr!=NULL)
+      return malloc_fresh(ptr);
+  }
+  return malloc_fresh(__real_calloc(nmemb, size));
+}
+
+// block replaced by realloc, kept in the quarantine in the sandbox
+static void malloc_dispose(void *ptr, size_t size) {
+  if(!wrap_monitoring) {
+    malloc_release(ptr);
+    return;
+  }
+  malloc_lock();
+  quarantine_push(ptr, size);
+  malloc_unlock();
+}
+
+// realloc in the sandbox, or of a guarded block: when the block moves,
+// the old one goes to the quarantine, so that freeing it again is
+// detected. In the guarded mode, or for a guarded block, the block
+// always moves, so that the old pointer cannot be used anymore.
+static void *malloc_resize(void *ptr, size_t size) {
+  size_t old_size=0;
+  bool guarded=ptr!=NULL && trap_allocated(ptr, &old_size);
+  if(!guarded && !malloc_checked())
+    return malloc_fresh(__real_realloc(ptr, size));
+  if(ptr!=NULL && !guarded)
+    old_size=malloc_usable_size(ptr);
+  if(ptr!=NULL && size==0) {
+    malloc_dispose(ptr, old_size);
+    return NULL;
+  }
+  // fits in the block
+  if(ptr!=NULL && !guarded && !malloc_guarded() && size<=old_size)
+    return ptr;
+  void *r_ptr=malloc_block(size);
+  if(r_ptr==NULL || ptr==NULL)
+    return r_ptr;
+  memcpy(r_ptr, ptr, old_size<size ? old_size : size);
+  malloc_dispose(ptr, old_size);
+  return r_ptr;
+}
 
 void * __wrap_malloc(size_t size) {
   if(!wrap_monitoring || !monitored.malloc) {
-    return __real_malloc(size);
+    return malloc_block(size);
   }
-  stats.malloc.called++;
-  stats.malloc.last_params.size=size;
-  if(FAIL(failures.malloc)) {
-    failures.malloc=NEXT(failures.malloc);
+  struct wrap_stats_t *shard=STATS_SHARD(malloc);
+  shard->malloc.called++;
+  shard->malloc.last_params.size=size;
+  if(fail_call(&failures.malloc, &failures.malloc_schedule, size)) {
+    errno=ENOMEM;
     return failures.malloc_ret;
   }
-  stats.memory.used+=size;
-  failures.malloc=NEXT(failures.malloc);    
-  void *ptr=__real_malloc(size);
-  stats.malloc.last_return=ptr;
-  log_malloc(ptr,size);
+  if(!malloc_within_budget(size, 0))
+    return shard->malloc.last_return=NULL;
+  void *ptr=malloc_block(size);
+  shard->malloc.last_return=ptr;
+  malloc_account(ptr,size,__builtin_return_address(0));
   return ptr;
 }
 
+// checked realloc, shared with reallocarray, caller is the return
+// address of the wrapper. The block is logged under its new address
+// even if realloc is not monitored, so that the log never keeps a
+// freed block.
+static void *malloc_realloc(void *ptr, size_t size, void *caller) {
+  malloc_lock();
+  if(!malloc_check_free(ptr)) {
+    malloc_unlock();
+    return NULL;
+  }
+  bool logged=ptr!=NULL && malloc_log_find(&logs.malloc, ptr)!=NULL;
+  size_t old_size=find_size_malloc(ptr);
+  malloc_unlock();
+  if(!malloc_within_budget(size, old_size))
+    return NULL;
+  void *r_ptr=malloc_resize(ptr,size);
+  malloc_lock();
+  if(r_ptr!=NULL) {
+    // the block may have moved, record it under its new address
+    if(logged) {
+      malloc_free_ptr(ptr);
+      memory_free(old_size);
+    }
+    log_malloc(r_ptr,size,caller);
+    memory_alloc(size);
+  } else if(logged && size==0) {
+    // realloc(ptr, 0) frees ptr
+    malloc_free_ptr(ptr);
+    memory_free(old_size);
+  }
+  malloc_unlock();
+  return r_ptr;
+}
+
 void * __wrap_realloc(void *ptr, size_t size) {
-  if(!wrap_monitoring || !monitored.realloc) {
-    return __real_realloc(ptr, size);
+  if(!malloc_checked()) {
+    return malloc_resize(ptr, size);
   }
-  stats.realloc.called++;
-  stats.realloc.last_params.size=size;
-  if(FAIL(failures.realloc)) {
-    failures.realloc=NEXT(failures.realloc);
-    return failures.realloc_ret;
+  if(!monitored.realloc) {
+    return malloc_realloc(ptr,size,__builtin_return_address(0));
   }
-  failures.realloc=NEXT(failures.realloc);    
-  int old_size=find_size_malloc(ptr);
-  void *r_ptr=__real_realloc(ptr,size);
-  stats.realloc.last_return=r_ptr;
-  if(ptr!=NULL) {
-      stats.memory.used+=size-old_size;
-      update_realloc_block(ptr,size);
+  struct wrap_stats_t *shard=STATS_SHARD(realloc);
+  shard->realloc.called++;
+  shard->realloc.last_params.ptr=ptr;
+  shard->realloc.last_params.size=size;
+  if(fail_call(&failures.realloc, &failures.realloc_schedule, size)) {
+    errno=ENOMEM;
+    return failures.realloc_ret;
   }
+  void *r_ptr=malloc_realloc(ptr,size,__builtin_return_address(0));
+  shard->realloc.last_return=r_ptr;
   return r_ptr;
 }
 
-
 void * __wrap_calloc(size_t nmemb, size_t size) {
   if(!wrap_monitoring || !monitored.calloc) {
-    return __real_calloc(nmemb, size);
+    return malloc_zeroed_block(nmemb, size);
   }
-  stats.calloc.called++;
-  stats.calloc.last_params.size=size;
-  stats.calloc.last_params.nmemb=nmemb;
+  struct wrap_stats_t *shard=STATS_SHARD(calloc);
+  shard->calloc.called++;
+  shard->calloc.last_params.size=size;
+  shard->calloc.last_params.nmemb=nmemb;
 
-  if(FAIL(failures.calloc)) {
-    failures.calloc=NEXT(failures.calloc);
+  size_t bytes;
+  if(__builtin_mul_overflow(nmemb, size, &bytes))
+    bytes=SIZE_MAX;
+  if(fail_call(&failures.calloc, &failures.calloc_schedule, bytes)) {
+    errno=ENOMEM;
     return failures.calloc_ret;
   }
-  stats.memory.used+=nmemb*size;
-  failures.calloc=NEXT(failures.calloc);
+  if(!malloc_within_budget(bytes, 0))
+    return shard->calloc.last_return=NULL;
     
-  void *ptr=__real_calloc(nmemb,size);
-  stats.calloc.last_return=ptr;
-  log_malloc(ptr,nmemb*size);
+  void *ptr=malloc_zeroed_block(nmemb,size);
+  shard->calloc.last_return=ptr;
+  malloc_account(ptr,bytes,__builtin_return_address(0));
   return ptr;
 }
 
-int malloc_free_ptr(void *ptr) {
-
-  for(int i=0;i<MAX_LOG;i++) {
-    if(logs.malloc.log[i].ptr==ptr) {
-      int size=logs.malloc.log[i].size;
-      logs.malloc.log[i].size=-1;
-      logs.malloc.log[i].ptr=NULL;
-      return size;
+void __wrap_free(void *ptr) {
+  if(!malloc_checked()) {
+    // the block may still be in the quarantine of a previous sandbox
+    if(quarantine.n==0) {
+      malloc_release(ptr);
+      return;
     }
+    malloc_lock();
+    bool kept=quarantined(ptr);
+    malloc_unlock();
+    if(!kept)
+      malloc_release(ptr);
+    return;
+  }
+  if(monitored.free) {
+    struct wrap_stats_t *shard=STATS_SHARD(free);
+    shard->free.called++;
+    shard->free.last_params.ptr=ptr;
+  }
+  if(ptr==NULL)
+    return;
+  // a free which fails leaves the block allocated
+  if(monitored.free && fail_call(&failures.free, &failures.free_schedule, 0))
+    return;
+  malloc_lock();
+  if(!malloc_check_free(ptr)) {
+    malloc_unlock();
+    return;
   }
-  return 0;
-}
 
-void __wrap_free(void *ptr) {
-  if(!wrap_monitoring || !monitored.free) {
-    return __real_free(ptr);
+  // the block leaves the log before entering the quarantine, even if
+  // free is not monitored, so that freeing it again is detected
+  size_t size=0;
+  if(malloc_log_find(&logs.malloc, ptr)!=NULL) {
+    size=malloc_free_ptr(ptr);
+    memory_free(size);
   }
-  stats.free.called++;
-  stats.free.last_params.ptr=ptr;
-  if(ptr!=NULL) {
-    stats.memory.used-=malloc_free_ptr(ptr);
+  quarantine_push(ptr, size);
+  malloc_unlock();
+}
 
-    if (FAIL(failures.free))
-      failures.free=NEXT(failures.free);
-    else
-      __real_free(ptr);
+//
+// The other allocation functions of the libc allocate their blocks like
+// malloc, and are logged and counted in the same way.
+//
+
+// copy of the len first bytes of s, followed by a null byte
+static char *malloc_copy(const char *s, size_t len) {
+  char *copy=malloc_block(len+1);
+  if(copy!=NULL) {
+    memcpy(copy, s, len);
+    copy[len]='\0';
   }
+  return copy;
 }
 
+char * __wrap_strdup(const char *s) {
+  if(!wrap_monitoring || !monitored.strdup) {
+    return malloc_copy(s, strlen(s));
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(strdup);
+  shard->strdup.called++;
+  shard->strdup.last_params.s=s;
+  size_t len=strlen(s);
+  if(fail_call(&failures.strdup, &failures.strdup_schedule, len+1)) {
+    errno=ENOMEM;
+    return failures.strdup_ret;
+  }
+  if(!malloc_within_budget(len+1, 0))
+    return shard->strdup.last_return=NULL;
+  char *copy=malloc_copy(s, len);
+  shard->strdup.last_return=copy;
+  malloc_account(copy,len+1,__builtin_return_address(0));
+  return copy;
+}
 
-/*
-void * find_ptr_malloc(size_t size){
-  for(int i=0;i<MAX_LOG;i++) {
-    if(logs.malloc.log[i].size==size) 
-      return logs.malloc.log[i].ptr;
+char * __wrap_strndup(const char *s, size_t n) {
+  if(!wrap_monitoring || !monitored.strndup) {
+    return malloc_copy(s, strnlen(s, n));
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(strndup);
+  shard->strndup.called++;
+  shard->strndup.last_params.s=s;
+  shard->strndup.last_params.n=n;
+  size_t len=strnlen(s, n);
+  if(fail_call(&failures.strndup, &failures.strndup_schedule, len+1)) {
+    errno=ENOMEM;
+    return failures.strndup_ret;
   }
-  return NULL;
+  if(!malloc_within_budget(len+1, 0))
+    return shard->strndup.last_return=NULL;
+  char *copy=malloc_copy(s, len);
+  shard->strndup.last_return=copy;
+  malloc_account(copy,len+1,__builtin_return_address(0));
+  return copy;
 }
 
-void malloc_log_init(struct malloc_t *l) {
-  for(int i=0;i<MAX_LOG;i++) {
-    l->log[i].size=-1;
-    l->log[i].ptr=NULL;
+// the blocks of malloc are aligned on 2*sizeof(size_t) bytes, they
+// can be guarded when no larger alignment is required
+static void *malloc_aligned_block(size_t alignment, size_t size) {
+  if(alignment!=0 && alignment<=2*sizeof(size_t) && (alignment & (alignment-1))==0)
+    return malloc_block(size);
+  return malloc_fresh(__real_aligned_alloc(alignment, size));
+}
+
+// posix_memalign, which returns an error number and leaves *memptr
+// unchanged if it fails
+static int malloc_memalign(void **memptr, size_t alignment, size_t size) {
+  if(alignment==0 || alignment%sizeof(void *) || (alignment & (alignment-1)))
+    return EINVAL;
+  void *ptr=malloc_aligned_block(alignment, size);
+  if(ptr==NULL)
+    return ENOMEM;
+  *memptr=ptr;
+  return 0;
+}
+
+void * __wrap_aligned_alloc(size_t alignment, size_t size) {
+  if(!wrap_monitoring || !monitored.aligned_alloc) {
+    return malloc_aligned_block(alignment, size);
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(aligned_alloc);
+  shard->aligned_alloc.called++;
+  shard->aligned_alloc.last_params.alignment=alignment;
+  shard->aligned_alloc.last_params.size=size;
+  if(fail_call(&failures.aligned_alloc, &failures.aligned_alloc_schedule, size)) {
+    errno=ENOMEM;
+    return failures.aligned_alloc_ret;
   }
-  l->n=0;
+  if(!malloc_within_budget(size, 0))
+    return shard->aligned_alloc.last_return=NULL;
+  void *ptr=malloc_aligned_block(alignment, size);
+  shard->aligned_alloc.last_return=ptr;
+  malloc_account(ptr,size,__builtin_return_address(0));
+  return ptr;
+}
 
+int __wrap_posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if(!wrap_monitoring || !monitored.posix_memalign) {
+    return malloc_memalign(memptr, alignment, size);
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(posix_memalign);
+  shard->posix_memalign.called++;
+  shard->posix_memalign.last_params.memptr=memptr;
+  shard->posix_memalign.last_params.alignment=alignment;
+  shard->posix_memalign.last_params.size=size;
+  if(fail_call(&failures.posix_memalign, &failures.posix_memalign_schedule, size)) {
+    shard->posix_memalign.last_return=failures.posix_memalign_ret;
+    return failures.posix_memalign_ret;
+  }
+  if(!malloc_within_budget(size, 0))
+    return shard->posix_memalign.last_return=ENOMEM;
+  int ret=malloc_memalign(memptr, alignment, size);
+  shard->posix_memalign.last_return=ret;
+  if(ret==0)
+    malloc_account(*memptr,size,__builtin_return_address(0));
+  return ret;
 }
 
-*/
-int  malloc_allocated() {
-  int tot=0;
-  for(int i=0;i<MAX_LOG;i++) {
-    if(logs.malloc.log[i].ptr!=NULL) {
-      tot+=(int) logs.malloc.log[i].size;
+void * __wrap_reallocarray(void *ptr, size_t nmemb, size_t size) {
+  size_t bytes;
+  bool overflow=__builtin_mul_overflow(nmemb, size, &bytes);
+  if(!wrap_monitoring || !monitored.reallocarray) {
+    if(overflow) {
+      errno=ENOMEM;
+      return NULL;
     }
+    if(!malloc_checked())
+      return malloc_resize(ptr, bytes);
+    return malloc_realloc(ptr,bytes,__builtin_return_address(0));
+  }
+  struct wrap_stats_t *shard=STATS_SHARD(reallocarray);
+  shard->reallocarray.called++;
+  shard->reallocarray.last_params.ptr=ptr;
+  shard->reallocarray.last_params.nmemb=nmemb;
+  shard->reallocarray.last_params.size=size;
+  if(fail_call(&failures.reallocarray, &failures.reallocarray_schedule,
+               overflow ? SIZE_MAX : bytes)) {
+    errno=ENOMEM;
+    return failures.reallocarray_ret;
+  }
+  if(overflow) {
+    errno=ENOMEM;
+    return shard->reallocarray.last_return=NULL;
   }
-  return tot;
+  void *r_ptr=malloc_realloc(ptr,bytes,__builtin_return_address(0));
+  shard->reallocarray.last_return=r_ptr;
+  return r_ptr;
+}
+
+
+size_t malloc_allocated() {
+  return logs.malloc.bytes;
+}
+
+static int malloc_index_cmp(const void *a, const void *b) {
+  uintptr_t x=(uintptr_t) *(void * const *) a, y=(uintptr_t) *(void * const *) b;
+  return (x > y) - (x < y);
+}
+
+// false if the index could not be allocated
+static bool malloc_index_build() {
+  if(malloc_index.valid && malloc_index.changes==logs.malloc.changes)
+    return true;
+  malloc_index_reset();
+  if(logs.malloc.n > 0) {
+    malloc_index.ptr=__real_malloc(logs.malloc.n*sizeof(void *));
+    if(malloc_index.ptr==NULL)
+      return false;
+  }
+  for(size_t i=0;i<logs.malloc.cap;i++) {
+    if(logs.malloc.log[i].ptr!=NULL)
+      malloc_index.ptr[malloc_index.n++]=logs.malloc.log[i].ptr;
+  }
+  qsort(malloc_index.ptr, malloc_index.n, sizeof(void *), malloc_index_cmp);
+  malloc_index.changes=logs.malloc.changes;
+  malloc_index.valid=true;
+  return true;
+}
+
+// block whose first byte is at most addr, NULL if there is none.
+// Called with the lock held.
+static struct malloc_elem_t *malloc_index_find(void *addr) {
+  if(!malloc_index_build())
+    return NULL;
+  size_t lo=0, hi=malloc_index.n;
+  while(lo < hi) {
+    size_t mid=lo+(hi-lo)/2;
+    if((uintptr_t) malloc_index.ptr[mid] <= (uintptr_t) addr)
+      lo=mid+1;
+    else
+      hi=mid;
+  }
+  return lo > 0 ? malloc_log_find(&logs.malloc, malloc_index.ptr[lo-1]) : NULL;
 }
 
 /*
@@ -195,12 +895,73 @@ int  malloc_allocated() {
  * otherwise (also false if address has been freed)
  */
 int malloced(void *addr) {
-  for(int i=0;i<logs.malloc.n;i++) {
-    if(logs.malloc.log[i].ptr<=addr && 
-       (logs.malloc.log[i].ptr+ logs.malloc.log[i].size)>=addr) {
-      return true;
-    }
+  malloc_lock();
+  struct malloc_elem_t *e=malloc_log_find(&logs.malloc, addr);
+  // addr may point inside a block
+  if(e==NULL)
+    e=malloc_index_find(addr);
+  bool found=e!=NULL && (e->ptr==addr || (char *) addr < (char *) e->ptr+e->size);
+  malloc_unlock();
+  return found;
+}
+
+static int malloc_site_cmp_leaks(const void *a, const void *b) {
+  const struct malloc_site_t *x=a, *y=b;
+  return (x->live_bytes < y->live_bytes) - (x->live_bytes > y->live_bytes);
+}
+
+static int malloc_site_cmp_bytes(const void *a, const void *b) {
+  const struct malloc_site_t *x=a, *y=b;
+  return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+int malloc_sites(struct malloc_site_t *sites, int n, bool leaks) {
+  struct malloc_site_t *all=__real_malloc((logs.malloc_sites.n+1)*sizeof(struct malloc_site_t));
+  if(all==NULL)
+    return 0;
+  int nb=0;
+  for(size_t i=0;i<logs.malloc_sites.cap;i++) {
+    struct malloc_site_t *site=&logs.malloc_sites.sites[i];
+    if(site->caller!=NULL && (!leaks || site->live > 0))
+      all[nb++]=*site;
   }
-  return false;
+  qsort(all, nb, sizeof(struct malloc_site_t), leaks ? malloc_site_cmp_leaks : malloc_site_cmp_bytes);
+  if(nb > n)
+    nb=n;
+  memcpy(sites, all, nb*sizeof(struct malloc_site_t));
+  __real_free(all);
+  return nb;
+}
+
+void malloc_site_name(void *caller, char *buf, size_t len) {
+  Dl_info info;
+  // info is left unset if caller is not in a loaded object
+  if(!dladdr(caller, &info))
+    snprintf(buf, len, "%p", caller);
+  else if(info.dli_sname!=NULL)
+    snprintf(buf, len, "%s+0x%lx", info.dli_sname,
+             (unsigned long) ((char *) caller-(char *) info.dli_saddr));
+  else if(info.dli_fname!=NULL)
+    snprintf(buf, len, "%s+0x%lx", info.dli_fname,
+             (unsigned long) ((char *) caller-(char *) info.dli_fbase));
+  else
+    snprintf(buf, len, "%p", caller);
+}
 
+int malloc_sites_summary(char *buf, size_t len, int n, bool leaks) {
+  struct malloc_site_t sites[n];
+  int nb=malloc_sites(sites, n, leaks);
+  size_t off=0;
+  buf[0]='\0';
+  for(int i=0;i<nb && off<len;i++) {
+    char name[128];
+    malloc_site_name(sites[i].caller, name, sizeof(name));
+    if(leaks)
+      off+=snprintf(buf+off, len-off, _("%s%s: %d blocks (%zu bytes) not freed"),
+                    i ? "; " : "", name, sites[i].live, sites[i].live_bytes);
+    else
+      off+=snprintf(buf+off, len-off, _("%s%s: %d blocks (%zu bytes) allocated"),
+                    i ? "; " : "", name, sites[i].calls, sites[i].bytes);
+  }
+  return nb;
 }
@@ -16,12 +16,32 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 // log for malloc operations
 
 
+// what a logged block is, and how it must be released
+
+enum malloc_kind_t {
+  MALLOC_HEAP,  // malloc, calloc, realloc, strdup, ..., released by free
+  MALLOC_MMAP,  // anonymous mapping, released by munmap
+};
+
 struct malloc_elem_t {
   size_t size;
   void *ptr;
+  void *caller; // return address of the allocation wrapper
+  enum malloc_kind_t kind;
+};
+
+// allocations aggregated per callsite
+
+struct malloc_site_t {
+  void *caller;       // return address in the code that called malloc
+  int calls;          // number of blocks allocated from there
+  size_t bytes;       // total size of these blocks
+  int live;           // number of these blocks not freed yet
+  size_t live_bytes;  // total size of the blocks not freed yet
 };
 
 
@@ -40,7 +60,13 @@ struct stats_malloc_t {
 };
 
 struct stats_memory_t {
-  int used;  // Total number of bytes allocated
+  size_t used;            // Total number of bytes allocated
+  size_t peak;            // highest value reached by used
+  size_t total_allocated; // number of bytes allocated, including the freed blocks
+  int allocations;        // number of blocks allocated (malloc, calloc, realloc, strdup,
+                          // strndup, aligned_alloc, posix_memalign, reallocarray, mmap)
+  int frees;              // number of blocks released (free, realloc, reallocarray, munmap)
+  int over_budget;        // allocations refused by failures.memory_budget
 };
 
 // basic structure to record the parameters of the last malloc call
@@ -70,6 +96,9 @@ struct params_free_t {
 struct stats_free_t {
   int called;  // number of times the free call has been issued
   struct params_free_t last_params; // parameters for the last call issued
+  int double_free;  // number of blocks freed twice (also by realloc)
+  int invalid_free; // number of pointers freed but not returned by malloc
+  void *last_invalid; // last pointer reported as double or invalid free
 };
 
 
@@ -89,12 +118,115 @@ struct stats_realloc_t {
 };
 
 
+// basic structure to record the parameters of the last strdup call
+
+struct params_strdup_t {
+  const char *s;
+};
+
+// basic statistics for the utilisation of the strdup call
+
+struct stats_strdup_t {
+  int called;  // number of times the strdup call has been issued
+  struct params_strdup_t last_params; // parameters for the last call issued
+  char *last_return;   // return value of the last strdup call issued
+};
+
+
+// basic structure to record the parameters of the last strndup call
+
+struct params_strndup_t {
+  const char *s;
+  size_t n;
+};
+
+// basic statistics for the utilisation of the strndup call
+
+struct stats_strndup_t {
+  int called;  // number of times the strndup call has been issued
+  struct params_strndup_t last_params; // parameters for the last call issued
+  char *last_return;   // return value of the last strndup call issued
+};
+
+
+// basic structure to record the parameters of the last aligned_alloc call
+
+struct params_aligned_alloc_t {
+  size_t alignment;
+  size_t size;
+};
+
+// basic statistics for the utilisation of the aligned_alloc call
+
+struct stats_aligned_alloc_t {
+  int called;  // number of times the aligned_alloc call has been issued
+  struct params_aligned_alloc_t last_params; // parameters for the last call issued
+  void *last_return;   // return value of the last aligned_alloc call issued
+};
+
+
+// basic structure to record the parameters of the last posix_memalign call
+
+struct params_posix_memalign_t {
+  void **memptr;
+  size_t alignment;
+  size_t size;
+};
+
+// basic statistics for the utilisation of the posix_memalign call
+
+struct stats_posix_memalign_t {
+  int called;  // number of times the posix_memalign call has been issued
+  struct params_posix_memalign_t last_params; // parameters for the last call issued
+  int last_return;     // return value of the last posix_memalign call issued
+};
+
+
+// basic structure to record the parameters of the last reallocarray call
+
+struct params_reallocarray_t {
+  void *ptr;
+  size_t nmemb;
+  size_t size;
+};
+
+// basic statistics for the utilisation of the reallocarray call
+
+struct stats_reallocarray_t {
+  int called;  // number of times the reallocarray call has been issued
+  struct params_reallocarray_t last_params; // parameters for the last call issued
+  void *last_return;   // return value of the last reallocarray call issued
+};
+
+
 // function prototypes
 
-//void malloc_log_init(struct malloc_t *l);
-void malloc_log(void *ptr, size_t size);
+void log_malloc(void *ptr, size_t size, void *caller);
+// accounting of the anonymous mappings by the wrappers of mmap and
+// munmap: they are logged and counted like the blocks of malloc.
+// malloc_map_budget is false, with errno set, if a mapping of length
+// bytes would exceed failures.memory_budget. malloc_unmap forgets the
+// mapping starting at addr, if there is one.
+bool malloc_map_budget(size_t length);
+void malloc_map(void *addr, size_t length, void *caller);
+void malloc_unmap(void *addr);
+// releases the malloc log and the quarantine, called before each test
+void malloc_log_reset();
+// makes fork wait until no thread holds the lock of the log, so that
+// the child does not inherit it held
+void malloc_atfork();
 
 // true if memory was allocated by malloc, false otherwise
 int malloced(void *addr);
 // total amount of memory allocated by malloc
-int  malloc_allocated();
\ No newline at end of file
+size_t malloc_allocated();
+
+// copies at most n callsites to sites, sorted by decreasing size of the
+// blocks not freed (leaks=true, only the sites with such blocks) or by
+// decreasing total size allocated (leaks=false). Returns their number.
+int malloc_sites(struct malloc_site_t *sites, int n, bool leaks);
+// name of a callsite, "function+offset", found with dladdr
+void malloc_site_name(void *caller, char *buf, size_t len);
+// one line summary of the n top callsites, to be given to push_info_msg.
+// Returns the number of callsites in the summary.
+int malloc_sites_summary(char *buf, size_t len, int n, bool leaks);
@@ -1,8 +1,18 @@
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <dlfcn.h>
 #include "wrap.h" // system call wrapper
 #include <pthread.h>
+#include <sched.h>
+#include <libintl.h>
+#define _(STRING) gettext(STRING)
 
 
 //int pthread_mutex_lock(pthread_mutex_t *mutex);
@@ -20,6 +30,7 @@ extern bool wrap_monitoring;
 extern struct wrap_stats_t stats;
 extern struct wrap_monitor_t monitored;
 extern struct wrap_fail_t failures;
+extern struct wrap_log_t logs;
 
 
 void init_mutex() {
@@ -50,10 +61,11 @@ int __wrap_pthread_mutex_destroy(pthread_mutex_t *mutex) {
   }
   // being monitored
 
-  stats.pthread_mutex_destroy.called++;
+  struct wrap_stats_t *shard=STATS_SHARD(pthread_mutex_destroy);
+  shard->pthread_mutex_destroy.called++;
   int ret=__real_pthread_mutex_destroy(mutex);
-  stats.pthread_mutex_destroy.last_arg=mutex;
-  stats.pthread_mutex_destroy.last_return=ret;
+  shard->pthread_mutex_destroy.last_arg=mutex;
+  shard->pthread_mutex_destroy.last_return=ret;
   return ret;
 }
 
@@ -65,53 +77,516 @@ int __wrap_pthread_mutex_init(pthread_mutex_t *restrict mutex,
   }
   // being monitored
 
-  stats.pthread_mutex_init.called++;
+  struct wrap_stats_t *shard=STATS_SHARD(pthread_mutex_init);
+  shard->pthread_mutex_init.called++;
+  shard->pthread_mutex_init.last_arg=mutex;
+  if(fail_call(&failures.pthread_mutex_init, &failures.pthread_mutex_init_schedule, 0)) {
+    int err=failures.pthread_mutex_init_ret ? failures.pthread_mutex_init_ret : ENOMEM;
+    shard->pthread_mutex_init.last_return=err;
+    return err;
+  }
   int ret=__real_pthread_mutex_init(mutex,attr);
-  stats.pthread_mutex_init.last_arg=mutex;
-  stats.pthread_mutex_init.last_return=ret;
+  shard->pthread_mutex_init.last_return=ret;
+  return ret;
+
+}
+
+
+static uint64_t mutex_now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t) t.tv_sec*1000000000+t.tv_nsec;
+}
+
+static size_t mutex_profile_hash(pthread_mutex_t *mutex) {
+  uint64_t h=((uintptr_t) mutex >> 3) * 0x9E3779B97F4A7C15ULL;
+  return (size_t) (h ^ (h >> 32)) & (MUTEX_PROFILE_MAX-1);
+}
+
+// slot of mutex in logs.mutex, created if needed. NULL if the table is full
+static struct mutex_profile_t *mutex_profile_get(pthread_mutex_t *mutex) {
+  size_t i=mutex_profile_hash(mutex);
+  for(int probe=0;probe<MUTEX_PROFILE_MAX;probe++) {
+    struct mutex_profile_t *p=&logs.mutex.profiles[i];
+    pthread_mutex_t *cur=__atomic_load_n(&p->mutex, __ATOMIC_ACQUIRE);
+    if(cur==mutex)
+      return p;
+    if(cur==NULL) {
+      if(__atomic_compare_exchange_n(&p->mutex, &cur, mutex, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_add_fetch(&logs.mutex.n, 1, __ATOMIC_RELAXED);
+        return p;
+      }
+      if(cur==mutex)
+        return p;
+    }
+    i=(i+1) & (MUTEX_PROFILE_MAX-1);
+  }
+  __atomic_add_fetch(&logs.mutex.dropped, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+struct mutex_profile_t *mutex_profile(pthread_mutex_t *mutex) {
+  size_t i=mutex_profile_hash(mutex);
+  for(int probe=0;probe<MUTEX_PROFILE_MAX;probe++) {
+    struct mutex_profile_t *p=&logs.mutex.profiles[i];
+    if(p->mutex==mutex)
+      return p;
+    if(p->mutex==NULL)
+      return NULL;
+    i=(i+1) & (MUTEX_PROFILE_MAX-1);
+  }
+  return NULL;
+}
+
+// called once the mutex is acquired, after waiting wait_ns
+static void mutex_profile_acquired(pthread_mutex_t *mutex, bool contended, uint64_t wait_ns) {
+  struct mutex_profile_t *p=mutex_profile_get(mutex);
+  if(p==NULL)
+    return;
+  p->acquisitions++;
+  if(contended) {
+    p->contended++;
+    p->wait_ns+=wait_ns;
+    if(wait_ns>p->max_wait_ns)
+      p->max_wait_ns=wait_ns;
+  }
+  p->locked_at=mutex_now();
+}
+
+// called before the mutex is released
+static void mutex_profile_released(pthread_mutex_t *mutex) {
+  struct mutex_profile_t *p=mutex_profile(mutex);
+  if(p==NULL || p->locked_at==0)
+    return;
+  uint64_t hold=mutex_now()-p->locked_at;
+  p->locked_at=0;
+  p->hold_ns+=hold;
+  int bucket=hold ? 63-__builtin_clzll(hold) : 0;
+  if(bucket>=MUTEX_HOLD_BUCKETS)
+    bucket=MUTEX_HOLD_BUCKETS-1;
+  p->hold_hist[bucket]++;
+}
+
+static int mutex_profile_cmp(const void *a, const void *b) {
+  const struct mutex_profile_t *x=a, *y=b;
+  return (x->wait_ns < y->wait_ns) - (x->wait_ns > y->wait_ns);
+}
+
+int mutex_profiles(struct mutex_profile_t *profiles, int n) {
+  struct mutex_profile_t all[MUTEX_PROFILE_MAX];
+  int nb=0;
+  for(int i=0;i<MUTEX_PROFILE_MAX;i++) {
+    if(logs.mutex.profiles[i].mutex!=NULL)
+      all[nb++]=logs.mutex.profiles[i];
+  }
+  qsort(all, nb, sizeof(struct mutex_profile_t), mutex_profile_cmp);
+  if(nb>n)
+    nb=n;
+  memcpy(profiles, all, nb*sizeof(struct mutex_profile_t));
+  return nb;
+}
+
+struct mutex_profile_t *mutex_hottest() {
+  struct mutex_profile_t *hottest=NULL;
+  for(int i=0;i<MUTEX_PROFILE_MAX;i++) {
+    struct mutex_profile_t *p=&logs.mutex.profiles[i];
+    if(p->mutex!=NULL && (hottest==NULL || p->wait_ns>hottest->wait_ns))
+      hottest=p;
+  }
+  return hottest;
+}
+
+//
+// Deadlock detection, enabled by monitored.pthread_mutex_deadlock. As in
+// the kernel's lockdep, the mutexes form a graph with an edge from a to
+// b when b is locked by a thread holding a. A cycle in this graph means
+// that two threads can lock the same mutexes in opposite orders, and is
+// reported as soon as it appears, even if the threads did not block
+// yet. A thread which blocks on a mutex also follows the chain of the
+// owners of the mutexes they wait for: if it comes back to itself, the
+// threads are deadlocked. The graph is protected by a spinlock, and
+// reset at the beginning of each sandbox.
+//
+
+#define LOCK_GRAPH_MAX 64  // mutexes and threads tracked
+#define LOCK_HELD_MAX 16   // mutexes held at the same time by a thread
+
+static struct {
+  unsigned int gen;  // sandbox of the graph, to reset the threads lazily
+  int lock;
+  int nodes;
+  pthread_mutex_t *mutex[LOCK_GRAPH_MAX];
+  uint64_t edges[LOCK_GRAPH_MAX];  // bit b of edges[a]: edge from a to b
+  int owner[LOCK_GRAPH_MAX];       // thread holding the mutex, -1 if none
+  int threads;
+  int waiting[LOCK_GRAPH_MAX];     // mutex a thread is blocked on, -1 if none
+} graph;
+
+static __thread struct {
+  unsigned int gen;
+  int thread;  // index of the thread in the graph, -1 if not tracked
+  int held;
+  int mutex[LOCK_HELD_MAX];
+} lock_thread;
+
+static void graph_lock() {
+  while(__atomic_test_and_set(&graph.lock, __ATOMIC_ACQUIRE)) {
+    while(__atomic_load_n(&graph.lock, __ATOMIC_RELAXED))
+      sched_yield();
+  }
+}
+
+static void graph_unlock() {
+  __atomic_clear(&graph.lock, __ATOMIC_RELEASE);
+}
+
+void mutex_graph_reset() {
+  graph_lock();
+  unsigned int gen=graph.gen;
+  memset(&graph.nodes, 0, sizeof(graph)-offsetof(typeof(graph), nodes));
+  graph.gen=gen+1;
+  graph_unlock();
+}
+
+// index of the calling thread, with the graph locked
+static int graph_thread() {
+  if(lock_thread.gen!=graph.gen) {
+    lock_thread.gen=graph.gen;
+    lock_thread.held=0;
+    lock_thread.thread=-1;
+    if(graph.threads<LOCK_GRAPH_MAX) {
+      lock_thread.thread=graph.threads++;
+      graph.waiting[lock_thread.thread]=-1;
+    }
+  }
+  return lock_thread.thread;
+}
+
+// index of mutex, with the graph locked. -1 if the graph is full
+static int graph_node(pthread_mutex_t *mutex) {
+  for(int i=0;i<graph.nodes;i++) {
+    if(graph.mutex[i]==mutex)
+      return i;
+  }
+  if(graph.nodes==LOCK_GRAPH_MAX)
+    return -1;
+  graph.mutex[graph.nodes]=mutex;
+  graph.owner[graph.nodes]=-1;
+  return graph.nodes++;
+}
+
+// true if there is a path from a to b in the graph
+static bool graph_path(int a, int b) {
+  uint64_t seen=1ULL << a;
+  int stack[LOCK_GRAPH_MAX];
+  int n=0;
+  stack[n++]=a;
+  while(n>0) {
+    int x=stack[--n];
+    if(x==b)
+      return true;
+    uint64_t next=graph.edges[x] & ~seen;
+    seen|=next;
+    while(next) {
+      stack[n++]=__builtin_ctzll(next);
+      next&=next-1;
+    }
+  }
+  return false;
+}
+
+// name of a mutex for the student, its variable if it is a global one
+static void mutex_name(pthread_mutex_t *mutex, char *buf, size_t len) {
+  Dl_info info;
+  if(dladdr(mutex, &info) && info.dli_sname!=NULL && info.dli_saddr==(void *) mutex)
+    snprintf(buf, len, "%s", info.dli_sname);
+  else
+    snprintf(buf, len, "%p", (void *) mutex);
+}
+
+// Aborts the sandbox. The thread leaves the sandbox or exits, so the
+// mutexes it holds are released first, for the other threads and tests.
+static void graph_deadlock(const char *fmt, pthread_mutex_t *a, pthread_mutex_t *b) {
+  char name_a[64], name_b[64], msg[256];
+  mutex_name(a, name_a, sizeof(name_a));
+  mutex_name(b, name_b, sizeof(name_b));
+  snprintf(msg, sizeof(msg), fmt, name_a, name_b);
+
+  pthread_mutex_t *held[LOCK_HELD_MAX];
+  graph_lock();
+  int n=lock_thread.held;
+  for(int i=0;i<n;i++) {
+    held[i]=graph.mutex[lock_thread.mutex[i]];
+    graph.owner[lock_thread.mutex[i]]=-1;
+  }
+  lock_thread.held=0;
+  if(lock_thread.thread>=0)
+    graph.waiting[lock_thread.thread]=-1;
+  graph_unlock();
+  for(int i=n-1;i>=0;i--)
+    __real_pthread_mutex_unlock(held[i]);
+  sandbox_deadlock(msg);
+  thread_exit();
+}
+
+// true if the owner of mutex can lock it again without blocking: it is
+// locked once more if it is recursive, and the lock fails with EDEADLK
+// if it checks errors. glibc keeps the type of a mutex in __kind, also
+// for the static initializers.
+static bool mutex_relockable(pthread_mutex_t *mutex) {
+  int type=mutex->__data.__kind & 3;
+  return type==PTHREAD_MUTEX_RECURSIVE || type==PTHREAD_MUTEX_ERRORCHECK;
+}
+
+// called before locking mutex. Adds the edges from the mutexes held by
+// the thread, and aborts the sandbox if they close a cycle. Returns
+// false if the thread already holds mutex, and can lock it again.
+static bool graph_before_lock(pthread_mutex_t *mutex) {
+  graph_lock();
+  int t=graph_thread();
+  int n=graph_node(mutex);
+  if(t<0 || n<0) {
+    graph_unlock();
+    return true;
+  }
+  if(graph.owner[n]==t && mutex_relockable(mutex)) {
+    graph_unlock();
+    return false;
+  }
+  for(int i=0;i<lock_thread.held;i++) {
+    int h=lock_thread.mutex[i];
+    if(h==n || (graph.edges[h] & (1ULL << n)))
+      continue;
+    graph.edges[h]|=1ULL << n;
+    if(graph_path(n, h)) {
+      graph_unlock();
+      graph_deadlock(_("Possible deadlock: the mutexes %s and %s are locked in opposite orders."),
+                     graph.mutex[h], mutex);
+      return true;
+    }
+  }
+  graph_unlock();
+  return true;
+}
+
+// called when the thread blocks on mutex. Aborts the sandbox if the
+// owners of the mutexes wait for each other.
+static void graph_wait(pthread_mutex_t *mutex) {
+  graph_lock();
+  int t=graph_thread();
+  int n=graph_node(mutex);
+  if(t<0 || n<0) {
+    graph_unlock();
+    return;
+  }
+  graph.waiting[t]=n;
+  int m=n;
+  for(int steps=0;steps<LOCK_GRAPH_MAX;steps++) {
+    int owner=graph.owner[m];
+    if(owner<0 || graph.waiting[owner]<0)
+      break;
+    if(owner==t) {
+      pthread_mutex_t *held=graph.mutex[m];
+      graph_unlock();
+      graph_deadlock(_("Deadlock: your threads wait for each other on the mutexes %s and %s."),
+                     held, mutex);
+      return;
+    }
+    m=graph.waiting[owner];
+  }
+  graph_unlock();
+}
+
+static void graph_acquired(pthread_mutex_t *mutex) {
+  graph_lock();
+  int t=graph_thread();
+  int n=graph_node(mutex);
+  if(t>=0 && n>=0) {
+    graph.waiting[t]=-1;
+    graph.owner[n]=t;
+    if(lock_thread.held<LOCK_HELD_MAX)
+      lock_thread.mutex[lock_thread.held++]=n;
+  }
+  graph_unlock();
+}
+
+static void graph_released(pthread_mutex_t *mutex) {
+  graph_lock();
+  int t=graph_thread();
+  int n=graph_node(mutex);
+  if(t>=0 && n>=0) {
+    // a recursive mutex is held until its last unlock
+    bool held=false;
+    for(int i=lock_thread.held-1;i>=0;i--) {
+      if(lock_thread.mutex[i]==n) {
+        memmove(&lock_thread.mutex[i], &lock_thread.mutex[i+1],
+                (lock_thread.held-i-1)*sizeof(int));
+        lock_thread.held--;
+        break;
+      }
+    }
+    for(int i=0;i<lock_thread.held && !held;i++)
+      held=lock_thread.mutex[i]==n;
+    if(graph.owner[n]==t && !held)
+      graph.owner[n]=-1;
+  }
+  graph_unlock();
+}
+
+// true if the mutexes need more than the real functions
+static bool mutex_tracked() {
+  return monitored.pthread_mutex_profile || monitored.pthread_mutex_deadlock || sched_running();
+}
+
+// Locks the mutex, without the statistics of pthread_mutex_lock. When
+// profiling or detecting deadlocks, a trylock first tells whether the
+// mutex was contended, and only then the wait is measured and the
+// owners are checked. With the scheduler, a thread which finds the
+// mutex locked lets another thread run until it is released.
+int wrap_mutex_acquire(pthread_mutex_t *mutex) {
+  bool scheduled=sched_running();
+  if(!monitored.pthread_mutex_profile && !monitored.pthread_mutex_deadlock && !scheduled)
+    return __real_pthread_mutex_lock(mutex);
+  if(monitored.pthread_mutex_deadlock && !graph_before_lock(mutex)) {
+    // relocked by its owner, without blocking
+    int ret=__real_pthread_mutex_lock(mutex);
+    if(ret==0 && monitored.pthread_mutex_profile)
+      mutex_profile_acquired(mutex, false, 0);
+    if(ret==0)
+      graph_acquired(mutex);
+    return ret;
+  }
+  if(scheduled)
+    sched_point();
+  int ret=__real_pthread_mutex_trylock(mutex);
+  if(ret==0) {
+    if(monitored.pthread_mutex_profile)
+      mutex_profile_acquired(mutex, false, 0);
+    if(monitored.pthread_mutex_deadlock)
+      graph_acquired(mutex);
+    return 0;
+  }
+  if(ret!=EBUSY)
+    return ret;
+  if(monitored.pthread_mutex_deadlock)
+    graph_wait(mutex);
+  uint64_t start=mutex_now();
+  ret=scheduled ? sched_mutex_lock(mutex) : __real_pthread_mutex_lock(mutex);
+  if(ret==0) {
+    if(monitored.pthread_mutex_profile)
+      mutex_profile_acquired(mutex, true, mutex_now()-start);
+    if(monitored.pthread_mutex_deadlock)
+      graph_acquired(mutex);
+  }
+  return ret;
+}
+
+// Unlocks the mutex, without the statistics of pthread_mutex_unlock
+int wrap_mutex_release(pthread_mutex_t *mutex) {
+  if(monitored.pthread_mutex_profile)
+    mutex_profile_released(mutex);
+  if(monitored.pthread_mutex_deadlock)
+    graph_released(mutex);
+  int ret=__real_pthread_mutex_unlock(mutex);
+  if(ret==0)
+    sched_mutex_unlocked(mutex);
   return ret;
+}
 
+// The real pthread_cond_wait releases the mutex while waiting: its hold
+// time and its owner are suspended before the wait, and resumed once it
+// is acquired again
+void wrap_mutex_suspend(pthread_mutex_t *mutex) {
+  if(monitored.pthread_mutex_profile)
+    mutex_profile_released(mutex);
+  if(monitored.pthread_mutex_deadlock)
+    graph_released(mutex);
 }
 
+void wrap_mutex_resume(pthread_mutex_t *mutex) {
+  if(monitored.pthread_mutex_profile) {
+    struct mutex_profile_t *p=mutex_profile(mutex);
+    if(p!=NULL)
+      p->locked_at=mutex_now();
+  }
+  if(monitored.pthread_mutex_deadlock)
+    graph_acquired(mutex);
+}
 
 pid_t __wrap_pthread_mutex_lock(pthread_mutex_t *mutex) {
-  if(!wrap_monitoring || !monitored.pthread_mutex_lock) {
+  if(!wrap_monitoring || (!monitored.pthread_mutex_lock && !mutex_tracked())) {
     return __real_pthread_mutex_lock(mutex);
   }
+  if(!monitored.pthread_mutex_lock)
+    return wrap_mutex_acquire(mutex);
   // being monitored
 
-  stats.pthread_mutex_lock.called++;
-  int ret=__real_pthread_mutex_lock(mutex);
-  stats.pthread_mutex_lock.last_arg=mutex;
-  stats.pthread_mutex_lock.last_return=ret;
+  struct wrap_stats_t *shard=STATS_SHARD(pthread_mutex_lock);
+  shard->pthread_mutex_lock.called++;
+  shard->pthread_mutex_lock.last_arg=mutex;
+  if(fail_call(&failures.pthread_mutex_lock, &failures.pthread_mutex_lock_schedule, 0)) {
+    int err=failures.pthread_mutex_lock_ret ? failures.pthread_mutex_lock_ret : EAGAIN;
+    shard->pthread_mutex_lock.last_return=err;
+    return err;
+  }
+  int ret=wrap_mutex_acquire(mutex);
+  shard->pthread_mutex_lock.last_return=ret;
   return ret;
 
 }
 
+// a mutex acquired by trylock cannot deadlock, but its owner is tracked
+static int mutex_trylock(pthread_mutex_t *mutex) {
+  sched_point();
+  int ret=__real_pthread_mutex_trylock(mutex);
+  if(ret==0 && monitored.pthread_mutex_profile)
+    mutex_profile_acquired(mutex, false, 0);
+  if(ret==0 && monitored.pthread_mutex_deadlock)
+    graph_acquired(mutex);
+  return ret;
+}
+
 pid_t __wrap_pthread_mutex_trylock(pthread_mutex_t *mutex) {
-  if(!wrap_monitoring || !monitored.pthread_mutex_trylock) {
+  if(!wrap_monitoring || (!monitored.pthread_mutex_trylock && !mutex_tracked())) {
     return __real_pthread_mutex_trylock(mutex);
   }
+  if(!monitored.pthread_mutex_trylock)
+    return mutex_trylock(mutex);
   // being monitored
 
-  stats.pthread_mutex_trylock.called++;
-  int ret=__real_pthread_mutex_trylock(mutex);
-  stats.pthread_mutex_trylock.last_arg=mutex;
-  stats.pthread_mutex_trylock.last_return=ret;
+  struct wrap_stats_t *shard=STATS_SHARD(pthread_mutex_trylock);
+  shard->pthread_mutex_trylock.called++;
+  shard->pthread_mutex_trylock.last_arg=mutex;
+  if(fail_call(&failures.pthread_mutex_trylock, &failures.pthread_mutex_trylock_schedule, 0)) {
+    int err=failures.pthread_mutex_trylock_ret ? failures.pthread_mutex_trylock_ret : EBUSY;
+    shard->pthread_mutex_trylock.last_return=err;
+    return err;
+  }
+  int ret=mutex_trylock(mutex);
+  shard->pthread_mutex_trylock.last_return=ret;
   return ret;
 
 }
 
 pid_t __wrap_pthread_mutex_unlock(pthread_mutex_t *mutex) {
-  if(!wrap_monitoring || !monitored.pthread_mutex_unlock) {
+  if(!wrap_monitoring || (!monitored.pthread_mutex_unlock && !mutex_tracked())) {
     return __real_pthread_mutex_unlock(mutex);
   }
+  int ret;
+  if(!monitored.pthread_mutex_unlock) {
+    ret=wrap_mutex_release(mutex);
+    sched_point();
+    return ret;
+  }
   // being monitored
 
-  stats.pthread_mutex_unlock.called++;
-  int ret=__real_pthread_mutex_unlock(mutex);
-  stats.pthread_mutex_unlock.last_arg=mutex;
-  stats.pthread_mutex_unlock.last_return=ret;
+  struct wrap_stats_t *shard=STATS_SHARD(pthread_mutex_unlock);
+  shard->pthread_mutex_unlock.called++;
+  ret=wrap_mutex_release(mutex);
+  shard->pthread_mutex_unlock.last_arg=mutex;
+  shard->pthread_mutex_unlock.last_return=ret;
+  sched_point();
   return ret;
 
 }
@@ -4,6 +4,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdint.h>
 
 struct stats_pthread_mutex_lock_t {
   int called;           // number of times the system call has been called
@@ -60,3 +61,39 @@ void init_pthread_mutex_destroy();
 void clean_pthread_mutex_destroy();
 void resetstats_pthread_mutex_destroy();
 
+// contention profile of a mutex, recorded when
+// monitored.pthread_mutex_profile is set. The fields are updated while
+// holding the mutex.
+
+#define MUTEX_HOLD_BUCKETS 32
+
+struct mutex_profile_t {
+  pthread_mutex_t *mutex;
+  int acquisitions;      // number of times the mutex was acquired
+  int contended;         // acquisitions that found the mutex already locked
+  uint64_t wait_ns;      // total time spent waiting for the mutex
+  uint64_t max_wait_ns;  // longest wait for the mutex
+  uint64_t hold_ns;      // total time the mutex was held
+  int hold_hist[MUTEX_HOLD_BUCKETS]; // hold_hist[i]: holds of 2^i to 2^(i+1)-1 ns
+  uint64_t locked_at;    // time of the last acquisition
+};
+
+// profile of a mutex, NULL if it was not locked while profiled
+struct mutex_profile_t *mutex_profile(pthread_mutex_t *mutex);
+// copies at most n profiles, sorted by decreasing total wait time,
+// returns their number
+int mutex_profiles(struct mutex_profile_t *profiles, int n);
+// profile of the mutex with the longest total wait time, NULL if none
+struct mutex_profile_t *mutex_hottest();
+
+// forgets the lock order graph of the deadlock detector, called by
+// sandbox_begin
+void mutex_graph_reset();
+
+// lock and unlock a mutex like the wrappers, without their statistics,
+// for the condition variables
+int wrap_mutex_acquire(pthread_mutex_t *mutex);
+int wrap_mutex_release(pthread_mutex_t *mutex);
+// around the real wait on a condition variable, which releases the mutex
+void wrap_mutex_suspend(pthread_mutex_t *mutex);
+void wrap_mutex_resume(pthread_mutex_t *mutex);
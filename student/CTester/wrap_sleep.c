@@ -32,19 +32,18 @@ unsigned int __wrap_sleep(unsigned int time) {
     return __real_sleep(time);
   }
 
-  stats.sleep.called++;
-  stats.sleep.last_arg = time;
+  struct wrap_stats_t *shard=STATS_SHARD(sleep);
+  shard->sleep.called++;
+  shard->sleep.last_arg = time;
   // being monitored
-  if (FAIL(failures.sleep)) {
-    failures.sleep=NEXT(failures.sleep);
-    stats.sleep.last_return=failures.sleep_ret;
+  if (fail_call(&failures.sleep, &failures.sleep_schedule, 0)) {
+    shard->sleep.last_return=failures.sleep_ret;
     return failures.sleep_ret;
   }
-  failures.sleep=NEXT(failures.sleep);
   // did not fail
 
   unsigned int ret=__real_sleep(time);
-  stats.sleep.last_return=ret;
+  shard->sleep.last_return=ret;
   return ret;
 }
 
@@ -0,0 +1,166 @@
+/*
+ * Per-thread statistics of the wrappers
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "wrap.h"
+
+//
+// The thread running the sandbox updates stats directly. Every other
+// thread gets its own shard, so that the wrappers never write to a
+// statistic shared between threads. The shards are merged into stats
+// by sandbox_end: the numbers of calls are added, and the last
+// parameters and return values are those of the most recent call. The
+// calls are ordered by a counter, which is only incremented while other
+// threads than the sandbox thread call the wrappers. The shard of a
+// thread which exits is reused by the next thread, with its statistics
+// not merged yet.
+//
+
+void *__real_calloc(size_t nmemb, size_t size);
+
+extern struct wrap_stats_t stats;
+
+#define STATS_SLOTS (sizeof(struct wrap_stats_t)/sizeof(int))
+
+struct stats_shard_t {
+  struct wrap_stats_t *stats;      // statistics updated by the thread
+  uint64_t last_call[STATS_SLOTS]; // order of the last call, per function
+  bool used;                       // by a running thread
+  struct stats_shard_t *next;
+  struct wrap_stats_t local;       // storage of the other threads
+};
+
+// per function statistics, from the number of calls to the end of the
+// fields that describe the last call. The others are shared by all
+// the threads and updated atomically.
+struct stats_entry_t {
+  size_t offset;
+  size_t size;
+};
+
+// the functions whose statistics start with the number of calls,
+// followed by the last parameters and return value
+#define STATS_FUNCTIONS(X) \
+  X(getpid) X(open) X(creat) X(close) X(read) X(write) X(stat) \
+  X(fstat) X(lseek) X(pread) X(pwrite) X(lstat) X(dup) X(dup2) \
+  X(fcntl) X(fsync) X(ftruncate) X(mmap) X(munmap) X(fopen) X(fclose) X(fdopen) \
+  X(freopen) X(tmpfile) X(malloc) X(calloc) \
+  X(realloc) X(strdup) X(strndup) X(aligned_alloc) X(posix_memalign) \
+  X(reallocarray) X(pthread_mutex_lock) X(pthread_mutex_trylock) \
+  X(pthread_mutex_unlock) X(pthread_mutex_init) X(pthread_mutex_destroy) \
+  X(sleep) X(pthread_create) X(pthread_join) X(pthread_exit) \
+  X(pthread_cond_wait) X(pthread_cond_signal) X(pthread_cond_broadcast)
+
+// the merge adds the numbers of calls, at the start of each entry
+#define STATS_CHECK(f) \
+  _Static_assert(offsetof(struct wrap_stats_t, f.called)==offsetof(struct wrap_stats_t, f) \
+                 && __builtin_types_compatible_p(__typeof__(stats.f.called), int), \
+                 "the statistics of " #f " must start with int called");
+STATS_FUNCTIONS(STATS_CHECK)
+STATS_CHECK(free)
+
+#define STATS_ENTRY(f) { offsetof(struct wrap_stats_t, f), sizeof(stats.f) },
+
+static const struct stats_entry_t stats_entries[] = {
+  STATS_FUNCTIONS(STATS_ENTRY)
+  // up to the counters of errors, which are shared
+  { offsetof(struct wrap_stats_t, free), offsetof(struct stats_free_t, double_free) },
+};
+
+static struct stats_shard_t main_shard = { .stats = &stats };
+static struct stats_shard_t *shards;  // shards of the other threads
+static bool stats_threaded;           // other threads called the wrappers
+static uint64_t stats_clock;          // order of the calls
+static pthread_key_t shard_key;       // releases the shard of an exiting thread
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+pthread_t sandbox_thread;
+static __thread struct stats_shard_t *thread_shard;
+
+void stats_sandbox_thread() {
+  sandbox_thread=pthread_self();
+  thread_shard=&main_shard;
+}
+
+static void stats_release_shard(void *shard) {
+  __atomic_store_n(&((struct stats_shard_t *) shard)->used, false, __ATOMIC_RELEASE);
+}
+
+static void stats_shard_key() {
+  pthread_key_create(&shard_key, stats_release_shard);
+}
+
+static struct stats_shard_t *stats_new_shard() {
+  pthread_once(&shard_once, stats_shard_key);
+  struct stats_shard_t *shard=__atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+  for(;shard!=NULL;shard=shard->next) {
+    bool used=false;
+    if(__atomic_compare_exchange_n(&shard->used, &used, true, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      pthread_setspecific(shard_key, shard);
+      return shard;
+    }
+  }
+  shard=__real_calloc(1, sizeof(struct stats_shard_t));
+  if(shard==NULL)
+    return &main_shard;
+  shard->stats=&shard->local;
+  shard->used=true;
+  pthread_setspecific(shard_key, shard);
+  shard->next=__atomic_load_n(&shards, __ATOMIC_RELAXED);
+  while(!__atomic_compare_exchange_n(&shards, &shard->next, shard, true,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  return shard;
+}
+
+struct wrap_stats_t *stats_shard(size_t offset) {
+  struct stats_shard_t *shard=thread_shard;
+  if(shard==NULL) {
+    if(pthread_equal(pthread_self(), sandbox_thread))
+      shard=&main_shard;
+    else
+      shard=stats_new_shard();
+    thread_shard=shard;
+  }
+  if(shard!=&main_shard && !__atomic_load_n(&stats_threaded, __ATOMIC_RELAXED))
+    __atomic_store_n(&stats_threaded, true, __ATOMIC_RELAXED);
+  if(__atomic_load_n(&stats_threaded, __ATOMIC_RELAXED))
+    shard->last_call[offset/sizeof(int)]=__atomic_add_fetch(&stats_clock, 1, __ATOMIC_RELAXED);
+  return shard->stats;
+}
+
+void stats_merge() {
+  struct stats_shard_t *shard=__atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+  for(;shard!=NULL;shard=shard->next) {
+    for(size_t i=0;i<sizeof(stats_entries)/sizeof(stats_entries[0]);i++) {
+      const struct stats_entry_t *e=&stats_entries[i];
+      char *from=(char *) &shard->local+e->offset;
+      char *to=(char *) &stats+e->offset;
+      size_t slot=e->offset/sizeof(int);
+      // every entry starts with the number of calls
+      *(int *) to+=*(int *) from;
+      if(shard->last_call[slot]>main_shard.last_call[slot]) {
+        memcpy(to+sizeof(int), from+sizeof(int), e->size-sizeof(int));
+        main_shard.last_call[slot]=shard->last_call[slot];
+      }
+      memset(from, 0, e->size);
+      shard->last_call[slot]=0;
+    }
+  }
+  __atomic_store_n(&stats_threaded, false, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,644 @@
+/*
+ * Wrappers for the creation of threads and the condition variables, and
+ * deterministic scheduler of the threads of the sandbox
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "wrap.h"
+
+#include <libintl.h>
+#define _(STRING) gettext(STRING)
+
+int __real_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                          void *(*start)(void *), void *arg);
+int __real_pthread_join(pthread_t thread, void **retval);
+void __real_pthread_exit(void *retval) __attribute__((noreturn));
+int __real_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int __real_pthread_cond_signal(pthread_cond_t *cond);
+int __real_pthread_cond_broadcast(pthread_cond_t *cond);
+int __real_pthread_mutex_lock(pthread_mutex_t *mutex);
+int __real_pthread_mutex_trylock(pthread_mutex_t *mutex);
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+
+extern bool wrap_monitoring;
+extern struct wrap_stats_t stats;
+extern struct wrap_monitor_t monitored;
+extern struct schedule_t schedule;
+
+//
+// The scheduler serializes the threads created in the sandbox: a thread
+// only runs when it holds the baton, given by sched_turn. At each
+// synchronization point, the running thread may give the baton to
+// another runnable thread, chosen at random (a preemption, at most
+// schedule.preemptions of them). A thread which blocks on a mutex, a
+// condition variable or a join gives the baton to a random runnable
+// thread, and becomes runnable again when the mutex is unlocked, the
+// condition signalled or the thread done. The same seed thus replays
+// the same interleaving. If no thread is runnable, they are deadlocked.
+// With schedule.systematic, the choices are not random: the sandboxes
+// explore the tree of the interleavings depth first, as a stateless
+// model checker. The trail records the choices of a sandbox and their
+// number, the next sandbox replays it up to its last choice which has
+// alternatives, and takes the next alternative there. The preemption
+// bound keeps the tree small; at a synchronization point, the first
+// alternative is to continue the running thread.
+// The scheduler state is only modified by the thread holding the baton.
+// The threads of a previous sandbox, which may still be waiting when
+// the next one begins, never match sched_turn as it includes the sandbox.
+//
+
+#define SCHED_THREADS_MAX 64
+#define SCHED_TRAIL_MAX 4096  // choices explored systematically in a sandbox
+
+enum sched_state_t {
+  SCHED_RUNNABLE,
+  SCHED_MUTEX,  // waiting for the mutex wait to be unlocked
+  SCHED_COND,   // waiting for the condition variable wait
+  SCHED_JOIN,   // waiting for the thread wait to be done
+  SCHED_DONE,
+};
+
+struct sched_thread_t {
+  enum sched_state_t state;
+  void *wait;
+  pthread_t thread;
+};
+
+static struct {
+  bool active;
+  unsigned int gen;  // sandbox of the threads, to recognize them
+  int threads;
+  int preemptions;   // preemptions left, -1 for no limit
+  uint64_t random;
+  int choices;       // choices made in the sandbox
+  struct sched_thread_t thread[SCHED_THREADS_MAX];
+} sched;
+
+// choices of the last sandbox of the systematic exploration, kept
+// between the sandboxes
+static struct {
+  int n;
+  unsigned short choice[SCHED_TRAIL_MAX];
+  unsigned short count[SCHED_TRAIL_MAX];  // alternatives of the choice
+} sched_trail;
+
+// sandbox and thread holding the baton, waited for with a futex
+static uint32_t sched_turn;
+
+static __thread unsigned int sched_self_gen;
+static __thread int sched_self;
+
+bool sched_running() {
+  return __atomic_load_n(&sched.active, __ATOMIC_ACQUIRE) && sched_self_gen==sched.gen;
+}
+
+// xorshift64*
+static uint64_t sched_random() {
+  sched.random^=sched.random >> 12;
+  sched.random^=sched.random << 25;
+  sched.random^=sched.random >> 27;
+  return sched.random * 0x2545F4914F6CDD1DULL;
+}
+
+// one of n alternatives, at random or as given by the trail. A choice
+// with a different number of alternatives than in the trail, when the
+// student's code is not deterministic, takes the first one.
+static int sched_choose(int n) {
+  if(!schedule.systematic)
+    return sched_random() % n;
+  if(n==1)
+    return 0;
+  int c=sched.choices++;
+  if(c>=SCHED_TRAIL_MAX)
+    return 0;
+  if(c>=sched_trail.n) {
+    sched_trail.choice[c]=0;
+    sched_trail.count[c]=n;
+    sched_trail.n=c+1;
+  }
+  return sched_trail.count[c]==n ? sched_trail.choice[c] : 0;
+}
+
+// next interleaving of the systematic exploration, after a sandbox
+static void sched_trail_next() {
+  int n=sched.choices<sched_trail.n ? sched.choices : sched_trail.n;
+  while(n>0 && sched_trail.choice[n-1]+1>=sched_trail.count[n-1])
+    n--;
+  sched_trail.n=n;
+  if(n==0)
+    schedule.exhausted=true;
+  else
+    sched_trail.choice[n-1]++;
+}
+
+// runnable thread, -1 if none. If self is runnable, it is the first
+// alternative of a systematic choice.
+static int sched_pick(int self) {
+  int runnable[SCHED_THREADS_MAX];
+  int n=0;
+  for(int i=0;i<sched.threads;i++) {
+    if(sched.thread[i].state==SCHED_RUNNABLE)
+      runnable[n++]=i;
+  }
+  if(n==0)
+    return -1;
+  if(schedule.systematic && self>=0) {
+    for(int i=1;i<n;i++) {
+      if(runnable[i]==self) {
+        runnable[i]=runnable[0];
+        runnable[0]=self;
+      }
+    }
+  }
+  return runnable[sched_choose(n)];
+}
+
+static uint32_t sched_turn_of(int thread) {
+  return (sched.gen << 8) | thread;
+}
+
+static void sched_give(uint32_t turn) {
+  __atomic_store_n(&sched_turn, turn, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &sched_turn, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// waits for the baton, or for the end of the sandbox
+static void sched_wait() {
+  for(;;) {
+    uint32_t turn=__atomic_load_n(&sched_turn, __ATOMIC_ACQUIRE);
+    if(!sched_running() || turn==sched_turn_of(sched_self))
+      return;
+    syscall(SYS_futex, &sched_turn, FUTEX_WAIT_PRIVATE, turn, NULL, NULL, 0);
+  }
+}
+
+static void sched_switch(int next) {
+  schedule.switches++;
+  sched_give(sched_turn_of(next));
+  sched_wait();
+}
+
+// no thread can run. The sandbox thread leaves the sandbox, the other
+// ones wait for its end and then continue without the scheduler.
+static void sched_deadlock() {
+  sandbox_deadlock(_("Deadlock: all the threads are blocked."));
+  sched_wait();
+}
+
+static void sched_block(enum sched_state_t state, void *wait) {
+  sched.thread[sched_self].state=state;
+  sched.thread[sched_self].wait=wait;
+  int next=sched_pick(-1);
+  if(next<0)
+    sched_deadlock();
+  else
+    sched_switch(next);
+}
+
+// wakes up the threads blocked on wait
+static int sched_wake(enum sched_state_t state, void *wait, bool all) {
+  int waiting[SCHED_THREADS_MAX];
+  int n=0;
+  for(int i=0;i<sched.threads;i++) {
+    if(sched.thread[i].state==state && sched.thread[i].wait==wait)
+      waiting[n++]=i;
+  }
+  if(n>0 && !all) {
+    waiting[0]=waiting[sched_choose(n)];
+    n=1;
+  }
+  for(int i=0;i<n;i++)
+    sched.thread[waiting[i]].state=SCHED_RUNNABLE;
+  return n;
+}
+
+void sched_point() {
+  if(!sched_running() || sched.preemptions==0)
+    return;
+  int next=sched_pick(sched_self);
+  if(next<0 || next==sched_self)
+    return;
+  if(sched.preemptions>0)
+    sched.preemptions--;
+  sched_switch(next);
+}
+
+int sched_mutex_lock(pthread_mutex_t *mutex) {
+  while(sched_running()) {
+    sched_block(SCHED_MUTEX, mutex);
+    if(!sched_running())
+      break;
+    int ret=__real_pthread_mutex_trylock(mutex);
+    if(ret!=EBUSY)
+      return ret;
+  }
+  return __real_pthread_mutex_lock(mutex);
+}
+
+void sched_mutex_unlocked(pthread_mutex_t *mutex) {
+  if(sched_running())
+    sched_wake(SCHED_MUTEX, mutex, true);
+}
+
+void sched_begin() {
+  if(!schedule.enabled)
+    return;
+  uint64_t seed=schedule.seed;
+  if(seed==0) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    seed=((uint64_t) now.tv_sec*1000000000+now.tv_nsec) | 1;
+  }
+  schedule.last_seed=seed;
+  schedule.switches=0;
+  if(schedule.systematic && (schedule.runs==0 || schedule.exhausted)) {
+    sched_trail.n=0;
+    schedule.runs=0;
+    schedule.exhausted=false;
+  }
+  if(schedule.systematic)
+    schedule.runs++;
+  sched.choices=0;
+  sched.random=seed;
+  sched.preemptions=schedule.preemptions;
+  sched.gen++;
+  sched.threads=1;
+  sched.thread[0].state=SCHED_RUNNABLE;
+  sched.thread[0].thread=pthread_self();
+  sched_self=0;
+  sched_self_gen=sched.gen;
+  __atomic_store_n(&sched_turn, sched_turn_of(0), __ATOMIC_RELAXED);
+  __atomic_store_n(&sched.active, true, __ATOMIC_RELEASE);
+}
+
+// the threads still blocked continue without the scheduler
+void sched_end() {
+  if(!__atomic_load_n(&sched.active, __ATOMIC_ACQUIRE))
+    return;
+  __atomic_store_n(&sched.active, false, __ATOMIC_RELEASE);
+  sched_give(sched_turn_of(0xff));
+  if(schedule.systematic)
+    sched_trail_next();
+}
+
+// the thread is done, also after pthread_exit or a cancellation
+static void sched_thread_done(void *unused) {
+  if(!sched_running())
+    return;
+  sched.thread[sched_self].state=SCHED_DONE;
+  sched_wake(SCHED_JOIN, &sched.thread[sched_self], true);
+  int next=sched_pick(-1);
+  if(next>=0) {
+    schedule.switches++;
+    sched_give(sched_turn_of(next));
+    return;
+  }
+  for(int i=0;i<sched.threads;i++) {
+    if(sched.thread[i].state!=SCHED_DONE) {
+      sandbox_deadlock(_("Deadlock: all the threads are blocked."));
+      return;
+    }
+  }
+}
+
+static void *sched_thread_run(int id, void *(*start)(void *), void *arg) {
+  sched_self=id;
+  sched_self_gen=sched.gen;
+  sched_wait();
+  void *ret;
+  pthread_cleanup_push(sched_thread_done, NULL);
+  ret=start(arg);
+  pthread_cleanup_pop(1);
+  return ret;
+}
+
+//
+// Every thread created in the sandbox is registered, so that sandbox_end
+// can wait THREADS_REAP_MS for the ones still running. A thread cannot
+// be stopped safely from outside: cancelling or unwinding it may leave
+// a lock of the libc or of CTester held. The threads still running are
+// left alone with the lowest priority (SCHED_IDLE), so that they only
+// use the CPU not used by the tests, and the remaining tests run in
+// forked children, which do not inherit them (see run_tests_serial).
+// The signals of the sandbox are handled by the thread running it:
+// SIGALRM is blocked in the registered threads, and a segfault in one of
+// them is reported to the sandbox thread before it terminates. Each
+// registered thread has an alternate signal stack, to report its stack
+// overflows. It is allocated apart from the stack of the thread, and
+// freed by threads_reap once the thread is done: the stacks of the
+// threads left running are never freed.
+//
+
+#define THREADS_MAX 256
+#define THREADS_REAP_MS 100
+
+struct thread_entry_t {
+  pthread_t thread;
+  bool created;  // thread is valid
+  bool done;
+  int sched;     // thread of the scheduler, -1 if not scheduled
+  void *(*start)(void *);
+  void *arg;
+  void *altstack;  // alternate signal stack, of thread_altstack_size() bytes
+};
+
+static struct {
+  unsigned int gen;  // sandbox of the threads
+  int n;
+  int stray;         // threads left running by the previous sandboxes
+  struct thread_entry_t thread[THREADS_MAX];
+} threads;
+
+static __thread struct thread_entry_t *thread_self;
+static __thread unsigned int thread_self_gen;
+
+bool thread_sandboxed() {
+  return thread_self!=NULL;
+}
+
+void thread_exit() {
+  __real_pthread_exit(PTHREAD_CANCELED);
+}
+
+// SIGSTKSZ is not a constant with recent versions of glibc
+static size_t thread_altstack_size() {
+  long size=sysconf(_SC_SIGSTKSZ);
+  return size > 0 ? (size_t) size : 64*1024;
+}
+
+// the thread is done, also after pthread_exit. Once the handler of a
+// segfault has called pthread_exit, the cleanup runs on the stack of the
+// thread, and the alternate stack is not used anymore.
+static void thread_done(void *unused) {
+  stack_t ss = { .ss_flags=SS_DISABLE };
+  sigaltstack(&ss, NULL);
+  if(thread_self_gen==__atomic_load_n(&threads.gen, __ATOMIC_ACQUIRE))
+    __atomic_store_n(&thread_self->done, true, __ATOMIC_RELEASE);
+}
+
+static void *thread_start(void *arg) {
+  struct thread_entry_t *t=arg;
+  thread_self=t;
+  thread_self_gen=threads.gen;
+  sigset_t alarm;
+  sigemptyset(&alarm);
+  sigaddset(&alarm, SIGALRM);
+  pthread_sigmask(SIG_BLOCK, &alarm, NULL);
+  if(t->altstack!=NULL) {
+    stack_t ss = { .ss_sp=t->altstack, .ss_size=thread_altstack_size() };
+    sigaltstack(&ss, NULL);
+  }
+  void *ret;
+  pthread_cleanup_push(thread_done, NULL);
+  if(t->sched>=0)
+    ret=sched_thread_run(t->sched, t->start, t->arg);
+  else
+    ret=t->start(t->arg);
+  pthread_cleanup_pop(1);
+  return ret;
+}
+
+void threads_begin() {
+  __atomic_store_n(&threads.n, 0, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&threads.gen, 1, __ATOMIC_RELEASE);
+}
+
+// waits until the registered threads are done, false after THREADS_REAP_MS
+static bool threads_wait(int n) {
+  struct timespec tick = { .tv_nsec=1000000 };
+  for(int ms=0;ms<THREADS_REAP_MS;ms++) {
+    bool done=true;
+    for(int i=0;i<n && done;i++) {
+      struct thread_entry_t *t=&threads.thread[i];
+      done=!t->created || __atomic_load_n(&t->done, __ATOMIC_ACQUIRE);
+    }
+    if(done)
+      return true;
+    nanosleep(&tick, NULL);
+  }
+  return false;
+}
+
+int threads_alive() {
+  int n=__atomic_load_n(&threads.n, __ATOMIC_ACQUIRE);
+  if(n>THREADS_MAX)
+    n=THREADS_MAX;
+  int alive=0;
+  for(int i=0;i<n;i++) {
+    struct thread_entry_t *t=&threads.thread[i];
+    if(t->created && !__atomic_load_n(&t->done, __ATOMIC_ACQUIRE))
+      alive++;
+  }
+  return alive;
+}
+
+// frees the alternate stacks of the n first registered threads, which
+// are done
+static void threads_free_altstacks(int n) {
+  for(int i=0;i<n;i++) {
+    __real_free(threads.thread[i].altstack);
+    threads.thread[i].altstack=NULL;
+  }
+}
+
+int threads_reap() {
+  int n=__atomic_load_n(&threads.n, __ATOMIC_ACQUIRE);
+  if(n>THREADS_MAX)
+    n=THREADS_MAX;
+  if(threads_wait(n)) {
+    threads_free_altstacks(n);
+    return 0;
+  }
+  struct sched_param param = { .sched_priority=0 };
+  int leaked=0;
+  for(int i=0;i<n;i++) {
+    struct thread_entry_t *t=&threads.thread[i];
+    if(t->created && !__atomic_load_n(&t->done, __ATOMIC_ACQUIRE)) {
+      pthread_setschedparam(t->thread, SCHED_IDLE, &param);
+      // the thread keeps its alternate stack
+      t->altstack=NULL;
+      leaked++;
+    }
+  }
+  threads_free_altstacks(n);
+  threads.stray+=leaked;
+  return leaked;
+}
+
+bool threads_stray() {
+  return threads.stray > 0;
+}
+
+int __wrap_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                          void *(*start)(void *), void *arg) {
+  if(!wrap_monitoring) {
+    return __real_pthread_create(thread, attr, start, arg);
+  }
+  struct wrap_stats_t *shard=NULL;
+  if(monitored.pthread_create) {
+    shard=STATS_SHARD(pthread_create);
+    shard->pthread_create.called++;
+    shard->pthread_create.last_arg=thread;
+  }
+  int ret;
+  int id=__atomic_fetch_add(&threads.n, 1, __ATOMIC_ACQ_REL);
+  if(id<THREADS_MAX) {
+    struct thread_entry_t *t=&threads.thread[id];
+    t->created=false;
+    t->done=false;
+    t->sched=-1;
+    t->start=start;
+    t->arg=arg;
+    t->altstack=__real_malloc(thread_altstack_size());
+    if(sched_running() && sched.threads<SCHED_THREADS_MAX) {
+      t->sched=sched.threads++;
+      sched.thread[t->sched].state=SCHED_RUNNABLE;
+      sched.thread[t->sched].wait=NULL;
+    }
+    ret=__real_pthread_create(&t->thread, attr, thread_start, t);
+    if(ret==0) {
+      *thread=t->thread;
+      if(t->sched>=0)
+        sched.thread[t->sched].thread=t->thread;
+      __atomic_store_n(&t->created, true, __ATOMIC_RELEASE);
+      __atomic_add_fetch(&stats.threads.created, 1, __ATOMIC_RELAXED);
+    } else {
+      __real_free(t->altstack);
+      t->altstack=NULL;
+      if(t->sched>=0)
+        sched.thread[t->sched].state=SCHED_DONE;
+    }
+  } else {
+    ret=__real_pthread_create(thread, attr, start, arg);
+  }
+  if(shard!=NULL)
+    shard->pthread_create.last_return=ret;
+  sched_point();
+  return ret;
+}
+
+int __wrap_pthread_join(pthread_t thread, void **retval) {
+  if(!wrap_monitoring || (!monitored.pthread_join && !sched_running())) {
+    return __real_pthread_join(thread, retval);
+  }
+  struct wrap_stats_t *shard=NULL;
+  if(monitored.pthread_join) {
+    shard=STATS_SHARD(pthread_join);
+    shard->pthread_join.called++;
+    shard->pthread_join.last_arg=thread;
+  }
+  if(sched_running()) {
+    for(int i=1;i<sched.threads;i++) {
+      if(pthread_equal(sched.thread[i].thread, thread)) {
+        while(sched_running() && sched.thread[i].state!=SCHED_DONE)
+          sched_block(SCHED_JOIN, &sched.thread[i]);
+        break;
+      }
+    }
+  }
+  int ret=__real_pthread_join(thread, retval);
+  if(shard!=NULL)
+    shard->pthread_join.last_return=ret;
+  return ret;
+}
+
+void __wrap_pthread_exit(void *retval) {
+  if(wrap_monitoring && monitored.pthread_exit) {
+    struct wrap_stats_t *shard=STATS_SHARD(pthread_exit);
+    shard->pthread_exit.called++;
+    shard->pthread_exit.last_arg=retval;
+  }
+  __real_pthread_exit(retval);
+}
+
+int __wrap_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+  if(!wrap_monitoring || (!monitored.pthread_cond_wait && !sched_running()
+                          && !monitored.pthread_mutex_profile && !monitored.pthread_mutex_deadlock)) {
+    return __real_pthread_cond_wait(cond, mutex);
+  }
+  struct wrap_stats_t *shard=NULL;
+  if(monitored.pthread_cond_wait) {
+    shard=STATS_SHARD(pthread_cond_wait);
+    shard->pthread_cond_wait.called++;
+    shard->pthread_cond_wait.last_arg=cond;
+  }
+  int ret;
+  if(sched_running()) {
+    // only this thread runs, so unlocking and waiting are atomic
+    wrap_mutex_release(mutex);
+    sched_block(SCHED_COND, cond);
+    ret=wrap_mutex_acquire(mutex);
+  } else {
+    // the time spent waiting is not held time
+    wrap_mutex_suspend(mutex);
+    ret=__real_pthread_cond_wait(cond, mutex);
+    wrap_mutex_resume(mutex);
+  }
+  if(shard!=NULL)
+    shard->pthread_cond_wait.last_return=ret;
+  return ret;
+}
+
+int __wrap_pthread_cond_signal(pthread_cond_t *cond) {
+  if(!wrap_monitoring || (!monitored.pthread_cond_signal && !sched_running())) {
+    return __real_pthread_cond_signal(cond);
+  }
+  struct wrap_stats_t *shard=NULL;
+  if(monitored.pthread_cond_signal) {
+    shard=STATS_SHARD(pthread_cond_signal);
+    shard->pthread_cond_signal.called++;
+    shard->pthread_cond_signal.last_arg=cond;
+  }
+  int ret=0;
+  // the threads which are not scheduled wait on the real condition
+  if(!sched_running() || sched_wake(SCHED_COND, cond, false)==0)
+    ret=__real_pthread_cond_signal(cond);
+  if(shard!=NULL)
+    shard->pthread_cond_signal.last_return=ret;
+  sched_point();
+  return ret;
+}
+
+int __wrap_pthread_cond_broadcast(pthread_cond_t *cond) {
+  if(!wrap_monitoring || (!monitored.pthread_cond_broadcast && !sched_running())) {
+    return __real_pthread_cond_broadcast(cond);
+  }
+  struct wrap_stats_t *shard=NULL;
+  if(monitored.pthread_cond_broadcast) {
+    shard=STATS_SHARD(pthread_cond_broadcast);
+    shard->pthread_cond_broadcast.called++;
+    shard->pthread_cond_broadcast.last_arg=cond;
+  }
+  if(sched_running())
+    sched_wake(SCHED_COND, cond, true);
+  int ret=__real_pthread_cond_broadcast(cond);
+  if(shard!=NULL)
+    shard->pthread_cond_broadcast.last_return=ret;
+  sched_point();
+  return ret;
+}
@@ -0,0 +1,83 @@
+// never remove statistics from this structure, they could be
+// used by existing exercices. You might add some additional information
+// if it can help to validate some exercices
+#include <sys/types.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct stats_pthread_create_t {
+  int called;           // number of times the system call has been called
+  int last_return;      // last return value
+  pthread_t *last_arg;  // last thread passed as argument
+};
+
+struct stats_pthread_join_t {
+  int called;           // number of times the system call has been called
+  int last_return;      // last return value
+  pthread_t last_arg;   // last thread passed as argument
+};
+
+struct stats_pthread_exit_t {
+  int called;           // number of times the system call has been called
+  void *last_arg;       // last return value of the thread
+};
+
+// threads created by the student's code
+struct stats_threads_t {
+  int created;          // number of threads created in the sandboxes
+  int leaked;           // number of them still running at the end of a sandbox
+};
+
+struct stats_pthread_cond_t {
+  int called;           // number of times the system call has been called
+  int last_return;      // last return value
+  pthread_cond_t *last_arg; // last condition variable passed as argument
+};
+
+// Deterministic scheduling of the threads created in the sandbox, see
+// wrap_thread.c. When enabled, the threads run one at a time and only
+// switch at the calls to the mutex, condition variable, pthread_create
+// and pthread_join functions. The choices are random, from seed, with
+// at most preemptions switches from a thread that could continue. With
+// systematic, each sandbox runs the next interleaving instead, until
+// all of them have been run.
+
+struct schedule_t {
+  bool enabled;       // serialize the threads of the next sandboxes
+  uint64_t seed;      // seed of the schedule, 0 for a new one at each sandbox
+  int preemptions;    // maximal number of preemptions, -1 for no limit
+  uint64_t last_seed; // seed of the last sandbox, to replay its schedule
+  int switches;       // number of context switches in the last sandbox
+  bool systematic;    // explore the interleavings in order, instead of at random
+  int runs;           // systematic: number of the interleaving of the last sandbox, from 1
+  bool exhausted;     // systematic: the last sandbox ran the last interleaving
+};
+
+// true if the calling thread is run by the scheduler
+bool sched_running();
+// possible context switch, in a thread run by the scheduler
+void sched_point();
+// locks a mutex found locked, with the scheduler
+int sched_mutex_lock(pthread_mutex_t *mutex);
+// wakes up the threads waiting for mutex
+void sched_mutex_unlocked(pthread_mutex_t *mutex);
+// called by sandbox_begin and sandbox_end
+void sched_begin();
+void sched_end();
+
+// true if the calling thread was created in a sandbox
+bool thread_sandboxed();
+// terminates the calling thread, created in a sandbox
+void thread_exit() __attribute__((noreturn));
+// called by sandbox_begin
+void threads_begin();
+// number of threads of the sandbox still running
+int threads_alive();
+// waits for the threads of the sandbox still running, and returns the
+// number of those which did not end, called by sandbox_end
+int threads_reap();
+// true if threads of previous sandboxes are still running: the process
+// cannot run more tests safely
+bool threads_stray();